@@ -21,40 +21,62 @@ static void std_free(void* ptr, void* ctx)
     free(ptr);
 }
 
+static void* std_realloc(void*     ptr,
+                         ptrdiff_t old_size,
+                         ptrdiff_t new_size,
+                         void*     ctx)
+{
+    (void) old_size;
+    (void) ctx;
+    return realloc(ptr, new_size);
+}
+
 int main(void)
 {
     allocator std_alloc = {
-        .malloc = std_malloc,
-        .free   = std_free,
-        .ctx    = NULL
+        .malloc  = std_malloc,
+        .free    = std_free,
+        .realloc = std_realloc,
+        .ctx     = NULL
     };
 
     // Paths must be relative to the build directory where the executable is run.
-    const char* vert_path = "../resources/shaders/shadervs.vert";
-    const char* frag_path = "../resources/shaders/shaderfs.frag";
-
-    const char* vert_spv_path = "../resources/shaders/shadervs.spv";
-    const char* frag_spv_path = "../resources/shaders/shaderfs.spv";
+    shader_job_t jobs[] = {
+        { .glsl_path  = "../resources/shaders/shadervs.vert",
+          .spirv_path = "../resources/shaders/shadervs.spv",
+          .type       = VERTEX_SHADER },
+        { .glsl_path  = "../resources/shaders/shaderfs.frag",
+          .spirv_path = "../resources/shaders/shaderfs.spv",
+          .type       = FRAGMENT_SHADER },
+    };
+    const size_t job_count = sizeof(jobs) / sizeof(jobs[0]);
 
-    // --- Compile Vertex Shader ---
-    printf("--- Compiling Vertex Shader ---\n");
-    glsl_to_spirv(&std_alloc, vert_path, vert_spv_path, VERTEX_SHADER);
+    // Unchanged shaders are served from the cache on later runs
+    shader_cache_t cache;
+    shader_cache_t* cache_ptr = shader_cache_init(&cache, "shader_cache") ? &cache : NULL;
 
-    if (file_exists(vert_spv_path)) {
-        printf("SUCCESS: '%s' was created.\n", vert_spv_path);
-    } else {
-        printf("FAILURE: '%s' was not created.\n", vert_spv_path);
+    // Shared GLSL is pulled in with #include, <...> is searched in the shader folder
+    shader_include_cache_t includes;
+    if (!shader_include_cache_init(&includes, &std_alloc, "../resources/shaders")) {
+        fprintf(stderr, "Failed to create the include cache\n");
+        return 1;
     }
 
-    // --- Compile Fragment Shader ---
-    printf("\n--- Compiling Fragment Shader ---\n");
-    glsl_to_spirv(&std_alloc, frag_path, frag_spv_path, FRAGMENT_SHADER);
+    // --- Compile all shaders in parallel, one compiler per worker thread ---
+    printf("--- Compiling %zu shaders ---\n", job_count);
+    size_t failed = compile_shader_batch(jobs, job_count, 0, cache_ptr, &includes);
 
-    if (file_exists(frag_spv_path)) {
-        printf("SUCCESS: '%s' was created.\n", frag_spv_path);
-    } else {
-        printf("FAILURE: '%s' was not created.\n", frag_spv_path);
+    for (size_t i = 0; i < job_count; i++) {
+        if (jobs[i].ok && file_exists(jobs[i].spirv_path)) {
+            printf("SUCCESS: '%s' was created in %.2f ms%s.\n",
+                   jobs[i].spirv_path,
+                   jobs[i].milliseconds,
+                   jobs[i].cache_hit ? " (cached)" : "");
+        } else {
+            printf("FAILURE: '%s' was not created: %s\n", jobs[i].spirv_path, jobs[i].error);
+        }
     }
 
-    return 0;
+    shader_include_cache_release(&includes);
+    return failed == 0 ? 0 : 1;
 } 
\ No newline at end of file
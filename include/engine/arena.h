@@ -0,0 +1,177 @@
+//
+// Linear (bump-pointer) arena behind the prelude `allocator` interface.
+//
+// An arena owns one contiguous block taken from a backing allocator. Every
+// allocation is a pointer bump, `free` is a no-op, and memory is given back
+// all at once with arena_reset or partially by restoring a saved mark.
+//
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "prelude.h"
+
+#define ARENA_DEFAULT_ALIGN alignof(max_align_t)
+
+typedef struct
+{
+    allocator* backing;
+    char*      base;
+    size_t     cap;
+    size_t     used;
+    size_t     peak;  // high-water mark, handy for sizing the arena
+} arena_t;
+
+// Position inside an arena, restore it to drop everything allocated after
+typedef struct
+{
+    size_t used;
+} arena_mark_t;
+
+bool arena_init(arena_t* arena, allocator* backing, size_t cap)
+{
+    *arena = (arena_t) { .backing = backing };
+
+    arena->base = backing->malloc((ptrdiff_t) cap, backing->ctx);
+    if (!arena->base)
+    {
+        return false;
+    }
+
+    arena->cap = cap;
+    return true;
+}
+
+void arena_release(arena_t* arena)
+{
+    if (arena->base)
+    {
+        arena->backing->free(arena->base, arena->backing->ctx);
+    }
+
+    *arena = (arena_t) { 0 };
+}
+
+// align must be a power of two
+void* arena_push(arena_t* arena, size_t size, size_t align)
+{
+    uintptr_t base    = (uintptr_t) arena->base;
+    uintptr_t current = base + arena->used;
+    uintptr_t aligned = (current + (align - 1)) & ~(uintptr_t) (align - 1);
+
+    size_t offset = aligned - base;
+    if (offset > arena->cap || size > arena->cap - offset)
+    {
+        return NULL;
+    }
+
+    arena->used = offset + size;
+    if (arena->used > arena->peak)
+    {
+        arena->peak = arena->used;
+    }
+
+    return arena->base + offset;
+}
+
+void arena_reset(arena_t* arena)
+{
+    arena->used = 0;
+}
+
+arena_mark_t arena_save(const arena_t* arena)
+{
+    return (arena_mark_t) { .used = arena->used };
+}
+
+void arena_restore(arena_t* arena, arena_mark_t mark)
+{
+    if (mark.used <= arena->used)
+    {
+        arena->used = mark.used;
+    }
+}
+
+static void* arena__malloc(ptrdiff_t size, void* ctx)
+{
+    if (size < 0)
+    {
+        return NULL;
+    }
+
+    return arena_push((arena_t*) ctx, (size_t) size, ARENA_DEFAULT_ALIGN);
+}
+
+static void arena__free(void* ptr, void* ctx)
+{
+    // individual frees are a no-op, memory comes back on reset/restore
+    (void) ptr;
+    (void) ctx;
+}
+
+// The most recent allocation is resized in place, anything else is copied
+static void* arena__realloc(void*     ptr,
+                            ptrdiff_t old_size,
+                            ptrdiff_t new_size,
+                            void*     ctx)
+{
+    arena_t* arena = ctx;
+    if (!ptr)
+    {
+        return arena__malloc(new_size, ctx);
+    }
+
+    if (old_size < 0 || new_size < 0)
+    {
+        return NULL;
+    }
+
+    char* top = arena->base + arena->used;
+    if ((char*) ptr + old_size == top)
+    {
+        size_t offset = (size_t) ((char*) ptr - arena->base);
+        if ((size_t) new_size > arena->cap - offset)
+        {
+            return NULL;
+        }
+
+        arena->used = offset + (size_t) new_size;
+        if (arena->used > arena->peak)
+        {
+            arena->peak = arena->used;
+        }
+
+        return ptr;
+    }
+
+    if (new_size <= old_size)
+    {
+        return ptr;
+    }
+
+    void* new_ptr = arena__malloc(new_size, ctx);
+    if (new_ptr)
+    {
+        memcpy(new_ptr, ptr, (size_t) old_size);
+    }
+
+    return new_ptr;
+}
+
+// The returned allocator points at `arena`, it must not outlive it
+allocator arena_allocator(arena_t* arena)
+{
+    return (allocator) {
+        .malloc  = arena__malloc,
+        .free    = arena__free,
+        .realloc = arena__realloc,
+        .ctx     = arena,
+    };
+}
+
+#endif  // ARENA_H
@@ -0,0 +1,770 @@
+//
+// Asynchronous batched file I/O.
+//
+// Requests are submitted in batches and complete in the background, opening
+// the file included. On Linux the queue drives an io_uring instance directly
+// through the raw syscalls (openat, then read/write), when io_uring is
+// unavailable (old kernel, seccomp, containers) it falls back to a small pool
+// of worker threads doing open and pread/pwrite.
+//
+// Completion callbacks always run on the thread that calls io_queue_poll or
+// io_queue_wait, never on a worker, so they may touch engine state freely.
+// A request can also be used as a future: check `done` or wait on it.
+//
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "prelude.h"
+
+#ifndef IO_QUEUE_DEPTH
+#define IO_QUEUE_DEPTH 64
+#endif
+
+#ifndef IO_MAX_WORKERS
+#define IO_MAX_WORKERS 4
+#endif
+
+typedef enum
+{
+    IO_OP_READ,
+    IO_OP_WRITE
+} io_op_t;
+
+typedef enum
+{
+    IO_BACKEND_AUTO,
+    IO_BACKEND_IO_URING,
+    IO_BACKEND_THREADS
+} io_backend_t;
+
+typedef struct io_request_t io_request_t;
+typedef void (*io_callback_t)(io_request_t* request, void* user_data);
+
+// Must stay alive and unmoved until `done` is set, and so must `path`.
+//
+// Reads with a NULL buffer get one sized to the whole file (plus a NUL
+// terminator) from the queue's allocator, the caller owns it afterwards. The
+// threads backend allocates on its workers, the allocator has to be
+// thread-safe.
+struct io_request_t
+{
+    io_op_t       op;
+    const char*   path;
+    void*         buffer;
+    size_t        size;
+    io_callback_t callback;
+    void*         user_data;
+
+    // bytes transferred, or -errno on failure
+    int64_t     result;
+    atomic_bool done;
+
+    // internal
+    int           fd;  // -1 until the open completed
+    size_t        transferred;
+    io_request_t* next;
+};
+
+typedef struct
+{
+    int       fd;
+    uint32_t  entries;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+
+    void*  sq_ptr;
+    size_t sq_size;
+    void*  cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} io_uring_ring_t;
+
+typedef struct
+{
+    allocator*   alloc;
+    io_backend_t backend;
+
+    mtx_t lock;
+    cnd_t work_ready;  // threads backend: pending work or shutdown
+    cnd_t work_done;   // threads backend: something landed in `completed`
+
+    // submitted but not yet handed to the kernel/workers
+    io_request_t* pending_head;
+    io_request_t* pending_tail;
+
+    // finished, waiting for io_queue_poll to run the callbacks
+    io_request_t* completed_head;
+    io_request_t* completed_tail;
+
+    io_uring_ring_t ring;
+    uint32_t        in_flight;
+
+    thrd_t   workers[IO_MAX_WORKERS];
+    uint32_t worker_count;
+    bool     stopping;
+} io_queue_t;
+
+static void io__list_append(io_request_t** head,
+                            io_request_t** tail,
+                            io_request_t*  request)
+{
+    request->next = NULL;
+    if (*tail)
+    {
+        (*tail)->next = request;
+    }
+    else
+    {
+        *head = request;
+    }
+    *tail = request;
+}
+
+static io_request_t* io__list_pop(io_request_t** head, io_request_t** tail)
+{
+    io_request_t* request = *head;
+    if (request)
+    {
+        *head = request->next;
+        if (!*head)
+        {
+            *tail = NULL;
+        }
+    }
+
+    return request;
+}
+
+static int io__open_flags(io_op_t op)
+{
+    return op == IO_OP_READ ? O_RDONLY | O_CLOEXEC
+                            : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+}
+
+#define IO__FILE_MODE 0644
+
+// Linux moves at most this much per read/write, larger requests go in pieces
+// through the short-transfer resubmit
+#define IO__MAX_TRANSFER 0x7ffff000u
+
+static size_t io__chunk(const io_request_t* request)
+{
+    size_t remain = request->size - request->transferred;
+    return remain < IO__MAX_TRANSFER ? remain : IO__MAX_TRANSFER;
+}
+
+// Once the file is open, sizes the buffer of a read that came without one.
+// 0 or -errno.
+static int64_t io__size_buffer(io_queue_t* queue, io_request_t* request)
+{
+    if (request->op != IO_OP_READ || request->buffer)
+    {
+        return 0;
+    }
+
+    // the inode is cached after the open, this does not hit the disk
+    struct stat info;
+    if (fstat(request->fd, &info) != 0)
+    {
+        return -errno;
+    }
+
+    request->size   = (size_t) info.st_size;
+    request->buffer = queue->alloc->malloc((ptrdiff_t) request->size + 1,
+                                           queue->alloc->ctx);
+    if (!request->buffer)
+    {
+        return -ENOMEM;
+    }
+
+    ((char*) request->buffer)[request->size] = '\0';
+    return 0;
+}
+
+//
+// io_uring backend
+//
+
+// Opcodes the backend submits. io_uring_setup works on kernels that predate
+// them (OPENAT/READ/WRITE came in 5.6), where every request would then fail
+// with -EINVAL instead of falling back to the threads.
+static const uint8_t io__uring_ops[] = {
+    IORING_OP_OPENAT,
+    IORING_OP_READ,
+    IORING_OP_WRITE,
+};
+
+#define IO__PROBE_OPS 256
+
+static bool io__uring_probe(int fd)
+{
+    _Alignas(struct io_uring_probe) uint8_t
+        storage[sizeof(struct io_uring_probe)
+                + IO__PROBE_OPS * sizeof(struct io_uring_probe_op)]
+        = { 0 };
+    struct io_uring_probe* probe = (struct io_uring_probe*) (void*) storage;
+
+    // IORING_REGISTER_PROBE itself is 5.6, older kernels reject it
+    if (syscall(__NR_io_uring_register,
+                fd,
+                IORING_REGISTER_PROBE,
+                probe,
+                IO__PROBE_OPS)
+        < 0)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(io__uring_ops); i++)
+    {
+        uint8_t op = io__uring_ops[i];
+        if (op >= probe->ops_len
+            || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool io__uring_setup(io_uring_ring_t* ring, uint32_t entries)
+{
+    struct io_uring_params params = { 0 };
+
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (!io__uring_probe(fd))
+    {
+        close(fd);
+        return false;
+    }
+
+    ring->fd      = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_size = params.cq_off.cqes
+                    + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+    {
+        size_t size   = ring->sq_size > ring->cq_size ? ring->sq_size
+                                                      : ring->cq_size;
+        ring->sq_size = size;
+        ring->cq_size = size;
+    }
+
+    ring->sq_ptr = mmap(NULL,
+                        ring->sq_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    ring->cq_ptr = ring->sq_ptr;
+    if (!single_mmap)
+    {
+        ring->cq_ptr = mmap(NULL,
+                            ring->cq_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE,
+                            fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(fd);
+            return false;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes      = mmap(NULL,
+                      ring->sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (!single_mmap)
+        {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(fd);
+        return false;
+    }
+
+    char* sq = ring->sq_ptr;
+    char* cq = ring->cq_ptr;
+
+    ring->sq_head  = (uint32_t*) (void*) (sq + params.sq_off.head);
+    ring->sq_tail  = (uint32_t*) (void*) (sq + params.sq_off.tail);
+    ring->sq_mask  = (uint32_t*) (void*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*) (void*) (sq + params.sq_off.array);
+    ring->cq_head  = (uint32_t*) (void*) (cq + params.cq_off.head);
+    ring->cq_tail  = (uint32_t*) (void*) (cq + params.cq_off.tail);
+    ring->cq_mask  = (uint32_t*) (void*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (void*) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+static void io__uring_teardown(io_uring_ring_t* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+static int io__uring_enter(io_uring_ring_t* ring,
+                           uint32_t         to_submit,
+                           uint32_t         min_complete)
+{
+    uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    return (int) syscall(
+        __NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Move as much pending work into the submission ring as fits
+static void io__uring_flush(io_queue_t* queue)
+{
+    io_uring_ring_t* ring = &queue->ring;
+
+    uint32_t tail      = *ring->sq_tail;
+    uint32_t mask      = *ring->sq_mask;
+    uint32_t submitted = 0;
+
+    // keep in-flight work within the ring size so the CQ can never overflow
+    while (queue->pending_head && queue->in_flight < ring->entries)
+    {
+        io_request_t* request
+            = io__list_pop(&queue->pending_head, &queue->pending_tail);
+
+        uint32_t             index = tail & mask;
+        struct io_uring_sqe* sqe   = &ring->sqes[index];
+
+        if (request->fd < 0)
+        {
+            *sqe = (struct io_uring_sqe) {
+                .opcode     = IORING_OP_OPENAT,
+                .fd         = AT_FDCWD,
+                .addr       = (uint64_t) (uintptr_t) request->path,
+                .len        = IO__FILE_MODE,
+                .open_flags = (uint32_t) io__open_flags(request->op),
+                .user_data  = (uint64_t) (uintptr_t) request,
+            };
+        }
+        else
+        {
+            *sqe = (struct io_uring_sqe) {
+                .opcode = request->op == IO_OP_READ ? IORING_OP_READ
+                                                    : IORING_OP_WRITE,
+                .fd     = request->fd,
+                .off    = request->transferred,
+                .addr   = (uint64_t) (uintptr_t) ((char*) request->buffer
+                                                + request->transferred),
+                .len       = (uint32_t) io__chunk(request),
+                .user_data = (uint64_t) (uintptr_t) request,
+            };
+        }
+
+        ring->sq_array[index] = index;
+        tail++;
+        submitted++;
+        queue->in_flight++;
+    }
+
+    if (submitted)
+    {
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    // also retries entries an interrupted or busy enter left behind
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (head == tail || io__uring_enter(ring, tail - head, 0) >= 0
+        || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+    {
+        return;
+    }
+
+    // the kernel took none of what is left, fail those requests rather than
+    // leave them in the ring forever
+    int error = errno;
+    head      = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (uint32_t i = head; i != tail; i++)
+    {
+        struct io_uring_sqe* sqe = &ring->sqes[ring->sq_array[i & mask]];
+        io_request_t* request = (io_request_t*) (uintptr_t) sqe->user_data;
+
+        request->result = -error;
+        queue->in_flight--;
+        io__list_append(
+            &queue->completed_head, &queue->completed_tail, request);
+    }
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+}
+
+//
+// threads backend
+//
+
+static void io__run_blocking(io_queue_t* queue, io_request_t* request)
+{
+    request->fd = open(
+        request->path, io__open_flags(request->op), IO__FILE_MODE);
+    if (request->fd < 0)
+    {
+        request->result = -errno;
+        return;
+    }
+
+    request->result = io__size_buffer(queue, request);
+    if (request->result < 0)
+    {
+        return;
+    }
+
+    while (request->transferred < request->size)
+    {
+        char*  data   = (char*) request->buffer + request->transferred;
+        size_t remain = io__chunk(request);
+
+        off_t   offset = (off_t) request->transferred;
+        ssize_t n      = request->op == IO_OP_READ
+                             ? pread(request->fd, data, remain, offset)
+                             : pwrite(request->fd, data, remain, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            request->result = -errno;
+            return;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+
+        request->transferred += (size_t) n;
+    }
+
+    request->result = (int64_t) request->transferred;
+}
+
+static int io__worker(void* arg)
+{
+    io_queue_t* queue = arg;
+
+    mtx_lock(&queue->lock);
+    while (true)
+    {
+        while (!queue->pending_head && !queue->stopping)
+        {
+            cnd_wait(&queue->work_ready, &queue->lock);
+        }
+
+        if (!queue->pending_head)
+        {
+            break;
+        }
+
+        io_request_t* request
+            = io__list_pop(&queue->pending_head, &queue->pending_tail);
+        mtx_unlock(&queue->lock);
+
+        io__run_blocking(queue, request);
+
+        mtx_lock(&queue->lock);
+        io__list_append(
+            &queue->completed_head, &queue->completed_tail, request);
+        cnd_broadcast(&queue->work_done);
+    }
+    mtx_unlock(&queue->lock);
+
+    return 0;
+}
+
+//
+// queue
+//
+
+io_queue_t* io_queue_create(allocator* alloc, io_backend_t backend)
+{
+    io_queue_t* queue = alloc->malloc(sizeof(io_queue_t), alloc->ctx);
+    if (!queue)
+    {
+        return NULL;
+    }
+
+    *queue = (io_queue_t) { .alloc = alloc };
+
+    if (mtx_init(&queue->lock, mtx_plain) != thrd_success)
+    {
+        alloc->free(queue, alloc->ctx);
+        return NULL;
+    }
+    cnd_init(&queue->work_ready);
+    cnd_init(&queue->work_done);
+
+    if (backend != IO_BACKEND_THREADS
+        && io__uring_setup(&queue->ring, IO_QUEUE_DEPTH))
+    {
+        queue->backend = IO_BACKEND_IO_URING;
+        return queue;
+    }
+
+    queue->backend = IO_BACKEND_THREADS;
+    for (uint32_t i = 0; i < IO_MAX_WORKERS; i++)
+    {
+        if (thrd_create(&queue->workers[i], io__worker, queue) != thrd_success)
+        {
+            break;
+        }
+        queue->worker_count++;
+    }
+
+    if (queue->worker_count == 0)
+    {
+        cnd_destroy(&queue->work_done);
+        cnd_destroy(&queue->work_ready);
+        mtx_destroy(&queue->lock);
+        alloc->free(queue, alloc->ctx);
+        return NULL;
+    }
+
+    return queue;
+}
+
+// Hand a batch to the backend, nothing here touches the disk. Requests that
+// cannot be opened complete with a negative result on a later poll.
+bool io_queue_submit(io_queue_t* queue, io_request_t* requests, size_t count)
+{
+    mtx_lock(&queue->lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        io_request_t* request = &requests[i];
+
+        request->result      = 0;
+        request->transferred = 0;
+        request->fd          = -1;
+        atomic_store_explicit(&request->done, false, memory_order_relaxed);
+
+        io__list_append(&queue->pending_head, &queue->pending_tail, request);
+    }
+
+    if (queue->backend == IO_BACKEND_IO_URING)
+    {
+        io__uring_flush(queue);
+    }
+    else
+    {
+        cnd_broadcast(&queue->work_ready);
+    }
+
+    mtx_unlock(&queue->lock);
+    return true;
+}
+
+static void io__finish(io_request_t* request)
+{
+    if (request->fd >= 0)
+    {
+        close(request->fd);
+        request->fd = -1;
+    }
+
+    atomic_store_explicit(&request->done, true, memory_order_release);
+    if (request->callback)
+    {
+        request->callback(request, request->user_data);
+    }
+}
+
+// Reap finished requests and run their callbacks. Returns how many finished.
+uint32_t io_queue_poll(io_queue_t* queue)
+{
+    uint32_t finished = 0;
+
+    mtx_lock(&queue->lock);
+
+    if (queue->backend == IO_BACKEND_IO_URING)
+    {
+        io_uring_ring_t* ring = &queue->ring;
+
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        uint32_t mask = *ring->cq_mask;
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &ring->cqes[head & mask];
+            io_request_t* request = (io_request_t*) (uintptr_t) cqe->user_data;
+
+            queue->in_flight--;
+
+            // the open finished, the transfer goes next
+            if (request->fd < 0 && cqe->res >= 0)
+            {
+                request->fd     = cqe->res;
+                request->result = io__size_buffer(queue, request);
+                if (request->result == 0)
+                {
+                    io__list_append(
+                        &queue->pending_head, &queue->pending_tail, request);
+                    continue;
+                }
+            }
+            else if (cqe->res < 0)
+            {
+                request->result = cqe->res;
+            }
+            else
+            {
+                request->transferred += (size_t) cqe->res;
+
+                // short transfer, queue the rest again
+                if (cqe->res > 0 && request->transferred < request->size)
+                {
+                    io__list_append(
+                        &queue->pending_head, &queue->pending_tail, request);
+                    continue;
+                }
+
+                request->result = (int64_t) request->transferred;
+            }
+
+            io__list_append(
+                &queue->completed_head, &queue->completed_tail, request);
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        io__uring_flush(queue);
+    }
+
+    io_request_t* done    = queue->completed_head;
+    queue->completed_head = NULL;
+    queue->completed_tail = NULL;
+
+    mtx_unlock(&queue->lock);
+
+    // callbacks run unlocked so they can submit follow-up work
+    while (done)
+    {
+        io_request_t* next = done->next;
+        io__finish(done);
+        done = next;
+        finished++;
+    }
+
+    return finished;
+}
+
+// Block until `request` completes, running any callbacks that become ready
+void io_queue_wait(io_queue_t* queue, io_request_t* request)
+{
+    while (!atomic_load_explicit(&request->done, memory_order_acquire))
+    {
+        if (io_queue_poll(queue))
+        {
+            continue;
+        }
+
+        if (queue->backend == IO_BACKEND_IO_URING)
+        {
+            io__uring_enter(&queue->ring, 0, 1);
+        }
+        else
+        {
+            mtx_lock(&queue->lock);
+            if (!queue->completed_head)
+            {
+                cnd_wait(&queue->work_done, &queue->lock);
+            }
+            mtx_unlock(&queue->lock);
+        }
+    }
+}
+
+void io_queue_wait_all(io_queue_t* queue, io_request_t* requests, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        io_queue_wait(queue, &requests[i]);
+    }
+}
+
+// Outstanding requests should be waited for first, their callbacks never run
+void io_queue_destroy(io_queue_t* queue)
+{
+    if (!queue)
+    {
+        return;
+    }
+
+    if (queue->backend == IO_BACKEND_IO_URING)
+    {
+        io__uring_teardown(&queue->ring);
+    }
+    else
+    {
+        mtx_lock(&queue->lock);
+        queue->stopping = true;
+        cnd_broadcast(&queue->work_ready);
+        mtx_unlock(&queue->lock);
+
+        for (uint32_t i = 0; i < queue->worker_count; i++)
+        {
+            thrd_join(queue->workers[i], NULL);
+        }
+    }
+
+    cnd_destroy(&queue->work_done);
+    cnd_destroy(&queue->work_ready);
+    mtx_destroy(&queue->lock);
+
+    allocator* alloc = queue->alloc;
+    alloc->free(queue, alloc->ctx);
+}
+
+#endif  // ASYNC_IO_H
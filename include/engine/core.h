@@ -33,8 +33,21 @@
 #include <vulkan/vulkan_core.h>
 
 #include "prelude.h"
+#include "log.h"
+#include "arena.h"
+#include "intern.h"
+#include "async_io.h"
+#include "jobs.h"
+#include "validation.h"
+#include "shader_watcher.h"
 #include "device.h"
 #include "surface.h"
+#include "frame.h"
+#include "pacing.h"
+#include "offscreen.h"
+#include "gpu_memory.h"
+#include "staging.h"
+#include "record.h"
 
 
 // Engine version
@@ -51,31 +64,170 @@
 #endif
 #endif
 
+// Size of the per-frame scratch arena, also used for init scratch
+#ifndef ZERUS_FRAME_ARENA_SIZE
+#define ZERUS_FRAME_ARENA_SIZE (1024 * 1024)
+#endif
+
+// Bytes reserved for interned identifiers (layers, extensions, asset names)
+#ifndef ZERUS_STRING_TABLE_SIZE
+#define ZERUS_STRING_TABLE_SIZE (64 * 1024)
+#endif
+
+// Recompile shaders when they are saved, on by default in debug builds
+#ifndef ZERUS_HOT_RELOAD
+#ifdef DEBUG
+#define ZERUS_HOT_RELOAD 1
+#else
+#define ZERUS_HOT_RELOAD 0
+#endif
+#endif
+
+// What VALIDATION_AUTO resolves to, on in debug builds
+#ifndef ZERUS_VALIDATION
+#ifdef DEBUG
+#define ZERUS_VALIDATION 1
+#else
+#define ZERUS_VALIDATION 0
+#endif
+#endif
+
+// Relative to the working directory, which is the build directory
+#ifndef ZERUS_SHADER_DIR
+#define ZERUS_SHADER_DIR "../resources/shaders"
+#endif
+
+#ifndef ZERUS_SHADER_CACHE_DIR
+#define ZERUS_SHADER_CACHE_DIR "shader_cache"
+#endif
+
+// Driver pipeline cache, kept across runs
+#ifndef ZERUS_PIPELINE_CACHE_PATH
+#define ZERUS_PIPELINE_CACHE_PATH "pipeline_cache.bin"
+#endif
+
 typedef enum
 {
     INIT_OK,
     VULKAN_INSTANCE_FAILED,
     VULKAN_VALIDATION_NOT_FOUND,
-    VULKAN_SURFACE_FAILED
+    VULKAN_SURFACE_FAILED,
+    FRAME_ARENA_FAILED,
+    STRING_TABLE_FAILED,
+    IO_QUEUE_FAILED,
+    JOB_SYSTEM_FAILED,
+    FRAMES_FAILED,
+    GPU_MEMORY_FAILED,
+    STAGING_FAILED,
+    RECORDER_FAILED
 } engine_error_t;
 
+// Steps of zerus_engine_init, overlapping ones ran concurrently
+typedef enum
+{
+    STARTUP_VALIDATION,
+    STARTUP_PIPELINE_CACHE_LOAD,
+    STARTUP_WINDOW_SYSTEM,
+    STARTUP_INSTANCE,
+    STARTUP_DEVICE,
+    STARTUP_WINDOW,
+    STARTUP_PIPELINE_CACHE,
+    STARTUP_SURFACE,
+    STARTUP_FRAMES,
+    STARTUP_PHASE_COUNT
+} startup_phase_t;
+
+typedef struct
+{
+    uint64_t start_ns;  // 0 = skipped
+    uint64_t end_ns;
+} startup_timing_t;
+
+// Passed to zerus_engine_init, NULL or zeroed fields pick the defaults
+typedef struct
+{
+    uint32_t          frames_in_flight;  // 0 = FRAME_DEFAULT_IN_FLIGHT
+    VkClearColorValue clear_color;
+
+    // job workers including the main thread, 0 = one per core
+    uint32_t worker_threads;
+
+    // Khronos validation layer and debug messenger, AUTO = ZERUS_VALIDATION
+    validation_mode_t validation;
+
+    // deviceName substring or deviceUUID of the GPU to use. NULL falls back
+    // to $ZERUS_DEVICE, then to the highest scoring device.
+    const char* device;
+
+    // interactive sessions want MAILBOX or IMMEDIATE, benchmarks IMMEDIATE
+    // with no limiter, VSYNC for steady pacing on battery
+    present_policy_t present_policy;
+    uint32_t         swapchain_images;  // 0 = surface minimum + 1
+    uint32_t         max_fps;           // CPU frame limiter, 0 = off
+
+    // staging ring space per frame in flight, 0 = STAGING_DEFAULT_FRAME_SIZE
+    VkDeviceSize staging_frame_size;
+
+    // no window or display, frames render into offscreen images
+    bool       headless;
+    VkExtent2D headless_extent;  // 0 = 800x600
+    uint64_t   frame_count;      // stop after this many frames, 0 = never
+
+    // headless readback, every finished frame is written to
+    // <capture_dir>/frame_<n>.ppm and/or passed to on_readback
+    const char* capture_dir;
+    void (*on_readback)(const frame_readback_t* readback, void* user_data);
+    void* user_data;
+} zerus_engine_config_t;
+
 // Engine subsystems state
 typedef struct zerus_engine_state_t
 {
-    bool           initialized;
-    engine_error_t err;
-    allocator*     alloc;
+    bool                  initialized;
+    engine_error_t        err;
+    allocator*            alloc;
+    zerus_engine_config_t config;
+
+    // transient memory, reset at the start of every frame
+    arena_t frame_arena;
+
+    string_table_t strings;
+    string_id      validation_layer_id;
+
+    // async file I/O, init reads the pipeline cache through it and assets can
+    // follow. Completions are dispatched once per frame.
+    io_queue_t* io;
+
+    // fans work out over every core, the main thread is worker 0
+    job_system_t* jobs;
+
+    // hot reload, NULL when disabled. Reloads are delivered to
+    // shaders->on_reload at the start of a frame.
+    shader_watcher_t* shaders;
 
     VkInstance               instance;
-    VkDebugUtilsMessengerEXT debug_messenger;
+    VkDebugUtilsMessengerEXT debug_messenger;  // VK_NULL_HANDLE without
+                                               // validation
 
     device_info_t  device_info;
+    gpu_memory_t*  gpu_memory;  // buffers and images
+    staging_t*     staging;     // uploads, see staging_upload_*
+    recorder_t*    recorder;    // secondaries, see recorder_record
     surface_info_t surface_info;
+    frames_t       frames;
+    frame_pacer_t  pacer;
+    uint64_t       start_ns;  // first frame, for the run summary
+
+    // time to first frame is measured from init_ns
+    uint64_t         init_ns;
+    uint64_t         first_frame_ns;
+    startup_timing_t startup[STARTUP_PHASE_COUNT];
 } zerus_engine_state_t;
 
 
 // Core engine functions
-ZERUS_CORE_DEF zerus_engine_state_t zerus_engine_init(allocator*);
+ZERUS_CORE_DEF zerus_engine_state_t
+zerus_engine_init(allocator*, const zerus_engine_config_t* config);
 ZERUS_CORE_DEF bool zerus_engine_update(zerus_engine_state_t* engine);
 ZERUS_CORE_DEF void zerus_engine_shutdown(zerus_engine_state_t* engine);
 ZERUS_CORE_DEF void zerus_engine_start(zerus_engine_state_t* engine);
@@ -88,7 +240,9 @@ ZERUS_CORE_DEF void zerus_engine_start(zerus_engine_state_t* engine);
 
 #ifdef ZERUS_CORE_IMPLEMENTATION
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define GLFW_INCLUDE_VULKAN
 #include "GLFW/glfw3.h"
@@ -102,25 +256,26 @@ string_t required_validation_extension
     = MAKE_STR(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 
 
-bool check_validation_support()
+bool check_validation_support(const string_table_t* strings,
+                              string_id             validation_layer_id)
 {
-    uint32_t count;
-    vkEnumerateInstanceLayerProperties(&count, NULL);
+    // string_table_find returns STRING_ID_NONE for every name it lacks
+    if (validation_layer_id == STRING_ID_NONE)
+    {
+        return false;
+    }
 
+    uint32_t count = 256;
     VkLayerProperties layer_properties[256];
     vkEnumerateInstanceLayerProperties(&count, layer_properties);
 
     bool found = false;
     for (uint32_t i = 0; i < count; i++)
     {
-        VkLayerProperties layer = layer_properties[i];
-
         string_t layer_name
-            = { .chars = layer.layerName,
-                .len   = find_length_of_c_string(layer.layerName) };
+            = make_from_c_string(layer_properties[i].layerName);
 
-
-        if (string_equal(layer_name, required_validation_layer))
+        if (string_table_find(strings, layer_name) == validation_layer_id)
         {
             found = true;
             break;
@@ -130,81 +285,211 @@ bool check_validation_support()
     return found;
 }
 
-static VKAPI_ATTR VkBool32 VKAPI_CALL
-debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT      message_severity,
-               VkDebugUtilsMessageTypeFlagsEXT             message_type,
-               const VkDebugUtilsMessengerCallbackDataEXT* p_callback_data,
-               void*                                       p_user_data)
+#if ZERUS_HOT_RELOAD
+static void zerus_core__shader_reloaded(const shader_reload_t* reload,
+                                        void*                  user_data)
 {
-    (void) p_user_data;
+    (void) user_data;
 
-    printf("message severity %d \n", message_severity);
-    printf("message type: %d \n", message_type);
-    printf("validation layer: %s \n", p_callback_data->pMessage);
-    return VK_FALSE;
+    log_info(LOG_CORE,
+             "shader reloaded: %s (%zu bytes)\n",
+             reload->glsl_path,
+             reload->spirv->len);
 }
+#endif
 
-bool create_debug_utils_messenger(VkInstance                instance,
-                                  VkDebugUtilsMessengerEXT* debug_messenger)
+// Init runs as a small dependency graph on the job system. Steps that only
+// need their inputs go to the workers, GLFW stays on the main thread, and the
+// pipeline cache file is read through the I/O queue:
+//
+//   validation check (job), glfwInit (main)  -> instance (main)
+//   instance                 -> device (job), window (main) meanwhile
+//   device, cache read (io)  -> pipeline cache, surface, frames (main)
+//
+// With ZERUS_HOT_RELOAD (DEBUG builds) shaders compile on the watcher thread,
+// started before this graph. Release builds compile no shaders during init.
+typedef struct
 {
-    VkDebugUtilsMessengerCreateInfoEXT create_info = { 0 };
-    create_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+    zerus_engine_state_t* engine;
+    allocator*            scratch;  // owned by the device job while it runs
+
+    job_counter_t validation;
+    job_counter_t device;
+
+    // buffer comes from the engine allocator, freed once the cache is made
+    io_request_t pipeline_cache;
+    bool         pipeline_cache_submitted;
 
-    create_info.messageSeverity
-        = VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT
-          | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+    bool        validation_found;
+    const char* device_override;
+} zerus_core__startup_t;
 
-    create_info.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT
-                              | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT
-                              | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+static void zerus_core__phase_begin(zerus_engine_state_t* engine,
+                                    startup_phase_t       phase)
+{
+    engine->startup[phase].start_ns = time_now_ns();
+}
 
-    create_info.pfnUserCallback = debug_callback;
-    create_info.pUserData       = NULL;
+static void zerus_core__phase_end(zerus_engine_state_t* engine,
+                                  startup_phase_t       phase)
+{
+    engine->startup[phase].end_ns = time_now_ns();
+}
 
-    PFN_vkCreateDebugUtilsMessengerEXT pfnCreateDebugUtilsMessengerEXT
-        = (PFN_vkCreateDebugUtilsMessengerEXT) vkGetInstanceProcAddr(
-            instance, "vkCreateDebugUtilsMessengerEXT");
-    if (pfnCreateDebugUtilsMessengerEXT == NULL)
+static void zerus_core__check_validation(void* data)
+{
+    zerus_core__startup_t* startup = data;
+    zerus_engine_state_t*  engine  = startup->engine;
+
+    zerus_core__phase_begin(engine, STARTUP_VALIDATION);
+    startup->validation_found = check_validation_support(
+        &engine->strings, engine->validation_layer_id);
+    zerus_core__phase_end(engine, STARTUP_VALIDATION);
+}
+
+// Returns the bytes read, or an empty view when the file is missing or the
+// read failed
+static file_view_t zerus_core__wait_pipeline_cache(
+    zerus_engine_state_t* engine, zerus_core__startup_t* startup)
+{
+    io_request_t* request = &startup->pipeline_cache;
+    if (!startup->pipeline_cache_submitted)
     {
-        printf("failed to register debug callback");
-        return false;
+        return (file_view_t) { 0 };
     }
 
-    VkResult res = pfnCreateDebugUtilsMessengerEXT(
-        instance, &create_info, nullptr, debug_messenger);
-    if (res)
+    io_queue_wait(engine->io, request);
+    zerus_core__phase_end(engine, STARTUP_PIPELINE_CACHE_LOAD);
+
+    if (request->result < 0)
     {
-        printf("failed to create debug messenger %d", res);
-        return false;
+        if (request->result != -ENOENT)
+        {
+            log_warn(LOG_CORE,
+                     "failed to read %s: %s\n",
+                     request->path,
+                     strerror((int) -request->result));
+        }
+        return (file_view_t) { 0 };
     }
 
-    return true;
+    return (file_view_t) {
+        .data = request->buffer,
+        .len  = (size_t) request->result,
+    };
 }
 
-void destroy_debug_utils_messenger(VkInstance               instance,
-                                   VkDebugUtilsMessengerEXT debug_messenger)
+static void zerus_core__create_device(void* data)
 {
-    PFN_vkDestroyDebugUtilsMessengerEXT pfnDestroyDebugUtilsMessengerEXT
-        = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(
-            instance, "vkDestroyDebugUtilsMessengerEXT");
-    if (pfnDestroyDebugUtilsMessengerEXT == NULL)
+    zerus_core__startup_t* startup = data;
+    zerus_engine_state_t*  engine  = startup->engine;
+
+    zerus_core__phase_begin(engine, STARTUP_DEVICE);
+    engine->device_info = pick_device(startup->scratch,
+                                      engine->instance,
+                                      !engine->config.headless,
+                                      startup->device_override);
+    zerus_core__phase_end(engine, STARTUP_DEVICE);
+}
+
+static const char* zerus_core__phase_names[STARTUP_PHASE_COUNT] = {
+    [STARTUP_VALIDATION]          = "validation",
+    [STARTUP_PIPELINE_CACHE_LOAD] = "pipeline cache read",
+    [STARTUP_WINDOW_SYSTEM]       = "window system",
+    [STARTUP_INSTANCE]            = "instance",
+    [STARTUP_DEVICE]              = "device",
+    [STARTUP_WINDOW]              = "window",
+    [STARTUP_PIPELINE_CACHE]      = "pipeline cache",
+    [STARTUP_SURFACE]             = "surface",
+    [STARTUP_FRAMES]              = "frames",
+};
+
+static void zerus_core__print_startup(const zerus_engine_state_t* engine)
+{
+    log_info(LOG_CORE, "startup phases, ms since init:\n");
+    for (uint32_t i = 0; i < STARTUP_PHASE_COUNT; i++)
     {
-        return;
-    }
+        startup_timing_t timing = engine->startup[i];
+        if (timing.start_ns == 0 || timing.end_ns == 0)
+        {
+            continue;
+        }
 
-    pfnDestroyDebugUtilsMessengerEXT(instance, debug_messenger, nullptr);
+        log_info(LOG_CORE,
+                 "  %-20s %8.2f .. %8.2f (%.2f)\n",
+                 zerus_core__phase_names[i],
+                 time_ns_to_ms(timing.start_ns - engine->init_ns),
+                 time_ns_to_ms(timing.end_ns - engine->init_ns),
+                 time_ns_to_ms(timing.end_ns - timing.start_ns));
+    }
 }
 
-
-engine_error_t _init_vulkan(allocator* alloc, zerus_engine_state_t* engine)
+static engine_error_t _init_vulkan(allocator*             alloc,
+                                   zerus_engine_state_t*  engine,
+                                   zerus_core__startup_t* startup)
 {
-    if (!check_validation_support())
+    job_system_t* jobs     = engine->jobs;
+    bool          headless = engine->config.headless;
+
+    validation_mode_t mode       = engine->config.validation;
+    bool              validation = mode == VALIDATION_ON
+                      || (mode == VALIDATION_AUTO && ZERUS_VALIDATION);
+
+    // neither needs anything else, both run while GLFW comes up
+    if (validation)
     {
-        printf("validation support not found");
-        return VULKAN_VALIDATION_NOT_FOUND;
+        jobs_run(jobs,
+                 &(job_decl_t) { zerus_core__check_validation, startup },
+                 1,
+                 &startup->validation);
     }
 
-    string_array_t* extensions = get_glfw_extensions(alloc);
+    zerus_core__phase_begin(engine, STARTUP_PIPELINE_CACHE_LOAD);
+    startup->pipeline_cache = (io_request_t) {
+        .op   = IO_OP_READ,
+        .path = ZERUS_PIPELINE_CACHE_PATH,
+    };
+    startup->pipeline_cache_submitted
+        = io_queue_submit(engine->io, &startup->pipeline_cache, 1);
+
+    // init scratch lives in the frame arena, the caller resets it afterwards
+    allocator scratch = arena_allocator(&engine->frame_arena);
+    startup->scratch  = &scratch;
+
+    // headless never touches GLFW, there may be no display to connect to
+    if (!headless)
+    {
+        zerus_core__phase_begin(engine, STARTUP_WINDOW_SYSTEM);
+        bool initialized = glfwInit();
+        zerus_core__phase_end(engine, STARTUP_WINDOW_SYSTEM);
+
+        if (!initialized)
+        {
+            log_error(LOG_CORE, "failed to initialize GLFW\n");
+            return VULKAN_SURFACE_FAILED;
+        }
+    }
+
+    // only an explicit request makes a missing layer fatal, machines
+    // without the SDK just run without it
+    jobs_wait(jobs, &startup->validation);
+    if (validation && !startup->validation_found)
+    {
+        if (mode == VALIDATION_ON)
+        {
+            log_error(LOG_CORE, "validation support not found\n");
+            return VULKAN_VALIDATION_NOT_FOUND;
+        }
+
+        log_warn(LOG_CORE,
+                 "validation layer not installed, running without it\n");
+        validation = false;
+    }
+
+    zerus_core__phase_begin(engine, STARTUP_INSTANCE);
+
+    string_array_t* extensions = headless ? make_string_array(&scratch, 1)
+                                          : get_glfw_extensions(&scratch);
 
 
     // create instance
@@ -220,7 +505,14 @@ engine_error_t _init_vulkan(allocator* alloc, zerus_engine_state_t* engine)
     };
 
 
-    string_array_push(alloc, extensions, required_validation_extension);
+    if (!extensions
+        || (validation
+            && !string_array_push(
+                &scratch, &extensions, required_validation_extension)))
+    {
+        log_error(LOG_CORE, "failed to build the instance extension list\n");
+        return VULKAN_INSTANCE_FAILED;
+    }
 
     const VkInstanceCreateInfo instance_create_info
         = { .sType                   = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -228,7 +520,7 @@ engine_error_t _init_vulkan(allocator* alloc, zerus_engine_state_t* engine)
             .pApplicationInfo        = &app_info,
             .enabledExtensionCount   = extensions->len,
             .ppEnabledExtensionNames = string_array_to_cstrings(extensions),
-            .enabledLayerCount       = 1,
+            .enabledLayerCount       = validation ? 1 : 0,
             .ppEnabledLayerNames     = (const char*[]) {
                 string_to_cstring(&required_validation_layer) } };
 
@@ -236,65 +528,498 @@ engine_error_t _init_vulkan(allocator* alloc, zerus_engine_state_t* engine)
         = vkCreateInstance(&instance_create_info, NULL, &engine->instance);
     if (result)
     {
-        printf("error creating vulkan instance");
+        log_error(LOG_CORE, "error creating vulkan instance\n");
         return VULKAN_INSTANCE_FAILED;
     }
 
-    if (!create_debug_utils_messenger(engine->instance,
-                                      &engine->debug_messenger))
+    if (validation
+        && !create_debug_utils_messenger(engine->instance,
+                                         &engine->debug_messenger))
     {
         return VULKAN_VALIDATION_NOT_FOUND;
     }
 
-    engine->device_info = pick_device(alloc, engine->instance);
+    zerus_core__phase_end(engine, STARTUP_INSTANCE);
+
+    startup->device_override = engine->config.device;
+    if (!startup->device_override)
+    {
+        startup->device_override = getenv("ZERUS_DEVICE");
+    }
+
+    // the device job owns the scratch arena until it is waited for
+    jobs_run(jobs,
+             &(job_decl_t) { zerus_core__create_device, startup },
+             1,
+             &startup->device);
+
+    GLFWwindow* window = NULL;
+    if (!headless)
+    {
+        zerus_core__phase_begin(engine, STARTUP_WINDOW);
+        window = make_window();
+        zerus_core__phase_end(engine, STARTUP_WINDOW);
+
+        // create_surface takes it over, until then failures destroy it here
+        engine->surface_info.window = window;
+    }
+
+    jobs_wait(jobs, &startup->device);
     if (engine->device_info.error)
     {
-        printf("error creating device %d \n", engine->device_info.error);
+        log_error(
+            LOG_CORE, "error creating device %d\n", engine->device_info.error);
         return VULKAN_INSTANCE_FAILED;
     }
 
-    engine->surface_info
-        = create_surface(alloc, engine->instance, engine->device_info);
+    // not fatal, pipelines just compile without a cache
+    file_view_t cache_blob = zerus_core__wait_pipeline_cache(engine, startup);
+    zerus_core__phase_begin(engine, STARTUP_PIPELINE_CACHE);
+    create_pipeline_cache(&engine->device_info, cache_blob);
+    zerus_core__phase_end(engine, STARTUP_PIPELINE_CACHE);
+
+    zerus_core__phase_begin(engine, STARTUP_SURFACE);
+
+    engine->gpu_memory
+        = alloc->malloc((ptrdiff_t) sizeof(gpu_memory_t), alloc->ctx);
+    if (!engine->gpu_memory)
+    {
+        log_error(LOG_CORE, "failed to allocate gpu memory allocator\n");
+        return GPU_MEMORY_FAILED;
+    }
+
+    gpu_memory_init(engine->gpu_memory, &engine->device_info);
+
+    if (headless)
+    {
+        VkExtent2D extent = engine->config.headless_extent;
+        if (extent.width == 0 || extent.height == 0)
+        {
+            extent = (VkExtent2D) { 800, 600 };
+        }
+
+        engine->surface_info = create_offscreen_surface(
+            alloc,
+            engine->gpu_memory,
+            &engine->device_info,
+            extent.width,
+            extent.height,
+            frames_resolve_count(engine->config.frames_in_flight));
+    }
+    else
+    {
+        engine->surface_info
+            = create_surface(alloc,
+                             &scratch,
+                             engine->instance,
+                             engine->device_info,
+                             window,
+                             engine->config.present_policy,
+                             engine->config.swapchain_images);
+    }
+
     if (engine->surface_info.status)
     {
-        printf("error creating surface %d \n", engine->surface_info.status);
+        log_error(LOG_CORE,
+                  "error creating surface %d\n",
+                  engine->surface_info.status);
         return VULKAN_SURFACE_FAILED;
     }
 
-    printf("Vulkan instance created...\n");
+    zerus_core__phase_end(engine, STARTUP_SURFACE);
+    zerus_core__phase_begin(engine, STARTUP_FRAMES);
+
+    if (!frames_init(alloc,
+                     &engine->frames,
+                     &engine->device_info,
+                     &engine->surface_info,
+                     engine->config.frames_in_flight))
+    {
+        log_error(LOG_CORE, "error creating frames in flight\n");
+        return FRAMES_FAILED;
+    }
+
+    if (headless && (engine->config.capture_dir || engine->config.on_readback)
+        && !frames_enable_readback(alloc,
+                                   engine->gpu_memory,
+                                   &engine->frames,
+                                   &engine->device_info,
+                                   &engine->surface_info))
+    {
+        log_error(LOG_CORE, "error creating frame readback\n");
+        return FRAMES_FAILED;
+    }
+
+    engine->staging = staging_create(alloc,
+                                     engine->gpu_memory,
+                                     &engine->device_info,
+                                     engine->frames.count,
+                                     engine->config.staging_frame_size);
+    if (!engine->staging)
+    {
+        return STAGING_FAILED;
+    }
+
+    engine->recorder = recorder_create(
+        alloc, &engine->device_info, engine->jobs, engine->frames.count);
+    if (!engine->recorder)
+    {
+        return RECORDER_FAILED;
+    }
+
+    const char* capture_dir = engine->config.capture_dir;
+    if (headless && capture_dir && mkdir(capture_dir, 0755) != 0
+        && errno != EEXIST)
+    {
+        log_error(LOG_CORE,
+                  "failed to create %s: %s\n",
+                  capture_dir,
+                  strerror(errno));
+        return FRAMES_FAILED;
+    }
+
+    zerus_core__phase_end(engine, STARTUP_FRAMES);
+
+    log_info(LOG_CORE, "Vulkan instance created...\n");
 
-    alloc->free(extensions, alloc->ctx);  // Free immediately after use
     return INIT_OK;
 }
 
+static engine_error_t zerus_core__startup(allocator*            alloc,
+                                          zerus_engine_state_t* engine)
+{
+    zerus_core__startup_t startup = { .engine = engine };
+    job_counter_init(&startup.validation);
+    job_counter_init(&startup.device);
+
+    engine_error_t err = _init_vulkan(alloc, engine, &startup);
+
+    // early returns leave jobs behind that still point at `startup`
+    jobs_wait(engine->jobs, &startup.validation);
+    jobs_wait(engine->jobs, &startup.device);
+    if (startup.pipeline_cache_submitted)
+    {
+        io_queue_wait(engine->io, &startup.pipeline_cache);
+        alloc->free(startup.pipeline_cache.buffer, alloc->ctx);
+    }
+
+    zerus_core__print_startup(engine);
+    return err;
+}
+
+// Destroys whatever init got to, in reverse. Also the tail of
+// zerus_engine_shutdown.
+static void zerus_core__destroy(zerus_engine_state_t* engine)
+{
+    allocator*     alloc       = engine->alloc;
+    device_info_t* device_info = &engine->device_info;
+
+    if (device_info->device)
+    {
+        // waits for the GPU to drain every frame in flight
+        frames_destroy(alloc, &engine->frames, device_info);
+        staging_destroy(engine->staging, device_info);
+        recorder_destroy(engine->recorder);
+    }
+
+    destroy_debug_utils_messenger(engine->instance, engine->debug_messenger);
+
+    if (engine->config.headless)
+    {
+        if (engine->gpu_memory)
+        {
+            destroy_offscreen_surface(
+                alloc, engine->gpu_memory, device_info, &engine->surface_info);
+        }
+    }
+    else if (device_info->device)
+    {
+        destroy_surface(
+            alloc, engine->instance, *device_info, &engine->surface_info);
+    }
+    else
+    {
+        // init failed before the surface, only the window may exist
+        if (engine->surface_info.window)
+        {
+            glfwDestroyWindow(engine->surface_info.window);
+        }
+        glfwTerminate();
+    }
+
+    if (device_info->device)
+    {
+        destroy_pipeline_cache(device_info);
+
+        if (engine->gpu_memory)
+        {
+            gpu_memory_destroy(alloc, engine->gpu_memory, device_info);
+            alloc->free(engine->gpu_memory, alloc->ctx);
+        }
+
+        destroy_device(device_info);
+    }
+
+    vkDestroyInstance(engine->instance, nullptr);
+
+    shader_watcher_destroy(engine->shaders);
+    jobs_destroy(engine->jobs);
+    io_queue_destroy(engine->io);
+    string_table_release(&engine->strings);
+    arena_release(&engine->frame_arena);
+}
+
 ZERUS_CORE_DEF
-zerus_engine_state_t zerus_engine_init(allocator* alloc)
+zerus_engine_state_t zerus_engine_init(allocator*                   alloc,
+                                       const zerus_engine_config_t* config)
 {
-    zerus_engine_state_t state = { .initialized = true, .alloc = alloc };
+    zerus_engine_state_t state = {
+        .initialized = true,
+        .alloc       = alloc,
+        .init_ns     = time_now_ns(),
+    };
+    if (config)
+    {
+        state.config = *config;
+    }
+
+    // without the flush thread messages are just written synchronously
+    log_init(alloc, NULL);
+
+    frame_pacer_init(&state.pacer, state.config.max_fps);
+
+    if (!arena_init(&state.frame_arena, alloc, ZERUS_FRAME_ARENA_SIZE))
+    {
+        log_error(LOG_CORE, "failed to allocate frame arena\n");
+        log_shutdown();
+        state.initialized = false;
+        state.err         = FRAME_ARENA_FAILED;
+        return state;
+    }
+
+    if (!string_table_init(&state.strings, alloc, ZERUS_STRING_TABLE_SIZE))
+    {
+        log_error(LOG_CORE, "failed to allocate string table\n");
+        string_table_release(&state.strings);
+        arena_release(&state.frame_arena);
+        log_shutdown();
+        state.initialized = false;
+        state.err         = STRING_TABLE_FAILED;
+        return state;
+    }
+
+    state.validation_layer_id
+        = string_intern(&state.strings, required_validation_layer);
+
+    state.io = io_queue_create(alloc, IO_BACKEND_AUTO);
+    if (!state.io)
+    {
+        log_error(LOG_CORE, "failed to create io queue\n");
+        string_table_release(&state.strings);
+        arena_release(&state.frame_arena);
+        log_shutdown();
+        state.initialized = false;
+        state.err         = IO_QUEUE_FAILED;
+        return state;
+    }
+
+    state.jobs = jobs_create(alloc, state.config.worker_threads);
+    if (!state.jobs)
+    {
+        log_error(LOG_CORE, "failed to create job system\n");
+        io_queue_destroy(state.io);
+        string_table_release(&state.strings);
+        arena_release(&state.frame_arena);
+        log_shutdown();
+        state.initialized = false;
+        state.err         = JOB_SYSTEM_FAILED;
+        return state;
+    }
+
+#if ZERUS_HOT_RELOAD
+    // compiles in the background while the renderer comes up, a failure only
+    // costs hot reload
+    state.shaders = shader_watcher_create(alloc,
+                                          ZERUS_SHADER_DIR,
+                                          ZERUS_SHADER_CACHE_DIR,
+                                          zerus_core__shader_reloaded,
+                                          NULL);
+    if (!state.shaders)
+    {
+        log_warn(LOG_CORE, "shader hot reload disabled\n");
+    }
+#endif
 
     // Initialize subsystems
-    printf("Initializing rendessrer... \n");
-    state.err = _init_vulkan(alloc, &state);
+    log_info(LOG_CORE, "Initializing rendessrer... \n");
+    state.err = zerus_core__startup(alloc, &state);
+
+    // drop all init scratch in one go
+    arena_reset(&state.frame_arena);
+
     if (state.err)
     {
-        printf("error in vulkan init %d", state.err);
+        log_error(LOG_CORE, "error in vulkan init %d\n", state.err);
+        zerus_core__destroy(&state);
+        log_shutdown();
+        state.initialized = false;
         return state;
     }
 
     return state;
 }
 
-ZERUS_CORE_DEF bool zerus_engine_update(zerus_engine_state_t* engine)
+// Hands every completed headless frame to the capture directory and the
+// user callback
+static void zerus_core__drain_readbacks(zerus_engine_state_t* engine)
 {
-    surface_status_t status = update_surface(&engine->surface_info);
-    if (status == SURFACE_SHOULD_CLOSE)
+    const zerus_engine_config_t* config = &engine->config;
+
+    frame_readback_t readback;
+    while (frames_take_readback(
+        &engine->frames, &engine->surface_info, &readback))
+    {
+        if (config->capture_dir)
+        {
+            char path[PATH_MAX];
+            int  len = snprintf(path,
+                               sizeof(path),
+                               "%s/frame_%06llu.ppm",
+                               config->capture_dir,
+                               (unsigned long long) readback.frame_number);
+            if (len > 0 && (size_t) len < sizeof(path))
+            {
+                offscreen_write_ppm(
+                    path, readback.pixels, readback.extent, readback.row_pitch);
+            }
+        }
+
+        if (config->on_readback)
+        {
+            config->on_readback(&readback, config->user_data);
+        }
+    }
+}
+
+// Records and submits one frame. The only CPU wait is for the slot being
+// reused, which finished N frames ago.
+static bool zerus_core__render(zerus_engine_state_t* engine)
+{
+    frames_t*       frames       = &engine->frames;
+    device_info_t*  device_info  = &engine->device_info;
+    surface_info_t* surface_info = &engine->surface_info;
+
+    frames_poll(frames, device_info);
+
+    frame_status_t status = FRAME_OK;
+    if (surface_resized(surface_info))
+    {
+        status = frames_recreate_swapchain(
+            engine->alloc, frames, device_info, surface_info);
+    }
+
+    if (status == FRAME_OK)
     {
+        status = frame_begin(frames, device_info, surface_info);
+
+        // rebuild and retry straight away rather than dropping the frame
+        if (status == FRAME_OUT_OF_DATE)
+        {
+            status = frames_recreate_swapchain(
+                engine->alloc, frames, device_info, surface_info);
+            if (status == FRAME_OK)
+            {
+                status = frame_begin(frames, device_info, surface_info);
+            }
+        }
+    }
+
+    if (status == FRAME_OK)
+    {
+        frames_collect(engine->alloc, frames, device_info);
+        recorder_begin_frame(engine->recorder, frames->current);
+
+        // uploads made since the last frame, their acquires go first
+        queue_wait_t uploads
+            = staging_acquire(engine->staging,
+                              device_info,
+                              frame_current(frames)->command_buffer);
+        if (uploads.ticket.value)
+        {
+            frame_wait_ticket(frames, uploads.ticket, uploads.stage);
+        }
+
+        // before frame_end reuses the slot's readback buffer
+        zerus_core__drain_readbacks(engine);
+
+        frame_clear(frames, surface_info, engine->config.clear_color);
+
+        status = frame_end(frames, device_info, surface_info);
+
+        // this frame still presented, the next one rebuilds
+        if (status == FRAME_OUT_OF_DATE)
+        {
+            surface_info->events->resized = true;
+            status                        = FRAME_OK;
+        }
+    }
+
+    if (status == FRAME_FAILED)
+    {
+        log_error(LOG_CORE,
+                  "frame %llu failed\n",
+                  (unsigned long long) frames->frame_number);
         return false;
     }
 
+    // still out of date means minimized, update_surface sleeps until restored
     return true;
 }
 
+ZERUS_CORE_DEF bool zerus_engine_update(zerus_engine_state_t* engine)
+{
+    // waiting before input is polled keeps the limiter out of the latency
+    frame_pacer_wait(&engine->pacer);
+
+    arena_reset(&engine->frame_arena);
+    gpu_memory_update_budget(engine->gpu_memory, &engine->device_info);
+
+    io_queue_poll(engine->io);
+
+    // frame boundary, the only place new shaders become visible
+    shader_watcher_poll(engine->shaders);
+
+    uint64_t frame_count = engine->config.frame_count;
+    if (frame_count && engine->frames.frame_number >= frame_count)
+    {
+        return false;
+    }
+
+    if (!engine->config.headless
+        && update_surface(&engine->surface_info) == SURFACE_SHOULD_CLOSE)
+    {
+        return false;
+    }
+
+    engine->frames.input_ns = time_now_ns();
+    if (engine->start_ns == 0)
+    {
+        engine->start_ns = engine->frames.input_ns;
+    }
+
+    bool running = zerus_core__render(engine);
+
+    if (engine->first_frame_ns == 0 && engine->frames.frame_number > 0)
+    {
+        engine->first_frame_ns = time_now_ns();
+        log_info(LOG_CORE,
+                 "time to first frame: %.1f ms\n",
+                 time_ns_to_ms(engine->first_frame_ns - engine->init_ns));
+    }
+
+    return running;
+}
+
 ZERUS_CORE_DEF void zerus_engine_start(zerus_engine_state_t* engine)
 {
     if (!engine->initialized)
@@ -314,25 +1039,49 @@ ZERUS_CORE_DEF void zerus_engine_start(zerus_engine_state_t* engine)
 
 ZERUS_CORE_DEF void zerus_engine_shutdown(zerus_engine_state_t* engine)
 {
-    printf("Shutting down subsystems...\n");
+    log_info(LOG_CORE, "Shutting down subsystems...\n");
 
     if (engine->initialized)
     {
-        destroy_debug_utils_messenger(engine->instance,
-                                      engine->debug_messenger);
+        // the last frames in flight still have readbacks to deliver
+        if (engine->frames.readback
+            && frames_flush(&engine->frames, &engine->device_info))
+        {
+            zerus_core__drain_readbacks(engine);
+        }
+
+        uint64_t frames = engine->frames.frame_number;
+        if (frames)
+        {
+            double ms = time_ns_to_ms(time_now_ns() - engine->start_ns);
+            log_info(LOG_CORE,
+                     "rendered %llu frames in %.1f ms (%.1f fps)\n",
+                     (unsigned long long) frames,
+                     ms,
+                     (double) frames * 1000.0 / ms);
+        }
 
-        destroy_surface(engine->alloc,
-                        engine->instance,
-                        engine->device_info,
-                        &engine->surface_info);
+        frame_latency_t latency = engine->frames.latency;
+        if (latency.samples && !engine->config.headless)
+        {
+            log_info(LOG_CORE,
+                     "input to present latency: %.2f ms mean, %.2f ms max "
+                     "over %llu frames\n",
+                     latency.mean_ms,
+                     latency.max_ms,
+                     (unsigned long long) latency.samples);
+        }
 
-        // maybe should be in a function like free_device_info
-        vkDestroyDevice(engine->device_info.device, nullptr);
+        save_pipeline_cache(
+            engine->alloc, &engine->device_info, ZERUS_PIPELINE_CACHE_PATH);
 
-        vkDestroyInstance(engine->instance, nullptr);
+        zerus_core__destroy(engine);
 
         engine->initialized = false;
     }
+
+    // every thread that logs has been joined by now
+    log_shutdown();
 }
 
 
@@ -5,10 +5,14 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 #include "prelude.h"
+#include "log.h"
 
+#include <string.h>
 
 #include <vulkan/vulkan_core.h>
 
+#include "GLFW/glfw3.h"
+
 typedef enum
 {
     DEVICE_OK,
@@ -38,82 +42,667 @@ list_t* enumerate_devices(allocator* alloc, VkInstance instance)
     return physical_devices;
 }
 
-void _print_queue_flags(VkQueueFlagBits flags)
+void _print_queue_flags(uint32_t index, VkQueueFlagBits flags)
 {
-    printf("Queue flags: 0x%08x (", flags);
+    static const struct
+    {
+        VkQueueFlagBits bit;
+        const char*     name;
+    } names[] = {
+        { VK_QUEUE_GRAPHICS_BIT, "GRAPHICS" },
+        { VK_QUEUE_COMPUTE_BIT, "COMPUTE" },
+        { VK_QUEUE_TRANSFER_BIT, "TRANSFER" },
+        { VK_QUEUE_SPARSE_BINDING_BIT, "SPARSE_BINDING" },
+        { VK_QUEUE_PROTECTED_BIT, "PROTECTED" },
+        // Add other flags as needed...
+    };
 
-    bool first = true;
-    if (flags & VK_QUEUE_GRAPHICS_BIT)
+    // one message per family, the pieces would interleave with other
+    // threads. Every name together fits in `text`.
+    char   text[96] = "";
+    size_t len      = 0;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
     {
-        printf("%sGRAPHICS", first ? "" : " | ");
-        first = false;
+        if (flags & names[i].bit)
+        {
+            if (len)
+            {
+                memcpy(text + len, " | ", 3);
+                len += 3;
+            }
+            size_t name_len = strlen(names[i].name);
+            memcpy(text + len, names[i].name, name_len);
+            len += name_len;
+        }
     }
-    if (flags & VK_QUEUE_COMPUTE_BIT)
+    text[len] = '\0';
+
+    log_debug(LOG_DEVICE,
+              "queue family %u flags: 0x%08x (%s)\n",
+              index,
+              (unsigned) flags,
+              text);
+}
+
+typedef enum
+{
+    QUEUE_GRAPHICS,
+    QUEUE_COMPUTE,   // async compute
+    QUEUE_TRANSFER,  // DMA engine
+    QUEUE_KIND_COUNT
+} queue_kind_t;
+
+// Compute and transfer fall back to the graphics queue when the hardware has
+// no dedicated family, the kinds then share one VkQueue (and its external
+// synchronization) but keep separate timelines
+typedef struct
+{
+    VkQueue  queue;
+    uint32_t family;
+    bool     dedicated;  // own family, ownership transfers are needed
+
+    // signalled by every submit to this kind, see queue.h
+    VkSemaphore timeline;
+    uint64_t    submitted;  // last value a submit will signal
+    uint64_t    completed;  // last value seen signalled, see queue.h
+} device_queue_t;
+
+typedef struct
+{
+    device_error_t             error;
+    VkPhysicalDevice           physical_device;
+    VkPhysicalDeviceProperties properties;
+    VkDevice                   device;
+    device_queue_t             queues[QUEUE_KIND_COUNT];
+
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    bool memory_budget;  // VK_EXT_memory_budget enabled, see gpu_memory.h
+
+    // pass to every vkCreate*Pipelines call, VK_NULL_HANDLE if unavailable
+    VkPipelineCache pipeline_cache;
+    uint64_t        pipeline_cache_hash;  // of the blob loaded from disk
+} device_info_t;
+
+// Index of a memory type allowed by `type_bits` that has all of `flags`,
+// -1 if there is none
+int32_t device_memory_type(const device_info_t*  device_info,
+                           uint32_t              type_bits,
+                           VkMemoryPropertyFlags flags)
+{
+    const VkPhysicalDeviceMemoryProperties* props
+        = &device_info->memory_properties;
+
+    for (uint32_t i = 0; i < props->memoryTypeCount; i++)
     {
-        printf("%sCOMPUTE", first ? "" : " | ");
-        first = false;
+        if ((type_bits & (1u << i))
+            && (props->memoryTypes[i].propertyFlags & flags) == flags)
+        {
+            return (int32_t) i;
+        }
     }
-    if (flags & VK_QUEUE_TRANSFER_BIT)
+
+    return -1;
+}
+
+// A blob is only usable by the exact driver and GPU that produced it, anything
+// else is at best ignored by the driver and at worst crashes it
+static bool device__pipeline_cache_valid(
+    const VkPhysicalDeviceProperties* props, file_view_t blob)
+{
+    VkPipelineCacheHeaderVersionOne header;
+    if (blob.len < sizeof(header))
     {
-        printf("%sTRANSFER", first ? "" : " | ");
-        first = false;
+        return false;
     }
-    if (flags & VK_QUEUE_SPARSE_BINDING_BIT)
+
+    memcpy(&header, blob.data, sizeof(header));
+
+    return header.headerSize >= sizeof(header) && header.headerSize <= blob.len
+           && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+           && header.vendorID == props->vendorID
+           && header.deviceID == props->deviceID
+           && memcmp(header.pipelineCacheUUID,
+                     props->pipelineCacheUUID,
+                     VK_UUID_SIZE)
+                  == 0;
+}
+
+// Seeds the pipeline cache from `blob`, the bytes save_pipeline_cache wrote
+// (may be empty), when it matches this device, otherwise starts empty. The
+// blob needs no device to be read, so it can load while the device is being
+// created. It is only borrowed, the caller frees it afterwards.
+bool create_pipeline_cache(device_info_t* device_info, file_view_t blob)
+{
+    if (blob.len > 0
+        && !device__pipeline_cache_valid(&device_info->properties, blob))
     {
-        printf("%sSPARSE_BINDING", first ? "" : " | ");
-        first = false;
+        log_warn(LOG_DEVICE, "pipeline cache is stale, starting empty\n");
+        blob = (file_view_t) { 0 };
     }
-    if (flags & VK_QUEUE_PROTECTED_BIT)
+
+    VkPipelineCacheCreateInfo create_info = {
+        .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = blob.len,
+        .pInitialData    = blob.data,
+    };
+
+    VkResult res = vkCreatePipelineCache(device_info->device,
+                                         &create_info,
+                                         nullptr,
+                                         &device_info->pipeline_cache);
+
+    // the driver may still reject a blob that looked fine, retry empty
+    if (res != VK_SUCCESS && blob.len > 0)
+    {
+        create_info.initialDataSize = 0;
+        create_info.pInitialData    = nullptr;
+        res = vkCreatePipelineCache(device_info->device,
+                                    &create_info,
+                                    nullptr,
+                                    &device_info->pipeline_cache);
+        blob = (file_view_t) { 0 };
+    }
+
+    if (res != VK_SUCCESS)
+    {
+        log_error(LOG_DEVICE, "failed to create pipeline cache %d\n", res);
+        device_info->pipeline_cache = VK_NULL_HANDLE;
+        return false;
+    }
+
+    if (blob.len > 0)
+    {
+        log_info(LOG_DEVICE, "pipeline cache: loaded %zu bytes\n", blob.len);
+        device_info->pipeline_cache_hash
+            = hash_bytes(blob.data, blob.len, HASH_SEED);
+    }
+
+    return true;
+}
+
+// Writes the cache back through a temporary file and rename. Skipped when
+// nothing was added since it was loaded.
+bool save_pipeline_cache(allocator*           alloc,
+                         const device_info_t* device_info,
+                         const char*          path)
+{
+    if (!device_info->pipeline_cache || !path)
+    {
+        return false;
+    }
+
+    size_t size = 0;
+    if (vkGetPipelineCacheData(
+            device_info->device, device_info->pipeline_cache, &size, nullptr)
+            != VK_SUCCESS
+        || size == 0)
+    {
+        return false;
+    }
+
+    char* data = alloc->malloc((ptrdiff_t) size, alloc->ctx);
+    if (!data)
+    {
+        return false;
+    }
+
+    bool success = vkGetPipelineCacheData(device_info->device,
+                                          device_info->pipeline_cache,
+                                          &size,
+                                          data)
+                   == VK_SUCCESS;
+
+    uint64_t hash = success ? hash_bytes(data, size, HASH_SEED) : 0;
+    if (success && hash != device_info->pipeline_cache_hash)
     {
-        printf("%sPROTECTED", first ? "" : " | ");
-        first = false;
+        success = write_file_atomic(path, data, size);
+        if (!success)
+        {
+            log_error(LOG_DEVICE, "failed to write pipeline cache %s\n", path);
+        }
     }
-    // Add other flags as needed...
 
-    printf(")\n");
+    alloc->free(data, alloc->ctx);
+    return success;
+}
+
+void destroy_pipeline_cache(device_info_t* device_info)
+{
+    if (device_info->pipeline_cache)
+    {
+        vkDestroyPipelineCache(
+            device_info->device, device_info->pipeline_cache, nullptr);
+        device_info->pipeline_cache = VK_NULL_HANDLE;
+    }
 }
 
+// Every device must support these, the swapchain goes last so headless runs
+// can drop it
+static const char* const device__extensions[] = {
+    VK_KHR_SPIRV_1_4_EXTENSION_NAME,
+    VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+    VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+};
+
+#define DEVICE_EXTENSION_COUNT                                                 \
+    (sizeof(device__extensions) / sizeof(device__extensions[0]))
+
+// Enabled when present, device_info_t records which ones were
+static const char* const device__optional_extensions[] = {
+    VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+};
+
+#define DEVICE_OPTIONAL_EXTENSION_COUNT                                        \
+    (sizeof(device__optional_extensions)                                      \
+     / sizeof(device__optional_extensions[0]))
+
 typedef struct
 {
-    device_error_t   error;
-    VkPhysicalDevice physical_device;
-    VkDevice         device;
-    VkQueue          graphics_queue;
-    VkQueue          compute_queue;
-} device_info_t;
+    VkPhysicalDevice           physical_device;
+    VkPhysicalDeviceProperties properties;
+    uint8_t                    uuid[VK_UUID_SIZE];
+    int64_t                    score;  // negative when the device is unusable
+} device_candidate_t;
+
+// Device type dominates, so a CPU implementation only wins when nothing else
+// can run the engine and an integrated GPU never beats a discrete one
+static int64_t device__type_score(VkPhysicalDeviceType type)
+{
+    switch (type)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+            return 100000;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+            return 50000;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+            return 20000;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:
+            return 1000;
+        default:
+            return 0;
+    }
+}
 
-device_info_t pick_device(allocator* alloc, VkInstance instance)
+// The device's extensions, taken from `scratch`. NULL when there are none.
+static VkExtensionProperties* device__extension_properties(
+    allocator* scratch, VkPhysicalDevice device, uint32_t* count)
 {
-    device_info_t device_info = { 0 };
+    *count = 0;
+    vkEnumerateDeviceExtensionProperties(device, NULL, count, NULL);
 
-    list_t* physical_devices = enumerate_devices(alloc, instance);
+    VkExtensionProperties* available = scratch->malloc(
+        (ptrdiff_t) (*count * sizeof(VkExtensionProperties)), scratch->ctx);
+    if (!available)
+    {
+        *count = 0;
+        return NULL;
+    }
 
-    VkPhysicalDevice choosen_device = nullptr;
+    vkEnumerateDeviceExtensionProperties(device, NULL, count, available);
+    return available;
+}
 
-    for (uint32_t i = 0; i < physical_devices->len; i++)
+static bool device__extension_listed(const VkExtensionProperties* available,
+                                     uint32_t                     count,
+                                     const char*                  name)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (strcmp(available[i].extensionName, name) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool device__has_extensions(allocator*       scratch,
+                                   VkPhysicalDevice device,
+                                   uint32_t         required_count)
+{
+    uint32_t               count;
+    VkExtensionProperties* available
+        = device__extension_properties(scratch, device, &count);
+
+    for (uint32_t r = 0; r < required_count; r++)
+    {
+        if (!device__extension_listed(available, count, device__extensions[r]))
+        {
+            log_warn(LOG_DEVICE, "  missing %s\n", device__extensions[r]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Scores one device, negative if it lacks something the engine needs. Ties
+// between devices of one type go to the larger device-local heap, then to
+// dedicated compute and transfer families. A `presentable` device must be
+// able to present from its graphics family, frames present on that queue.
+static int64_t device__score(allocator*                        scratch,
+                             VkInstance                        instance,
+                             VkPhysicalDevice                  device,
+                             const VkPhysicalDeviceProperties* props,
+                             bool                              presentable)
+{
+    // the frame loop calls the core 1.3 vkQueueSubmit2/vkCmdPipelineBarrier2
+    // and the 1.2 timeline semaphore functions, not their KHR aliases
+    if (props->apiVersion < VK_API_VERSION_1_3)
     {
-        VkPhysicalDevice device = physical_devices->data[i];
+        log_warn(LOG_DEVICE, "  Vulkan 1.3 not supported\n");
+        return -1;
+    }
+
+    uint32_t required = presentable ? DEVICE_EXTENSION_COUNT
+                                    : DEVICE_EXTENSION_COUNT - 1;
+    if (!device__has_extensions(scratch, device, required))
+    {
+        return -1;
+    }
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+    };
+    VkPhysicalDeviceSynchronization2Features sync2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+        .pNext = &timeline,
+    };
+    VkPhysicalDeviceFeatures2 features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &sync2,
+    };
+    vkGetPhysicalDeviceFeatures2(device, &features);
+    if (!sync2.synchronization2)
+    {
+        log_warn(LOG_DEVICE, "  synchronization2 not supported\n");
+        return -1;
+    }
+    if (!timeline.timelineSemaphore)
+    {
+        log_warn(LOG_DEVICE, "  timeline semaphores not supported\n");
+        return -1;
+    }
+
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &family_count, NULL);
+
+    VkQueueFamilyProperties* families = scratch->malloc(
+        (ptrdiff_t) (family_count * sizeof(VkQueueFamilyProperties)),
+        scratch->ctx);
+    if (!families)
+    {
+        return -1;
+    }
 
-        VkPhysicalDeviceProperties props;
-        vkGetPhysicalDeviceProperties(device, &props);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &family_count, families);
 
-        // picking the first discrete gpu for simplicity
-        if (props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
+    // the family pick_device will use for graphics
+    uint32_t graphics = -1u;
+    int64_t  score    = device__type_score(props->deviceType);
+    for (uint32_t i = 0; i < family_count; i++)
+    {
+        VkQueueFlags flags = families[i].queueFlags;
+        if (flags & VK_QUEUE_GRAPHICS_BIT)
+        {
+            if (graphics == -1u && families[i].queueCount > 0)
+            {
+                graphics = i;
+            }
+        }
+        else if (flags & VK_QUEUE_COMPUTE_BIT)
+        {
+            score += 500;  // async compute
+        }
+        else if (flags & VK_QUEUE_TRANSFER_BIT)
         {
-            choosen_device = device;
-            printf("found discrete GPU device\n");
-            break;
+            score += 250;  // copy engine
         }
     }
 
-    if (choosen_device == nullptr)
+    if (graphics == -1u)
+    {
+        log_warn(LOG_DEVICE, "  no graphics queue\n");
+        return -1;
+    }
+
+    // needs no surface yet, and GLFW allows it from any thread
+    if (presentable
+        && !glfwGetPhysicalDevicePresentationSupport(
+            instance, device, graphics))
+    {
+        log_warn(LOG_DEVICE, "  graphics queue cannot present\n");
+        return -1;
+    }
+
+    // 1 point per 16 MiB of VRAM, 24 GiB is worth 1536
+    VkPhysicalDeviceMemoryProperties memory;
+    vkGetPhysicalDeviceMemoryProperties(device, &memory);
+    for (uint32_t i = 0; i < memory.memoryHeapCount; i++)
+    {
+        if (memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+        {
+            score += (int64_t) (memory.memoryHeaps[i].size >> 24);
+        }
+    }
+
+    return score;
+}
+
+static int device__hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+// Accepts 32 hex digits, dashes anywhere are ignored
+static bool device__parse_uuid(const char* text, uint8_t uuid[VK_UUID_SIZE])
+{
+    uint32_t digits = 0;
+    for (; *text; text++)
+    {
+        if (*text == '-')
+        {
+            continue;
+        }
+
+        int value = device__hex_digit(*text);
+        if (value < 0 || digits == VK_UUID_SIZE * 2)
+        {
+            return false;
+        }
+
+        if (digits % 2 == 0)
+        {
+            uuid[digits / 2] = (uint8_t) (value << 4);
+        }
+        else
+        {
+            uuid[digits / 2] |= (uint8_t) value;
+        }
+
+        digits++;
+    }
+
+    return digits == VK_UUID_SIZE * 2;
+}
+
+static bool device__matches(const device_candidate_t* candidate,
+                            const char*               name_or_uuid)
+{
+    uint8_t uuid[VK_UUID_SIZE];
+    if (device__parse_uuid(name_or_uuid, uuid))
+    {
+        return memcmp(uuid, candidate->uuid, VK_UUID_SIZE) == 0;
+    }
+
+    return strstr(candidate->properties.deviceName, name_or_uuid) != NULL;
+}
+
+// Scores every device and returns the index of the one to use, -1 if none is
+// usable. A usable device matching `name_or_uuid` (a deviceName substring or
+// a deviceUUID, may be NULL) wins regardless of score.
+static int32_t device__select(allocator*          scratch,
+                              VkInstance          instance,
+                              device_candidate_t* candidates,
+                              uint32_t            count,
+                              bool                presentable,
+                              const char*         name_or_uuid)
+{
+    int32_t best       = -1;
+    int32_t overridden = -1;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        device_candidate_t* candidate = &candidates[i];
+
+        VkPhysicalDeviceIDProperties id = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+        };
+        VkPhysicalDeviceProperties2 props = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &id,
+        };
+
+        vkGetPhysicalDeviceProperties(candidate->physical_device,
+                                      &candidate->properties);
+        if (candidate->properties.apiVersion >= VK_API_VERSION_1_1)
+        {
+            vkGetPhysicalDeviceProperties2(candidate->physical_device, &props);
+            memcpy(candidate->uuid, id.deviceUUID, VK_UUID_SIZE);
+        }
+
+        log_debug(LOG_DEVICE,
+                  "device %u: %s\n",
+                  i,
+                  candidate->properties.deviceName);
+
+        candidate->score = device__score(scratch,
+                                         instance,
+                                         candidate->physical_device,
+                                         &candidate->properties,
+                                         presentable);
+        if (candidate->score < 0)
+        {
+            continue;
+        }
+
+        log_debug(LOG_DEVICE, "  score %lld\n", (long long) candidate->score);
+
+        if (best < 0 || candidate->score > candidates[best].score)
+        {
+            best = (int32_t) i;
+        }
+
+        if (overridden < 0 && name_or_uuid
+            && device__matches(candidate, name_or_uuid))
+        {
+            overridden = (int32_t) i;
+        }
+    }
+
+    if (name_or_uuid && overridden < 0)
+    {
+        log_warn(LOG_DEVICE,
+                 "no usable device matches \"%s\", picking by score\n",
+                 name_or_uuid);
+    }
+
+    return overridden >= 0 ? overridden : best;
+}
+
+// First family that has all of `wanted` and none of `unwanted`, -1u if none.
+// A family without `unwanted` is a dedicated engine that runs concurrently
+// with the graphics queue.
+static uint32_t device__find_family(const VkQueueFamilyProperties* families,
+                                    uint32_t                       count,
+                                    VkQueueFlags                   wanted,
+                                    VkQueueFlags                   unwanted)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        VkQueueFlags flags = families[i].queueFlags;
+        if ((flags & wanted) == wanted && !(flags & unwanted)
+            && families[i].queueCount > 0)
+        {
+            return i;
+        }
+    }
+
+    return -1u;
+}
+
+// The device list and queue family properties are transient, they are taken
+// from `scratch` (usually the frame arena) and never freed here. The pipeline
+// cache is left to create_pipeline_cache. `presentable` enables
+// VK_KHR_swapchain, headless runs leave it off since it is missing on some
+// software and compute-only drivers. `device_override` forces a device by
+// deviceName substring or deviceUUID, NULL picks the highest scoring one.
+device_info_t pick_device(allocator*  scratch,
+                          VkInstance  instance,
+                          bool        presentable,
+                          const char* device_override)
+{
+    device_info_t device_info = { 0 };
+
+    list_t* physical_devices = enumerate_devices(scratch, instance);
+    if (!physical_devices)
+    {
+        device_info.error = DEVICE_NOT_FOUND;
+        return device_info;
+    }
+
+    device_candidate_t* candidates = scratch->malloc(
+        (ptrdiff_t) (physical_devices->len * sizeof(device_candidate_t)),
+        scratch->ctx);
+    if (!candidates)
+    {
+        device_info.error = DEVICE_NOT_FOUND;
+        return device_info;
+    }
+
+    for (uint32_t i = 0; i < physical_devices->len; i++)
+    {
+        candidates[i] = (device_candidate_t) {
+            .physical_device = physical_devices->data[i],
+        };
+    }
+
+    int32_t choosen = device__select(scratch,
+                                     instance,
+                                     candidates,
+                                     physical_devices->len,
+                                     presentable,
+                                     device_override);
+    if (choosen < 0)
     {
         device_info.error = DEVICE_NOT_FOUND;
         return device_info;
     }
 
+    VkPhysicalDevice choosen_device = candidates[choosen].physical_device;
+    device_info.properties          = candidates[choosen].properties;
+    log_info(LOG_DEVICE, "using %s\n", device_info.properties.deviceName);
+
     // we found a device
     device_info.physical_device = choosen_device;
+    vkGetPhysicalDeviceMemoryProperties(choosen_device,
+                                        &device_info.memory_properties);
 
     // now lets look for a queue where we will submit the commands
     uint32_t queue_family_count;
@@ -126,74 +715,109 @@ device_info_t pick_device(allocator* alloc, VkInstance instance)
     }
 
     VkQueueFamilyProperties* families
-        = (VkQueueFamilyProperties*) alloc->malloc(
-            queue_family_count * sizeof(VkQueueFamilyProperties), alloc->ctx);
+        = (VkQueueFamilyProperties*) scratch->malloc(
+            queue_family_count * sizeof(VkQueueFamilyProperties),
+            scratch->ctx);
+    if (!families)
+    {
+        device_info.error = QUEUE_FAMILY_NOT_FOUND;
+        return device_info;
+    }
 
     vkGetPhysicalDeviceQueueFamilyProperties(
         choosen_device, &queue_family_count, families);
 
 
-    printf("queue family count: %d \n", queue_family_count);
+    log_debug(LOG_DEVICE, "queue family count: %u\n", queue_family_count);
 
-    uint32_t graphics_queue_index = -1, compute_queue_index = -1;
     for (uint32_t i = 0; i < queue_family_count; i++)
     {
-        VkQueueFamilyProperties queue_family = families[i];
-
-        if (queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT)
-        {
-            graphics_queue_index = i;
-        }
-        else if (queue_family.queueFlags & VK_QUEUE_COMPUTE_BIT)
-        {
-            // check if there is a dedicated compute queue
-            compute_queue_index = i;
-        }
-
-        printf("index %d", i);
-        _print_queue_flags(queue_family.queueFlags);
+        _print_queue_flags(i, families[i].queueFlags);
     }
 
-    if (graphics_queue_index == -1u)
+    uint32_t graphics_family = device__find_family(
+        families, queue_family_count, VK_QUEUE_GRAPHICS_BIT, 0);
+    if (graphics_family == -1u)
     {
         device_info.error = GRAPHICS_QUEUE_NOT_FOUND;
         return device_info;
     }
 
+    // async compute runs beside graphics, transfers go to the DMA engine
+    uint32_t families_by_kind[QUEUE_KIND_COUNT] = {
+        [QUEUE_GRAPHICS] = graphics_family,
+        [QUEUE_COMPUTE]  = device__find_family(families,
+                                              queue_family_count,
+                                              VK_QUEUE_COMPUTE_BIT,
+                                              VK_QUEUE_GRAPHICS_BIT),
+        [QUEUE_TRANSFER] = device__find_family(
+            families,
+            queue_family_count,
+            VK_QUEUE_TRANSFER_BIT,
+            VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT),
+    };
+
+    // one queue per distinct family
     uint32_t                queue_count            = 0;
     float                   default_queue_priority = 1.0f;
-    VkDeviceQueueCreateInfo queue_create_info[2] = { (VkDeviceQueueCreateInfo) {
-        .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueCount       = 1,
-        .queueFamilyIndex = graphics_queue_index,
-        .pQueuePriorities = &default_queue_priority } };
-
-    // if we have a dedicated compute queue, we create a logical one for that
-    if (compute_queue_index != -1u)
+    VkDeviceQueueCreateInfo queue_create_info[QUEUE_KIND_COUNT];
+    for (uint32_t kind = 0; kind < QUEUE_KIND_COUNT; kind++)
     {
-        queue_create_info[1] = (VkDeviceQueueCreateInfo) {
+        uint32_t family = families_by_kind[kind];
+        if (family == -1u)
+        {
+            continue;
+        }
+
+        queue_create_info[queue_count++] = (VkDeviceQueueCreateInfo) {
             .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
             .queueCount       = 1,
-            .queueFamilyIndex = compute_queue_index,
+            .queueFamilyIndex = family,
             .pQueuePriorities = &default_queue_priority
         };
-
-        queue_count++;
     }
 
-    const char* device_extensions[4]
-        = { VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-            VK_KHR_SPIRV_1_4_EXTENSION_NAME,
-            VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
-            VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME };
+    // the frame loop records barriers and submits with synchronization2,
+    // cross-queue dependencies are timeline semaphores
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .timelineSemaphore = VK_TRUE,
+    };
+
+    VkPhysicalDeviceSynchronization2Features sync2_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+        .pNext = &timeline_features,
+        .synchronization2 = VK_TRUE,
+    };
+
+    // the required extensions, VK_KHR_swapchain last, then optional ones
+    const char* extensions[DEVICE_EXTENSION_COUNT
+                           + DEVICE_OPTIONAL_EXTENSION_COUNT];
+    uint32_t    extension_count = presentable ? DEVICE_EXTENSION_COUNT
+                                              : DEVICE_EXTENSION_COUNT - 1;
+    memcpy(extensions, device__extensions, sizeof(device__extensions));
+
+    uint32_t               available_count;
+    VkExtensionProperties* available = device__extension_properties(
+        scratch, choosen_device, &available_count);
+    for (uint32_t i = 0; i < DEVICE_OPTIONAL_EXTENSION_COUNT; i++)
+    {
+        const char* name = device__optional_extensions[i];
+        if (device__extension_listed(available, available_count, name))
+        {
+            extensions[extension_count++] = name;
+            device_info.memory_budget
+                |= strcmp(name, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0;
+        }
+    }
 
     VkDeviceCreateInfo create_info = {
         .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pNext                   = nullptr,
+        .pNext                   = &sync2_features,
         .queueCreateInfoCount    = queue_count,
         .pQueueCreateInfos       = queue_create_info,
-        .enabledExtensionCount   = 4,
-        .ppEnabledExtensionNames = device_extensions,
+        .enabledExtensionCount   = extension_count,
+        .ppEnabledExtensionNames = extensions,
     };
 
     VkResult res = vkCreateDevice(
@@ -204,28 +828,57 @@ device_info_t pick_device(allocator* alloc, VkInstance instance)
         return device_info;
     }
 
+    VkSemaphoreTypeCreateInfo timeline_info = {
+        .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue  = 0,
+    };
 
-    vkGetDeviceQueue(device_info.device,
-                     graphics_queue_index,
-                     0,
-                     &device_info.graphics_queue);
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &timeline_info,
+    };
 
-    if (compute_queue_index == -1u)
+    for (uint32_t kind = 0; kind < QUEUE_KIND_COUNT; kind++)
     {
-        vkGetDeviceQueue(device_info.device,
-                         compute_queue_index,
-                         0,
-                         &device_info.compute_queue);
-    }
-    else
-    {
-        // if not compute queue, we share the queue
-        device_info.compute_queue = device_info.graphics_queue;
+        device_queue_t* queue = &device_info.queues[kind];
+
+        queue->dedicated = families_by_kind[kind] != -1u;
+        queue->family    = queue->dedicated ? families_by_kind[kind]
+                                            : graphics_family;
+        vkGetDeviceQueue(device_info.device, queue->family, 0, &queue->queue);
+
+        if (vkCreateSemaphore(
+                device_info.device, &semaphore_info, nullptr, &queue->timeline)
+            != VK_SUCCESS)
+        {
+            device_info.error = DEVICE_CREATION_FAILED;
+            return device_info;
+        }
     }
 
-    alloc->free(families, alloc->ctx);
-    alloc->free(physical_devices, alloc->ctx);
+    log_info(LOG_DEVICE,
+             "queues: graphics %u, compute %u%s, transfer %u%s\n",
+             device_info.queues[QUEUE_GRAPHICS].family,
+             device_info.queues[QUEUE_COMPUTE].family,
+             device_info.queues[QUEUE_COMPUTE].dedicated ? "" : " (shared)",
+             device_info.queues[QUEUE_TRANSFER].family,
+             device_info.queues[QUEUE_TRANSFER].dedicated ? "" : " (shared)");
 
     return device_info;
 }
+
+// Destroys the queue timelines and the device, the caller drains the queues
+// and destroys everything created from the device first
+void destroy_device(device_info_t* device_info)
+{
+    for (uint32_t kind = 0; kind < QUEUE_KIND_COUNT; kind++)
+    {
+        vkDestroySemaphore(
+            device_info->device, device_info->queues[kind].timeline, nullptr);
+    }
+
+    vkDestroyDevice(device_info->device, nullptr);
+    device_info->device = VK_NULL_HANDLE;
+}
 #endif  // DEVICE_H
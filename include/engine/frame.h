@@ -0,0 +1,903 @@
+//
+// Frames in flight.
+//
+// Each of the N frame slots owns a command pool, a primary command buffer,
+// the semaphore its swapchain image is acquired with and the graphics
+// timeline ticket of its last submission (see queue.h). frame_begin only
+// waits for the ticket of the slot it is about to reuse, so the CPU records
+// frame N+1 while the GPU is still executing frame N.
+//
+// The render-finished semaphore waited on by present belongs to the swapchain
+// image rather than the slot. The presentation engine holds it until that
+// image is acquired again, which can be later than the slot comes round when
+// there are more images than slots.
+//
+// A resized or out-of-date swapchain is rebuilt with the old one as
+// oldSwapchain. The old swapchain, its views and its render-finished
+// semaphores are retired with the ticket of the first submit after them, and
+// frames_collect destroys them once it completed. Objects handed to
+// frames_defer_destroy are released the same way. Resizing never idles the
+// device.
+//
+// Headless runs hand in a surface without a swapchain (see offscreen.h). The
+// slot renders into its own image, nothing is acquired or presented, and
+// with readback enabled every frame is copied into a host-visible buffer of
+// the slot, collected with frames_take_readback once its ticket completed.
+//
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "device.h"
+#include "gpu_memory.h"
+#include "surface.h"
+#include "pacing.h"
+#include "queue.h"
+
+#ifndef FRAME_MAX_IN_FLIGHT
+#define FRAME_MAX_IN_FLIGHT 4
+#endif
+
+#ifndef FRAME_DEFAULT_IN_FLIGHT
+#define FRAME_DEFAULT_IN_FLIGHT 2
+#endif
+
+// Swapchains awaiting destruction, a window drag recreates one per frame
+#ifndef FRAME_MAX_RETIRED
+#define FRAME_MAX_RETIRED 8
+#endif
+
+typedef enum
+{
+    FRAME_OK,
+    FRAME_OUT_OF_DATE,  // swapchain no longer matches the surface
+    FRAME_FAILED
+} frame_status_t;
+
+typedef struct
+{
+    VkCommandPool   command_pool;
+    VkCommandBuffer command_buffer;
+    VkSemaphore     image_acquired;
+    queue_ticket_t  ticket;  // graphics timeline, last submission
+
+    // the last submission has not been seen retired yet
+    bool     submitted;
+    uint64_t submitted_frame;
+
+    // input poll the submitted frame was built after, 0 once measured
+    uint64_t input_ns;
+
+    // host copy of the slot's image, headless readback only
+    VkBuffer         readback;
+    gpu_allocation_t readback_allocation;
+    bool             readback_ready;
+} frame_slot_t;
+
+// Pixels stay valid until the slot records its next frame
+typedef struct
+{
+    const void* pixels;
+    VkExtent2D  extent;
+    VkFormat    format;
+    uint32_t    row_pitch;
+    uint64_t    frame_number;
+} frame_readback_t;
+
+typedef struct
+{
+    queue_ticket_t free_after;  // first submit after the retirement
+    surface_info_t surface;     // swapchain, images and views only
+    uint32_t       image_count;
+    VkSemaphore*   render_finished;
+} frame_retired_t;
+
+typedef struct
+{
+    uint32_t     count;
+    uint32_t     current;
+    uint64_t     frame_number;
+    frame_slot_t slots[FRAME_MAX_IN_FLIGHT];
+
+    // swapchain image acquired by the frame being recorded
+    uint32_t image_index;
+
+    // set by the caller when it polls input, frame_end tags the submission
+    uint64_t        input_ns;
+    frame_latency_t latency;
+
+    // other queues' work the frame being recorded depends on
+    uint32_t     wait_count;
+    queue_wait_t waits[QUEUE_KIND_COUNT];
+
+    uint32_t     image_count;
+    VkSemaphore* render_finished;  // one per swapchain image
+
+    uint32_t        retired_count;  // oldest first
+    frame_retired_t retired[FRAME_MAX_RETIRED];
+
+    queue_deletions_t deletions;
+
+    bool          readback;
+    VkDeviceSize  readback_size;
+    gpu_memory_t* readback_memory;  // the buffers' allocator
+} frames_t;
+
+static void frames__destroy_semaphores(allocator*   alloc,
+                                       VkDevice     device,
+                                       VkSemaphore* semaphores,
+                                       uint32_t     count)
+{
+    if (!semaphores)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vkDestroySemaphore(device, semaphores[i], nullptr);
+    }
+
+    alloc->free(semaphores, alloc->ctx);
+}
+
+// Creates `count` semaphores, NULL on failure
+static VkSemaphore* frames__create_semaphores(allocator* alloc,
+                                              VkDevice   device,
+                                              uint32_t   count)
+{
+    VkSemaphore* semaphores = alloc->malloc(
+        (ptrdiff_t) (count * sizeof(VkSemaphore)), alloc->ctx);
+    if (!semaphores)
+    {
+        return NULL;
+    }
+
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphores[i])
+            != VK_SUCCESS)
+        {
+            log_error(LOG_FRAME, "failed to create present semaphore %u\n", i);
+            frames__destroy_semaphores(alloc, device, semaphores, i);
+            return NULL;
+        }
+    }
+
+    return semaphores;
+}
+
+static void frames__destroy_retired(allocator*           alloc,
+                                    const device_info_t* device_info,
+                                    frame_retired_t*     retired)
+{
+    destroy_retired_swapchain(alloc, device_info, &retired->surface);
+    frames__destroy_semaphores(alloc,
+                               device_info->device,
+                               retired->render_finished,
+                               retired->image_count);
+}
+
+// Destroys retired swapchains and deferred objects the GPU is done with.
+// Never blocks, call once per frame.
+void frames_collect(allocator*     alloc,
+                    frames_t*      frames,
+                    device_info_t* device_info)
+{
+    queue_collect(device_info, &frames->deletions);
+
+    uint32_t done = 0;
+    while (done < frames->retired_count
+           && queue_ticket_done(device_info, frames->retired[done].free_after))
+    {
+        frames__destroy_retired(alloc, device_info, &frames->retired[done]);
+        done++;
+    }
+
+    if (done == 0)
+    {
+        return;
+    }
+
+    frames->retired_count -= done;
+    memmove(frames->retired,
+            frames->retired + done,
+            frames->retired_count * sizeof(frame_retired_t));
+}
+
+void frames_destroy(allocator*           alloc,
+                    frames_t*            frames,
+                    const device_info_t* device_info)
+{
+    if (frames->count == 0)
+    {
+        return;
+    }
+
+    VkDevice device = device_info->device;
+
+    // every slot may still be executing
+    vkDeviceWaitIdle(device);
+
+    for (uint32_t i = 0; i < frames->count; i++)
+    {
+        frame_slot_t* slot = &frames->slots[i];
+
+        vkDestroySemaphore(device, slot->image_acquired, nullptr);
+        vkDestroyCommandPool(device, slot->command_pool, nullptr);
+
+        if (frames->readback_memory)
+        {
+            gpu_memory_destroy_buffer(alloc,
+                                      frames->readback_memory,
+                                      device_info,
+                                      slot->readback,
+                                      &slot->readback_allocation);
+        }
+    }
+
+    frames__destroy_semaphores(
+        alloc, device, frames->render_finished, frames->image_count);
+
+    for (uint32_t i = 0; i < frames->retired_count; i++)
+    {
+        frames__destroy_retired(alloc, device_info, &frames->retired[i]);
+    }
+
+    queue_deletions_destroy(alloc, device_info, &frames->deletions);
+
+    *frames = (frames_t) { 0 };
+}
+
+// `count` of 0 picks FRAME_DEFAULT_IN_FLIGHT, it is capped at
+// FRAME_MAX_IN_FLIGHT
+uint32_t frames_resolve_count(uint32_t count)
+{
+    if (count == 0)
+    {
+        count = FRAME_DEFAULT_IN_FLIGHT;
+    }
+    if (count > FRAME_MAX_IN_FLIGHT)
+    {
+        count = FRAME_MAX_IN_FLIGHT;
+    }
+
+    return count;
+}
+
+// An offscreen `surface_info` needs one image per slot, see
+// frames_resolve_count
+bool frames_init(allocator*            alloc,
+                 frames_t*             frames,
+                 const device_info_t*  device_info,
+                 const surface_info_t* surface_info,
+                 uint32_t              count)
+{
+    count   = frames_resolve_count(count);
+    *frames = (frames_t) { .count = count };
+
+    VkDevice device = device_info->device;
+
+    VkCommandPoolCreateInfo pool_info = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = device_info->queues[QUEUE_GRAPHICS].family,
+    };
+
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        frame_slot_t* slot = &frames->slots[i];
+
+        if (vkCreateCommandPool(
+                device, &pool_info, nullptr, &slot->command_pool)
+                != VK_SUCCESS
+            || vkCreateSemaphore(
+                   device, &semaphore_info, nullptr, &slot->image_acquired)
+                   != VK_SUCCESS)
+        {
+            log_error(LOG_FRAME, "failed to create frame %u sync objects\n", i);
+            frames_destroy(alloc, frames, device_info);
+            return false;
+        }
+
+        VkCommandBufferAllocateInfo buffer_info = {
+            .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool        = slot->command_pool,
+            .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+
+        if (vkAllocateCommandBuffers(
+                device, &buffer_info, &slot->command_buffer)
+            != VK_SUCCESS)
+        {
+            log_error(
+                LOG_FRAME, "failed to allocate frame %u command buffer\n", i);
+            frames_destroy(alloc, frames, device_info);
+            return false;
+        }
+    }
+
+    // offscreen targets are never presented
+    if (surface_info->swapchain == VK_NULL_HANDLE)
+    {
+        return true;
+    }
+
+    frames->render_finished
+        = frames__create_semaphores(alloc, device, surface_info->image_count);
+    if (!frames->render_finished)
+    {
+        frames_destroy(alloc, frames, device_info);
+        return false;
+    }
+
+    frames->image_count = surface_info->image_count;
+    return true;
+}
+
+// Rebuilds the swapchain for the surface's current size and retires the old
+// one. Frames already submitted keep presenting to the old swapchain, the
+// next frame_begin acquires from the new one. FRAME_OUT_OF_DATE means the
+// window is minimized and there is nothing to render to yet.
+frame_status_t frames_recreate_swapchain(allocator*      alloc,
+                                         frames_t*       frames,
+                                         device_info_t*  device_info,
+                                         surface_info_t* surface_info)
+{
+    VkDevice device = device_info->device;
+
+    // only reachable if the GPU falls FRAME_MAX_RETIRED resizes behind,
+    // draining the slots then frees every retired swapchain at once
+    if (frames->retired_count == FRAME_MAX_RETIRED)
+    {
+        queue_ticket_t last = {
+            .queue = QUEUE_GRAPHICS,
+            .value = device_info->queues[QUEUE_GRAPHICS].submitted,
+        };
+
+        if (!queue_wait_ticket(device_info, last, UINT64_MAX))
+        {
+            return FRAME_FAILED;
+        }
+
+        for (uint32_t i = 0; i < frames->retired_count; i++)
+        {
+            frames__destroy_retired(alloc, device_info, &frames->retired[i]);
+        }
+
+        frames->retired_count = 0;
+    }
+
+    frame_retired_t retired = {
+        .image_count     = frames->image_count,
+        .render_finished = frames->render_finished,
+    };
+
+    surface_status_t status = recreate_swapchain(
+        alloc, device_info, surface_info, &retired.surface);
+    if (status == SURFACE_MINIMIZED)
+    {
+        return FRAME_OUT_OF_DATE;
+    }
+    if (status != SURFACE_OK)
+    {
+        return FRAME_FAILED;
+    }
+
+    // presents are not tracked, the next submit completing covers the one
+    // queued by the last frame submitted to the old swapchain
+    retired.free_after = queue_next_ticket(device_info, QUEUE_GRAPHICS);
+    frames->retired[frames->retired_count++] = retired;
+
+    frames->render_finished
+        = frames__create_semaphores(alloc, device, surface_info->image_count);
+    frames->image_count = surface_info->image_count;
+    if (!frames->render_finished)
+    {
+        frames->image_count = 0;
+        return FRAME_FAILED;
+    }
+
+    return FRAME_OK;
+}
+
+// Gives every slot a host-visible buffer its image is copied into at the end
+// of each frame. Cached memory is preferred, reading back from write-combined
+// memory is several times slower. Offscreen surfaces only.
+bool frames_enable_readback(allocator*            alloc,
+                            gpu_memory_t*         memory,
+                            frames_t*             frames,
+                            const device_info_t*  device_info,
+                            const surface_info_t* surface_info)
+{
+    // OFFSCREEN_FORMAT and the swapchain formats are all 4 bytes per texel
+    frames->readback_size   = (VkDeviceSize) surface_info->extent.width
+                              * surface_info->extent.height * 4;
+    frames->readback_memory = memory;
+
+    VkBufferCreateInfo buffer_info = {
+        .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size        = frames->readback_size,
+        .usage       = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    gpu_memory_request_t request = {
+        .required  = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        .preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+    };
+
+    for (uint32_t i = 0; i < frames->count; i++)
+    {
+        frame_slot_t* slot = &frames->slots[i];
+
+        if (!gpu_memory_create_buffer(alloc,
+                                      memory,
+                                      device_info,
+                                      &buffer_info,
+                                      &request,
+                                      &slot->readback,
+                                      &slot->readback_allocation)
+            || !slot->readback_allocation.mapped)
+        {
+            log_error(LOG_FRAME, "failed to create readback buffer %u\n", i);
+            return false;
+        }
+    }
+
+    frames->readback = true;
+    return true;
+}
+
+frame_slot_t* frame_current(frames_t* frames)
+{
+    return &frames->slots[frames->current];
+}
+
+// The slot's ticket completed, everything it submitted is done
+static void frames__retired(frames_t*            frames,
+                            const device_info_t* device_info,
+                            frame_slot_t*        slot)
+{
+    if (!slot->submitted)
+    {
+        return;
+    }
+
+    slot->submitted = false;
+
+    if (slot->input_ns != 0)
+    {
+        frame_latency_record(&frames->latency, time_now_ns() - slot->input_ns);
+        slot->input_ns = 0;
+    }
+
+    if (frames->readback)
+    {
+        gpu_memory_invalidate(device_info, &slot->readback_allocation);
+        slot->readback_ready = true;
+    }
+}
+
+// Handles submissions that retired since the last call: samples latency and
+// makes readbacks available. Reads the graphics timeline once, never
+// blocks; the latency resolution is one call interval.
+void frames_poll(frames_t* frames, device_info_t* device_info)
+{
+    uint64_t completed = queue_completed(device_info, QUEUE_GRAPHICS);
+
+    for (uint32_t i = 0; i < frames->count; i++)
+    {
+        frame_slot_t* slot = &frames->slots[i];
+        if (slot->submitted && slot->ticket.value <= completed)
+        {
+            frames__retired(frames, device_info, slot);
+        }
+    }
+}
+
+// Blocks until every submitted frame retired, so the last readbacks can be
+// taken before shutdown
+bool frames_flush(frames_t* frames, device_info_t* device_info)
+{
+    for (uint32_t i = 0; i < frames->count; i++)
+    {
+        frame_slot_t* slot = &frames->slots[i];
+        if (!slot->submitted)
+        {
+            continue;
+        }
+
+        if (!queue_wait_ticket(device_info, slot->ticket, UINT64_MAX))
+        {
+            return false;
+        }
+
+        frames__retired(frames, device_info, slot);
+    }
+
+    return true;
+}
+
+// Oldest completed frame not taken yet, false when there is none. A readback
+// is overwritten when its slot records again, take them between frame_begin
+// and frame_end.
+bool frames_take_readback(frames_t*             frames,
+                          const surface_info_t* surface_info,
+                          frame_readback_t*     readback)
+{
+    frame_slot_t* oldest = NULL;
+    for (uint32_t i = 0; i < frames->count; i++)
+    {
+        frame_slot_t* slot = &frames->slots[i];
+        if (slot->readback_ready
+            && (!oldest || slot->submitted_frame < oldest->submitted_frame))
+        {
+            oldest = slot;
+        }
+    }
+
+    if (!oldest)
+    {
+        return false;
+    }
+
+    oldest->readback_ready = false;
+
+    *readback = (frame_readback_t) {
+        .pixels       = oldest->readback_allocation.mapped,
+        .extent       = surface_info->extent,
+        .format       = surface_info->image_format,
+        .row_pitch    = surface_info->extent.width * 4,
+        .frame_number = oldest->submitted_frame,
+    };
+
+    return true;
+}
+
+// Waits until the slot's previous submission retired, acquires the next
+// swapchain image and opens the slot's command buffer for recording
+frame_status_t frame_begin(frames_t*             frames,
+                           device_info_t*        device_info,
+                           const surface_info_t* surface_info)
+{
+    VkDevice      device = device_info->device;
+    frame_slot_t* slot   = frame_current(frames);
+
+    if (!queue_wait_ticket(device_info, slot->ticket, UINT64_MAX))
+    {
+        return FRAME_FAILED;
+    }
+
+    frames__retired(frames, device_info, slot);
+
+    if (surface_info->swapchain == VK_NULL_HANDLE)
+    {
+        // offscreen, the slot's own image is free once its ticket completed
+        frames->image_index = frames->current % surface_info->image_count;
+    }
+    else
+    {
+        VkResult res = vkAcquireNextImageKHR(device,
+                                             surface_info->swapchain,
+                                             UINT64_MAX,
+                                             slot->image_acquired,
+                                             VK_NULL_HANDLE,
+                                             &frames->image_index);
+        if (res == VK_ERROR_OUT_OF_DATE_KHR)
+        {
+            return FRAME_OUT_OF_DATE;
+        }
+        if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR)
+        {
+            return FRAME_FAILED;
+        }
+    }
+
+    vkResetCommandPool(device, slot->command_pool, 0);
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    if (vkBeginCommandBuffer(slot->command_buffer, &begin_info) != VK_SUCCESS)
+    {
+        return FRAME_FAILED;
+    }
+
+    return FRAME_OK;
+}
+
+static void frame__image_barrier(VkCommandBuffer       command_buffer,
+                                 VkImage               image,
+                                 VkPipelineStageFlags2 src_stage,
+                                 VkAccessFlags2        src_access,
+                                 VkPipelineStageFlags2 dst_stage,
+                                 VkAccessFlags2        dst_access,
+                                 VkImageLayout         old_layout,
+                                 VkImageLayout         new_layout)
+{
+    VkImageMemoryBarrier2 barrier = {
+        .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .srcStageMask        = src_stage,
+        .srcAccessMask       = src_access,
+        .dstStageMask        = dst_stage,
+        .dstAccessMask       = dst_access,
+        .oldLayout           = old_layout,
+        .newLayout           = new_layout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image               = image,
+        .subresourceRange    = (VkImageSubresourceRange) {
+            .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+            .levelCount     = 1,
+            .layerCount     = 1,
+        },
+    };
+
+    VkDependencyInfo dependency = {
+        .sType                   = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers    = &barrier,
+    };
+
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+}
+
+// Records a clear of the acquired image and leaves it ready to present, or
+// to be copied out when offscreen. The old contents are discarded, the
+// transition starts from UNDEFINED.
+void frame_clear(frames_t*               frames,
+                 const surface_info_t*   surface_info,
+                 const VkClearColorValue color)
+{
+    VkCommandBuffer command_buffer = frame_current(frames)->command_buffer;
+    VkImage         image = surface_info->images[frames->image_index];
+
+    // the source stage matches the acquire semaphore wait in frame_end
+    frame__image_barrier(command_buffer,
+                         image,
+                         VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                         VK_ACCESS_2_NONE,
+                         VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                         VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                         VK_IMAGE_LAYOUT_UNDEFINED,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+    VkImageSubresourceRange range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+
+    vkCmdClearColorImage(command_buffer,
+                         image,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         &color,
+                         1,
+                         &range);
+
+    if (surface_info->swapchain == VK_NULL_HANDLE)
+    {
+        frame__image_barrier(command_buffer,
+                             image,
+                             VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                             VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                             VK_PIPELINE_STAGE_2_COPY_BIT,
+                             VK_ACCESS_2_TRANSFER_READ_BIT,
+                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        return;
+    }
+
+    // the render-finished semaphore signal makes the write visible to present
+    frame__image_barrier(command_buffer,
+                         image,
+                         VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                         VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                         VK_PIPELINE_STAGE_2_NONE,
+                         VK_ACCESS_2_NONE,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+}
+
+// Copies the offscreen image, left in TRANSFER_SRC_OPTIMAL by frame_clear,
+// into the slot's readback buffer and makes it visible to the host once the
+// submission completes
+static void frame__record_readback(frame_slot_t*         slot,
+                                   const surface_info_t* surface_info,
+                                   VkImage               image)
+{
+    VkBufferImageCopy region = {
+        .imageSubresource = (VkImageSubresourceLayers) {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .layerCount = 1,
+        },
+        .imageExtent = (VkExtent3D) {
+            surface_info->extent.width,
+            surface_info->extent.height,
+            1,
+        },
+    };
+
+    vkCmdCopyImageToBuffer(slot->command_buffer,
+                           image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           slot->readback,
+                           1,
+                           &region);
+
+    VkBufferMemoryBarrier2 barrier = {
+        .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+        .srcStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+        .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer              = slot->readback,
+        .size                = VK_WHOLE_SIZE,
+    };
+
+    VkDependencyInfo dependency = {
+        .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers    = &barrier,
+    };
+
+    vkCmdPipelineBarrier2(slot->command_buffer, &dependency);
+}
+
+// Makes the frame being recorded wait, on the GPU, for `ticket` before
+// `stage`. Typically the ticket of an upload or compute submit. Waits on one
+// queue are merged.
+void frame_wait_ticket(frames_t*             frames,
+                       queue_ticket_t        ticket,
+                       VkPipelineStageFlags2 stage)
+{
+    for (uint32_t i = 0; i < frames->wait_count; i++)
+    {
+        queue_wait_t* wait = &frames->waits[i];
+        if (wait->ticket.queue == ticket.queue)
+        {
+            if (ticket.value > wait->ticket.value)
+            {
+                wait->ticket.value = ticket.value;
+            }
+            wait->stage |= stage;
+            return;
+        }
+    }
+
+    frames->waits[frames->wait_count++] = (queue_wait_t) {
+        .ticket = ticket,
+        .stage  = stage,
+    };
+}
+
+// Destroys `object` once the frame being recorded, and with it every frame
+// before, has completed on the GPU
+void frames_defer_destroy(allocator*       alloc,
+                          frames_t*        frames,
+                          device_info_t*   device_info,
+                          queue_destroy_fn destroy,
+                          void*            object)
+{
+    queue_defer_destroy(alloc,
+                        device_info,
+                        &frames->deletions,
+                        queue_next_ticket(device_info, QUEUE_GRAPHICS),
+                        destroy,
+                        object);
+}
+
+// Submits the slot's command buffer, queues the image for presentation and
+// moves on to the next slot. Never waits on the GPU.
+frame_status_t frame_end(frames_t*             frames,
+                         device_info_t*        device_info,
+                         const surface_info_t* surface_info)
+{
+    frame_slot_t* slot      = frame_current(frames);
+    bool          offscreen = surface_info->swapchain == VK_NULL_HANDLE;
+
+    if (offscreen && frames->readback)
+    {
+        frame__record_readback(
+            slot, surface_info, surface_info->images[frames->image_index]);
+    }
+
+    if (vkEndCommandBuffer(slot->command_buffer) != VK_SUCCESS)
+    {
+        return FRAME_FAILED;
+    }
+
+    VkSemaphore render_finished
+        = offscreen ? VK_NULL_HANDLE
+                    : frames->render_finished[frames->image_index];
+
+    VkSemaphoreSubmitInfo wait_info = {
+        .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = slot->image_acquired,
+        .stageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT
+                     | VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+    };
+
+    VkSemaphoreSubmitInfo signal_info = {
+        .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = render_finished,
+        .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+    };
+
+    queue_submit_t submit = {
+        .command_buffers      = &slot->command_buffer,
+        .command_buffer_count = 1,
+        .waits                = frames->waits,
+        .wait_count           = frames->wait_count,
+        .extra_waits          = &wait_info,
+        .extra_wait_count     = offscreen ? 0 : 1,
+        .extra_signals        = &signal_info,
+        .extra_signal_count   = offscreen ? 0 : 1,
+    };
+
+    queue_ticket_t ticket = queue_submit(device_info, QUEUE_GRAPHICS, &submit);
+    if (ticket.value == 0)
+    {
+        return FRAME_FAILED;
+    }
+
+    frames->wait_count = 0;
+
+    slot->ticket          = ticket;
+    slot->submitted       = true;
+    slot->submitted_frame = frames->frame_number;
+    slot->input_ns        = frames->input_ns;
+    slot->readback_ready  = false;
+
+    if (offscreen)
+    {
+        frames->current = (frames->current + 1) % frames->count;
+        frames->frame_number++;
+        return FRAME_OK;
+    }
+
+    VkPresentInfoKHR present_info = {
+        .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores    = &render_finished,
+        .swapchainCount     = 1,
+        .pSwapchains        = &surface_info->swapchain,
+        .pImageIndices      = &frames->image_index,
+    };
+
+    VkResult res
+        = vkQueuePresentKHR(device_info->queues[QUEUE_GRAPHICS].queue,
+                            &present_info);
+
+    frames->current = (frames->current + 1) % frames->count;
+    frames->frame_number++;
+
+    if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR)
+    {
+        return FRAME_OUT_OF_DATE;
+    }
+
+    return res == VK_SUCCESS ? FRAME_OK : FRAME_FAILED;
+}
+
+#endif  // FRAME_H
@@ -0,0 +1,1067 @@
+//
+// GPU memory sub-allocation.
+//
+// vkAllocateMemory is slow, counts against maxMemoryAllocationCount (4096 on
+// many drivers) and rounds up to large pages, so buffers and images are
+// placed in blocks of device memory instead. Each memory type has two pools
+// of blocks, one for buffers and linear images and one for optimal tiled
+// images. Neighbours within a block then never differ in tiling and
+// bufferImageGranularity needs no padding between them.
+//
+// Blocks are carved up with a two-level segregated fit allocator (TLSF).
+// Free ranges sit in lists indexed by the power of two of their size and a
+// linear subdivision of it, two bitmaps find a fitting list in constant time
+// and a freed range merges with its free neighbours right away. Offsets and
+// sizes are counted in GPU_MEMORY_GRANULE units, which already satisfies the
+// alignment of most resources.
+//
+// Resources the driver wants in an allocation of their own, and anything
+// over half a block, get a dedicated allocation. New device memory is kept
+// within the heap budget, as reported by VK_EXT_memory_budget when the
+// device has it and estimated from the heap size otherwise.
+//
+// Not thread safe, callers sharing one gpu_memory_t lock around it.
+//
+
+#ifndef GPU_MEMORY_H
+#define GPU_MEMORY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "device.h"
+
+// Upper bound, heaps smaller than 8 blocks get proportionally smaller blocks
+#ifndef GPU_MEMORY_BLOCK_SIZE
+#define GPU_MEMORY_BLOCK_SIZE (64ull << 20)
+#endif
+
+#ifndef GPU_MEMORY_GRANULE
+#define GPU_MEMORY_GRANULE 256ull
+#endif
+
+// Share of a heap used as its budget without VK_EXT_memory_budget
+#ifndef GPU_MEMORY_BUDGET_PERCENT
+#define GPU_MEMORY_BUDGET_PERCENT 80
+#endif
+
+#define GPU_MEMORY_SL_LOG2  5
+#define GPU_MEMORY_SL_COUNT (1u << GPU_MEMORY_SL_LOG2)
+#define GPU_MEMORY_FL_COUNT 32
+#define GPU_MEMORY_NONE     UINT32_MAX
+
+typedef enum
+{
+    GPU_MEMORY_LINEAR,   // buffers and linear images
+    GPU_MEMORY_OPTIMAL,  // optimal tiled images
+    GPU_MEMORY_POOL_COUNT
+} gpu_memory_pool_t;
+
+// A range of a block, in granules
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size;
+    uint32_t prev_phys;  // neighbours in the block
+    uint32_t next_phys;
+    uint32_t prev_free;  // free list, next_free also links unused nodes
+    uint32_t next_free;
+    bool     free;
+} gpu_memory_node_t;
+
+typedef struct
+{
+    VkDeviceMemory memory;
+    VkDeviceSize   size;
+    void*          mapped;  // whole block, NULL unless host visible
+    uint32_t       allocations;
+
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[GPU_MEMORY_FL_COUNT];
+    uint32_t heads[GPU_MEMORY_FL_COUNT][GPU_MEMORY_SL_COUNT];
+
+    gpu_memory_node_t* nodes;
+    uint32_t           node_count;
+    uint32_t           node_capacity;
+    uint32_t           unused_nodes;
+} gpu_memory_block_t;
+
+typedef struct
+{
+    gpu_memory_block_t** blocks;
+    uint32_t             count;
+    uint32_t             capacity;
+} gpu_memory_blocks_t;
+
+typedef struct
+{
+    VkDeviceSize budget;
+    VkDeviceSize usage;      // whole process when the driver reports it
+    VkDeviceSize allocated;  // device memory held by this allocator
+    VkDeviceSize allocated_at_update;
+    VkDeviceSize block_size;
+} gpu_memory_heap_t;
+
+typedef struct
+{
+    gpu_memory_blocks_t pools[VK_MAX_MEMORY_TYPES][GPU_MEMORY_POOL_COUNT];
+    gpu_memory_heap_t   heaps[VK_MAX_MEMORY_HEAPS];
+    uint32_t            allocation_count;  // live vkAllocateMemory calls
+} gpu_memory_t;
+
+typedef struct
+{
+    VkDeviceMemory      memory;
+    VkDeviceSize        offset;
+    VkDeviceSize        size;
+    void*               mapped;  // at `offset`, NULL unless host visible
+    uint32_t            memory_type;
+    gpu_memory_pool_t   pool;
+    gpu_memory_block_t* block;  // NULL for a dedicated allocation
+    uint32_t            node;
+} gpu_allocation_t;
+
+typedef struct
+{
+    VkMemoryPropertyFlags required;
+    VkMemoryPropertyFlags preferred;  // tried first, e.g. HOST_CACHED
+    bool                  dedicated;  // force an allocation of its own
+} gpu_memory_request_t;
+
+static uint32_t gpu_memory__log2(uint32_t x)
+{
+    return 31u - (uint32_t) __builtin_clz(x);
+}
+
+// Free list of a range size: the power of two, then one of
+// GPU_MEMORY_SL_COUNT linear steps within it
+static void gpu_memory__mapping(uint32_t size, uint32_t* fl, uint32_t* sl)
+{
+    if (size < GPU_MEMORY_SL_COUNT)
+    {
+        *fl = 0;
+        *sl = size;
+        return;
+    }
+
+    uint32_t log2 = gpu_memory__log2(size);
+    *fl           = log2 - GPU_MEMORY_SL_LOG2 + 1;
+    *sl = (size >> (log2 - GPU_MEMORY_SL_LOG2)) - GPU_MEMORY_SL_COUNT;
+}
+
+static void gpu_memory__insert_free(gpu_memory_block_t* block, uint32_t index)
+{
+    gpu_memory_node_t* node = &block->nodes[index];
+
+    uint32_t fl, sl;
+    gpu_memory__mapping(node->size, &fl, &sl);
+
+    node->free      = true;
+    node->prev_free = GPU_MEMORY_NONE;
+    node->next_free = block->heads[fl][sl];
+    if (node->next_free != GPU_MEMORY_NONE)
+    {
+        block->nodes[node->next_free].prev_free = index;
+    }
+
+    block->heads[fl][sl] = index;
+    block->fl_bitmap |= 1u << fl;
+    block->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void gpu_memory__remove_free(gpu_memory_block_t* block, uint32_t index)
+{
+    gpu_memory_node_t* node = &block->nodes[index];
+
+    uint32_t fl, sl;
+    gpu_memory__mapping(node->size, &fl, &sl);
+
+    if (node->prev_free != GPU_MEMORY_NONE)
+    {
+        block->nodes[node->prev_free].next_free = node->next_free;
+    }
+    else
+    {
+        block->heads[fl][sl] = node->next_free;
+    }
+
+    if (node->next_free != GPU_MEMORY_NONE)
+    {
+        block->nodes[node->next_free].prev_free = node->prev_free;
+    }
+
+    if (block->heads[fl][sl] == GPU_MEMORY_NONE)
+    {
+        block->sl_bitmap[fl] &= ~(1u << sl);
+        if (block->sl_bitmap[fl] == 0)
+        {
+            block->fl_bitmap &= ~(1u << fl);
+        }
+    }
+
+    node->free = false;
+}
+
+// A free range of at least `size` granules, GPU_MEMORY_NONE if there is none
+static uint32_t gpu_memory__find_free(const gpu_memory_block_t* block,
+                                      uint32_t                  size)
+{
+    // round up to the next list start, every range in that list fits
+    if (size >= GPU_MEMORY_SL_COUNT)
+    {
+        size += (1u << (gpu_memory__log2(size) - GPU_MEMORY_SL_LOG2)) - 1;
+    }
+
+    uint32_t fl, sl;
+    gpu_memory__mapping(size, &fl, &sl);
+
+    uint32_t sl_map = block->sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0)
+    {
+        uint32_t fl_map = fl + 1 < GPU_MEMORY_FL_COUNT
+                              ? block->fl_bitmap & (~0u << (fl + 1))
+                              : 0;
+        if (fl_map == 0)
+        {
+            return GPU_MEMORY_NONE;
+        }
+
+        fl     = (uint32_t) __builtin_ctz(fl_map);
+        sl_map = block->sl_bitmap[fl];
+    }
+
+    return block->heads[fl][(uint32_t) __builtin_ctz(sl_map)];
+}
+
+// Makes room for `count` more nodes, so a split cannot fail halfway
+static bool gpu_memory__reserve_nodes(allocator*          alloc,
+                                      gpu_memory_block_t* block,
+                                      uint32_t            count)
+{
+    if (block->node_count + count <= block->node_capacity)
+    {
+        return true;
+    }
+
+    uint32_t capacity = block->node_capacity ? 2 * block->node_capacity : 64;
+    gpu_memory_node_t* nodes
+        = allocator_realloc(alloc,
+                            block->nodes,
+                            block->node_capacity * sizeof(gpu_memory_node_t),
+                            capacity * sizeof(gpu_memory_node_t));
+    if (!nodes)
+    {
+        return false;
+    }
+
+    block->nodes         = nodes;
+    block->node_capacity = capacity;
+    return true;
+}
+
+static uint32_t gpu_memory__new_node(gpu_memory_block_t* block)
+{
+    uint32_t index = block->unused_nodes;
+    if (index != GPU_MEMORY_NONE)
+    {
+        block->unused_nodes = block->nodes[index].next_free;
+        return index;
+    }
+
+    return block->node_count++;
+}
+
+static void gpu_memory__release_node(gpu_memory_block_t* block,
+                                     uint32_t            index)
+{
+    block->nodes[index].next_free = block->unused_nodes;
+    block->unused_nodes           = index;
+}
+
+// Splits the range at `index` after `size` granules, the rest becomes free
+static void gpu_memory__split(gpu_memory_block_t* block,
+                              uint32_t            index,
+                              uint32_t            size)
+{
+    uint32_t           rest_index = gpu_memory__new_node(block);
+    gpu_memory_node_t* node       = &block->nodes[index];
+    gpu_memory_node_t* rest       = &block->nodes[rest_index];
+
+    *rest = (gpu_memory_node_t) {
+        .offset    = node->offset + size,
+        .size      = node->size - size,
+        .prev_phys = index,
+        .next_phys = node->next_phys,
+    };
+
+    if (node->next_phys != GPU_MEMORY_NONE)
+    {
+        block->nodes[node->next_phys].prev_phys = rest_index;
+    }
+
+    node->next_phys = rest_index;
+    node->size      = size;
+
+    gpu_memory__insert_free(block, rest_index);
+}
+
+// `align` is a power of two, both in granules. GPU_MEMORY_NONE if the block
+// has no room.
+static uint32_t gpu_memory__block_alloc(allocator*          alloc,
+                                        gpu_memory_block_t* block,
+                                        uint32_t            size,
+                                        uint32_t            align)
+{
+    uint32_t index = gpu_memory__find_free(block, size + align - 1);
+    if (index == GPU_MEMORY_NONE || !gpu_memory__reserve_nodes(alloc, block, 2))
+    {
+        return GPU_MEMORY_NONE;
+    }
+
+    gpu_memory__remove_free(block, index);
+
+    // the padding in front stays free, its previous neighbour is in use
+    // since free neighbours are always merged
+    uint32_t offset  = block->nodes[index].offset;
+    uint32_t padding = ((offset + align - 1) & ~(align - 1)) - offset;
+    if (padding)
+    {
+        gpu_memory__split(block, index, padding);
+
+        uint32_t aligned = block->nodes[index].next_phys;
+        gpu_memory__remove_free(block, aligned);
+        gpu_memory__insert_free(block, index);
+        index = aligned;
+    }
+
+    if (block->nodes[index].size > size)
+    {
+        gpu_memory__split(block, index, size);
+    }
+
+    block->allocations++;
+    return index;
+}
+
+// Absorbs the free neighbour `next` into `index`
+static void gpu_memory__merge(gpu_memory_block_t* block,
+                              uint32_t            index,
+                              uint32_t            next)
+{
+    gpu_memory_node_t* node = &block->nodes[index];
+    gpu_memory_node_t* tail = &block->nodes[next];
+
+    node->size += tail->size;
+    node->next_phys = tail->next_phys;
+    if (tail->next_phys != GPU_MEMORY_NONE)
+    {
+        block->nodes[tail->next_phys].prev_phys = index;
+    }
+
+    gpu_memory__release_node(block, next);
+}
+
+static void gpu_memory__block_free(gpu_memory_block_t* block, uint32_t index)
+{
+    uint32_t next = block->nodes[index].next_phys;
+    if (next != GPU_MEMORY_NONE && block->nodes[next].free)
+    {
+        gpu_memory__remove_free(block, next);
+        gpu_memory__merge(block, index, next);
+    }
+
+    uint32_t prev = block->nodes[index].prev_phys;
+    if (prev != GPU_MEMORY_NONE && block->nodes[prev].free)
+    {
+        gpu_memory__remove_free(block, prev);
+        gpu_memory__merge(block, prev, index);
+        index = prev;
+    }
+
+    gpu_memory__insert_free(block, index);
+    block->allocations--;
+}
+
+// Projected usage of the heap including what was allocated since the last
+// gpu_memory_update_budget, against its budget
+static bool gpu_memory__fits_budget(const gpu_memory_t* memory,
+                                    uint32_t            heap_index,
+                                    VkDeviceSize        size)
+{
+    const gpu_memory_heap_t* heap = &memory->heaps[heap_index];
+
+    VkDeviceSize usage = heap->usage + heap->allocated;
+    usage = usage > heap->allocated_at_update
+                ? usage - heap->allocated_at_update
+                : 0;
+
+    return usage + size <= heap->budget;
+}
+
+// vkAllocateMemory within the budget and the allocation count limit
+static VkDeviceMemory gpu_memory__allocate(gpu_memory_t*        memory,
+                                           const device_info_t* device_info,
+                                           uint32_t             memory_type,
+                                           VkDeviceSize         size,
+                                           const void*          next)
+{
+    uint32_t heap_index = device_info->memory_properties
+                              .memoryTypes[memory_type]
+                              .heapIndex;
+
+    if (!gpu_memory__fits_budget(memory, heap_index, size)
+        || memory->allocation_count
+               >= device_info->properties.limits.maxMemoryAllocationCount)
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    VkMemoryAllocateInfo allocate_info = {
+        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext           = next,
+        .allocationSize  = size,
+        .memoryTypeIndex = memory_type,
+    };
+
+    VkDeviceMemory device_memory = VK_NULL_HANDLE;
+    if (vkAllocateMemory(
+            device_info->device, &allocate_info, nullptr, &device_memory)
+        != VK_SUCCESS)
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    memory->heaps[heap_index].allocated += size;
+    memory->allocation_count++;
+    return device_memory;
+}
+
+static void gpu_memory__release(gpu_memory_t*        memory,
+                                const device_info_t* device_info,
+                                uint32_t             memory_type,
+                                VkDeviceMemory       device_memory,
+                                VkDeviceSize         size)
+{
+    uint32_t heap_index = device_info->memory_properties
+                              .memoryTypes[memory_type]
+                              .heapIndex;
+
+    vkFreeMemory(device_info->device, device_memory, nullptr);
+    memory->heaps[heap_index].allocated -= size;
+    memory->allocation_count--;
+}
+
+// Host visible memory stays mapped for its whole lifetime
+static void* gpu_memory__map(const device_info_t* device_info,
+                             uint32_t             memory_type,
+                             VkDeviceMemory       device_memory)
+{
+    void* mapped = NULL;
+    if (device_info->memory_properties.memoryTypes[memory_type].propertyFlags
+        & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        if (vkMapMemory(device_info->device,
+                        device_memory,
+                        0,
+                        VK_WHOLE_SIZE,
+                        0,
+                        &mapped)
+            != VK_SUCCESS)
+        {
+            mapped = NULL;
+        }
+    }
+
+    return mapped;
+}
+
+static void gpu_memory__destroy_block(allocator*           alloc,
+                                      gpu_memory_t*        memory,
+                                      const device_info_t* device_info,
+                                      uint32_t             memory_type,
+                                      gpu_memory_block_t*  block)
+{
+    gpu_memory__release(
+        memory, device_info, memory_type, block->memory, block->size);
+
+    alloc->free(block->nodes, alloc->ctx);
+    alloc->free(block, alloc->ctx);
+}
+
+// Starts at the heap's block size and halves it while the allocation fails
+// or would go over budget, as long as `min_size` still fits
+static gpu_memory_block_t* gpu_memory__create_block(
+    allocator*           alloc,
+    gpu_memory_t*        memory,
+    const device_info_t* device_info,
+    uint32_t             memory_type,
+    VkDeviceSize         min_size)
+{
+    uint32_t heap_index = device_info->memory_properties
+                              .memoryTypes[memory_type]
+                              .heapIndex;
+
+    gpu_memory_block_t* block = alloc->malloc(
+        (ptrdiff_t) sizeof(gpu_memory_block_t), alloc->ctx);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    *block = (gpu_memory_block_t) {
+        .unused_nodes = GPU_MEMORY_NONE,
+    };
+    memset(block->heads, 0xff, sizeof(block->heads));
+
+    for (VkDeviceSize size = memory->heaps[heap_index].block_size;
+         size >= min_size && !block->memory;
+         size /= 2)
+    {
+        block->memory = gpu_memory__allocate(
+            memory, device_info, memory_type, size, NULL);
+        block->size = size;
+    }
+
+    if (!block->memory || !gpu_memory__reserve_nodes(alloc, block, 1))
+    {
+        if (block->memory)
+        {
+            gpu_memory__release(
+                memory, device_info, memory_type, block->memory, block->size);
+        }
+
+        alloc->free(block, alloc->ctx);
+        return NULL;
+    }
+
+    block->mapped = gpu_memory__map(device_info, memory_type, block->memory);
+
+    uint32_t index      = gpu_memory__new_node(block);
+    block->nodes[index] = (gpu_memory_node_t) {
+        .size      = (uint32_t) (block->size / GPU_MEMORY_GRANULE),
+        .prev_phys = GPU_MEMORY_NONE,
+        .next_phys = GPU_MEMORY_NONE,
+    };
+    gpu_memory__insert_free(block, index);
+
+    return block;
+}
+
+static bool gpu_memory__dedicated(
+    gpu_memory_t*                        memory,
+    const device_info_t*                 device_info,
+    uint32_t                             memory_type,
+    const VkMemoryRequirements*          requirements,
+    const VkMemoryDedicatedAllocateInfo* resource,
+    gpu_allocation_t*                    allocation)
+{
+    VkDeviceMemory device_memory = gpu_memory__allocate(
+        memory, device_info, memory_type, requirements->size, resource);
+    if (!device_memory)
+    {
+        return false;
+    }
+
+    *allocation = (gpu_allocation_t) {
+        .memory      = device_memory,
+        .size        = requirements->size,
+        .mapped      = gpu_memory__map(device_info, memory_type, device_memory),
+        .memory_type = memory_type,
+        .node        = GPU_MEMORY_NONE,
+    };
+
+    return true;
+}
+
+static bool gpu_memory__from_type(
+    allocator*                           alloc,
+    gpu_memory_t*                        memory,
+    const device_info_t*                 device_info,
+    uint32_t                             memory_type,
+    const VkMemoryRequirements*          requirements,
+    gpu_memory_pool_t                    pool,
+    bool                                 dedicated,
+    const VkMemoryDedicatedAllocateInfo* resource,
+    gpu_allocation_t*                    allocation)
+{
+    uint32_t heap_index = device_info->memory_properties
+                              .memoryTypes[memory_type]
+                              .heapIndex;
+    VkDeviceSize block_size = memory->heaps[heap_index].block_size;
+
+    if (dedicated || requirements->size > block_size / 2)
+    {
+        return gpu_memory__dedicated(memory,
+                                     device_info,
+                                     memory_type,
+                                     requirements,
+                                     resource,
+                                     allocation);
+    }
+
+    uint32_t size
+        = (uint32_t) ((requirements->size + GPU_MEMORY_GRANULE - 1)
+                      / GPU_MEMORY_GRANULE);
+    uint32_t align = requirements->alignment > GPU_MEMORY_GRANULE
+                         ? (uint32_t) (requirements->alignment
+                                       / GPU_MEMORY_GRANULE)
+                         : 1;
+
+    gpu_memory_blocks_t* blocks = &memory->pools[memory_type][pool];
+    gpu_memory_block_t*  block  = NULL;
+    uint32_t             node   = GPU_MEMORY_NONE;
+
+    for (uint32_t i = 0; i < blocks->count && node == GPU_MEMORY_NONE; i++)
+    {
+        block = blocks->blocks[i];
+        node  = gpu_memory__block_alloc(alloc, block, size, align);
+    }
+
+    if (node == GPU_MEMORY_NONE)
+    {
+        if (blocks->count == blocks->capacity)
+        {
+            uint32_t capacity = blocks->capacity ? 2 * blocks->capacity : 4;
+            gpu_memory_block_t** grown = allocator_realloc(
+                alloc,
+                blocks->blocks,
+                blocks->capacity * sizeof(gpu_memory_block_t*),
+                capacity * sizeof(gpu_memory_block_t*));
+            if (!grown)
+            {
+                return false;
+            }
+
+            blocks->blocks   = grown;
+            blocks->capacity = capacity;
+        }
+
+        VkDeviceSize min_size
+            = (VkDeviceSize) (size + align - 1) * GPU_MEMORY_GRANULE;
+        block = gpu_memory__create_block(
+            alloc, memory, device_info, memory_type, min_size);
+        if (!block)
+        {
+            return false;
+        }
+
+        blocks->blocks[blocks->count++] = block;
+
+        node = gpu_memory__block_alloc(alloc, block, size, align);
+        if (node == GPU_MEMORY_NONE)
+        {
+            return false;
+        }
+    }
+
+    VkDeviceSize offset
+        = (VkDeviceSize) block->nodes[node].offset * GPU_MEMORY_GRANULE;
+
+    *allocation = (gpu_allocation_t) {
+        .memory      = block->memory,
+        .offset      = offset,
+        .size        = requirements->size,
+        .mapped      = block->mapped ? (char*) block->mapped + offset : NULL,
+        .memory_type = memory_type,
+        .pool        = pool,
+        .block       = block,
+        .node        = node,
+    };
+
+    return true;
+}
+
+// Re-reads the heap budgets, call once per frame. Without
+// VK_EXT_memory_budget usage only counts this allocator's memory.
+void gpu_memory_update_budget(gpu_memory_t*        memory,
+                              const device_info_t* device_info)
+{
+    const VkPhysicalDeviceMemoryProperties* props
+        = &device_info->memory_properties;
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+    };
+
+    if (device_info->memory_budget)
+    {
+        VkPhysicalDeviceMemoryProperties2 props2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+            .pNext = &budget,
+        };
+        vkGetPhysicalDeviceMemoryProperties2(device_info->physical_device,
+                                             &props2);
+    }
+
+    for (uint32_t i = 0; i < props->memoryHeapCount; i++)
+    {
+        gpu_memory_heap_t* heap   = &memory->heaps[i];
+        heap->allocated_at_update = heap->allocated;
+
+        if (device_info->memory_budget)
+        {
+            heap->budget = budget.heapBudget[i];
+            heap->usage  = budget.heapUsage[i];
+        }
+        else
+        {
+            heap->budget = props->memoryHeaps[i].size
+                           * GPU_MEMORY_BUDGET_PERCENT / 100;
+            heap->usage  = heap->allocated;
+        }
+    }
+}
+
+void gpu_memory_init(gpu_memory_t* memory, const device_info_t* device_info)
+{
+    *memory = (gpu_memory_t) { 0 };
+
+    const VkPhysicalDeviceMemoryProperties* props
+        = &device_info->memory_properties;
+
+    for (uint32_t i = 0; i < props->memoryHeapCount; i++)
+    {
+        VkDeviceSize size = props->memoryHeaps[i].size / 8;
+        if (size > GPU_MEMORY_BLOCK_SIZE)
+        {
+            size = GPU_MEMORY_BLOCK_SIZE;
+        }
+
+        memory->heaps[i].block_size = size & ~(GPU_MEMORY_GRANULE - 1);
+    }
+
+    gpu_memory_update_budget(memory, device_info);
+}
+
+// Frees every block, all allocations must have been freed
+void gpu_memory_destroy(allocator*           alloc,
+                        gpu_memory_t*        memory,
+                        const device_info_t* device_info)
+{
+    for (uint32_t type = 0; type < VK_MAX_MEMORY_TYPES; type++)
+    {
+        for (uint32_t pool = 0; pool < GPU_MEMORY_POOL_COUNT; pool++)
+        {
+            gpu_memory_blocks_t* blocks = &memory->pools[type][pool];
+            for (uint32_t i = 0; i < blocks->count; i++)
+            {
+                if (blocks->blocks[i]->allocations)
+                {
+                    log_warn(LOG_MEMORY,
+                             "gpu memory: %u allocations leaked in type %u\n",
+                             blocks->blocks[i]->allocations,
+                             type);
+                }
+
+                gpu_memory__destroy_block(
+                    alloc, memory, device_info, type, blocks->blocks[i]);
+            }
+
+            alloc->free(blocks->blocks, alloc->ctx);
+        }
+    }
+
+    *memory = (gpu_memory_t) { 0 };
+}
+
+// Allocates memory for a resource with `requirements`. `resource` names the
+// buffer or image when the driver asked for a dedicated allocation, NULL
+// otherwise. Memory types with the preferred flags are tried first, then
+// any with the required ones.
+bool gpu_memory_alloc(allocator*                           alloc,
+                      gpu_memory_t*                        memory,
+                      const device_info_t*                 device_info,
+                      const VkMemoryRequirements*          requirements,
+                      const gpu_memory_request_t*          request,
+                      gpu_memory_pool_t                    pool,
+                      const VkMemoryDedicatedAllocateInfo* resource,
+                      gpu_allocation_t*                    allocation)
+{
+    VkMemoryPropertyFlags flags[2] = {
+        request->required | request->preferred,
+        request->required,
+    };
+
+    bool dedicated = request->dedicated || resource != NULL;
+
+    for (uint32_t attempt = request->preferred ? 0 : 1; attempt < 2; attempt++)
+    {
+        // another type with the same flags may live in a heap with room left
+        uint32_t type_bits = requirements->memoryTypeBits;
+        int32_t  type
+            = device_memory_type(device_info, type_bits, flags[attempt]);
+        for (; type >= 0;
+             type = device_memory_type(device_info, type_bits, flags[attempt]))
+        {
+            if (gpu_memory__from_type(alloc,
+                                      memory,
+                                      device_info,
+                                      (uint32_t) type,
+                                      requirements,
+                                      pool,
+                                      dedicated,
+                                      resource,
+                                      allocation))
+            {
+                return true;
+            }
+
+            type_bits &= ~(1u << type);
+        }
+    }
+
+    log_error(LOG_MEMORY,
+              "gpu memory: failed to allocate %llu bytes\n",
+              (unsigned long long) requirements->size);
+    return false;
+}
+
+void gpu_memory_free(allocator*           alloc,
+                     gpu_memory_t*        memory,
+                     const device_info_t* device_info,
+                     gpu_allocation_t*    allocation)
+{
+    gpu_memory_block_t* block = allocation->block;
+
+    if (!allocation->memory)
+    {
+        return;
+    }
+
+    if (!block)
+    {
+        gpu_memory__release(memory,
+                            device_info,
+                            allocation->memory_type,
+                            allocation->memory,
+                            allocation->size);
+        *allocation = (gpu_allocation_t) { 0 };
+        return;
+    }
+
+    gpu_memory__block_free(block, allocation->node);
+
+    // keep one block per pool around, a pool emptied and refilled every
+    // frame must not reallocate device memory each time
+    gpu_memory_blocks_t* blocks
+        = &memory->pools[allocation->memory_type][allocation->pool];
+    if (block->allocations == 0 && blocks->count > 1)
+    {
+        for (uint32_t i = 0; i < blocks->count; i++)
+        {
+            if (blocks->blocks[i] == block)
+            {
+                blocks->blocks[i] = blocks->blocks[--blocks->count];
+                break;
+            }
+        }
+
+        gpu_memory__destroy_block(
+            alloc, memory, device_info, allocation->memory_type, block);
+    }
+
+    *allocation = (gpu_allocation_t) { 0 };
+}
+
+// Rounds a host access range out to nonCoherentAtomSize, clamped to the end
+// of the device memory it lives in
+static VkMappedMemoryRange gpu_memory__range(
+    const device_info_t* device_info, const gpu_allocation_t* allocation)
+{
+    VkDeviceSize atom = device_info->properties.limits.nonCoherentAtomSize;
+    atom              = atom ? atom : 1;
+
+    VkMappedMemoryRange range = {
+        .sType  = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = allocation->memory,
+        .offset = allocation->offset / atom * atom,
+        .size   = VK_WHOLE_SIZE,
+    };
+
+    if (allocation->block)
+    {
+        VkDeviceSize end = (allocation->offset + allocation->size + atom - 1)
+                           / atom * atom;
+        end = end < allocation->block->size ? end : allocation->block->size;
+        range.size = end - range.offset;
+    }
+
+    return range;
+}
+
+static bool gpu_memory__coherent(const device_info_t*    device_info,
+                                 const gpu_allocation_t* allocation)
+{
+    return device_info->memory_properties
+               .memoryTypes[allocation->memory_type]
+               .propertyFlags
+           & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+// Makes host writes visible to the device, a no-op for coherent memory
+void gpu_memory_flush(const device_info_t*    device_info,
+                      const gpu_allocation_t* allocation)
+{
+    if (!gpu_memory__coherent(device_info, allocation))
+    {
+        VkMappedMemoryRange range = gpu_memory__range(device_info, allocation);
+        vkFlushMappedMemoryRanges(device_info->device, 1, &range);
+    }
+}
+
+// Makes device writes visible to the host, a no-op for coherent memory
+void gpu_memory_invalidate(const device_info_t*    device_info,
+                           const gpu_allocation_t* allocation)
+{
+    if (!gpu_memory__coherent(device_info, allocation))
+    {
+        VkMappedMemoryRange range = gpu_memory__range(device_info, allocation);
+        vkInvalidateMappedMemoryRanges(device_info->device, 1, &range);
+    }
+}
+
+// Creates a buffer and binds it to memory from the LINEAR pools
+bool gpu_memory_create_buffer(allocator*                  alloc,
+                              gpu_memory_t*               memory,
+                              const device_info_t*        device_info,
+                              const VkBufferCreateInfo*   buffer_info,
+                              const gpu_memory_request_t* request,
+                              VkBuffer*                   buffer,
+                              gpu_allocation_t*           allocation)
+{
+    VkDevice device = device_info->device;
+
+    *allocation = (gpu_allocation_t) { 0 };
+    if (vkCreateBuffer(device, buffer_info, nullptr, buffer) != VK_SUCCESS)
+    {
+        return false;
+    }
+
+    VkMemoryDedicatedRequirements dedicated = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS,
+    };
+    VkMemoryRequirements2 requirements = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+        .pNext = &dedicated,
+    };
+    VkBufferMemoryRequirementsInfo2 requirements_info = {
+        .sType  = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2,
+        .buffer = *buffer,
+    };
+    vkGetBufferMemoryRequirements2(device, &requirements_info, &requirements);
+
+    VkMemoryDedicatedAllocateInfo resource = {
+        .sType  = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+        .buffer = *buffer,
+    };
+    bool wants_dedicated = dedicated.prefersDedicatedAllocation
+                           || dedicated.requiresDedicatedAllocation;
+
+    if (!gpu_memory_alloc(alloc,
+                          memory,
+                          device_info,
+                          &requirements.memoryRequirements,
+                          request,
+                          GPU_MEMORY_LINEAR,
+                          wants_dedicated ? &resource : NULL,
+                          allocation)
+        || vkBindBufferMemory(
+               device, *buffer, allocation->memory, allocation->offset)
+               != VK_SUCCESS)
+    {
+        gpu_memory_free(alloc, memory, device_info, allocation);
+        vkDestroyBuffer(device, *buffer, nullptr);
+        *buffer = VK_NULL_HANDLE;
+        return false;
+    }
+
+    return true;
+}
+
+// Creates an image and binds it to memory from the pool matching its tiling
+bool gpu_memory_create_image(allocator*                  alloc,
+                             gpu_memory_t*               memory,
+                             const device_info_t*        device_info,
+                             const VkImageCreateInfo*    image_info,
+                             const gpu_memory_request_t* request,
+                             VkImage*                    image,
+                             gpu_allocation_t*           allocation)
+{
+    VkDevice device = device_info->device;
+
+    *allocation = (gpu_allocation_t) { 0 };
+    if (vkCreateImage(device, image_info, nullptr, image) != VK_SUCCESS)
+    {
+        return false;
+    }
+
+    VkMemoryDedicatedRequirements dedicated = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS,
+    };
+    VkMemoryRequirements2 requirements = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+        .pNext = &dedicated,
+    };
+    VkImageMemoryRequirementsInfo2 requirements_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+        .image = *image,
+    };
+    vkGetImageMemoryRequirements2(device, &requirements_info, &requirements);
+
+    VkMemoryDedicatedAllocateInfo resource = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+        .image = *image,
+    };
+    bool wants_dedicated = dedicated.prefersDedicatedAllocation
+                           || dedicated.requiresDedicatedAllocation;
+
+    gpu_memory_pool_t pool = image_info->tiling == VK_IMAGE_TILING_OPTIMAL
+                                 ? GPU_MEMORY_OPTIMAL
+                                 : GPU_MEMORY_LINEAR;
+
+    if (!gpu_memory_alloc(alloc,
+                          memory,
+                          device_info,
+                          &requirements.memoryRequirements,
+                          request,
+                          pool,
+                          wants_dedicated ? &resource : NULL,
+                          allocation)
+        || vkBindImageMemory(
+               device, *image, allocation->memory, allocation->offset)
+               != VK_SUCCESS)
+    {
+        gpu_memory_free(alloc, memory, device_info, allocation);
+        vkDestroyImage(device, *image, nullptr);
+        *image = VK_NULL_HANDLE;
+        return false;
+    }
+
+    return true;
+}
+
+void gpu_memory_destroy_buffer(allocator*           alloc,
+                               gpu_memory_t*        memory,
+                               const device_info_t* device_info,
+                               VkBuffer             buffer,
+                               gpu_allocation_t*    allocation)
+{
+    vkDestroyBuffer(device_info->device, buffer, nullptr);
+    gpu_memory_free(alloc, memory, device_info, allocation);
+}
+
+void gpu_memory_destroy_image(allocator*           alloc,
+                              gpu_memory_t*        memory,
+                              const device_info_t* device_info,
+                              VkImage              image,
+                              gpu_allocation_t*    allocation)
+{
+    vkDestroyImage(device_info->device, image, nullptr);
+    gpu_memory_free(alloc, memory, device_info, allocation);
+}
+
+#endif  // GPU_MEMORY_H
@@ -0,0 +1,211 @@
+//
+// Interned string table.
+//
+// Every distinct string is stored once, NUL terminated, in an arena owned by
+// the table and gets a stable `string_id`. Ids are dense indices into the
+// entry list, so comparing two interned identifiers is a single integer
+// compare and the string bytes never move. Lookup goes through an
+// open-addressing (linear probing) hash table keyed on the precomputed hash.
+//
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "prelude.h"
+#include "arena.h"
+
+typedef uint32_t string_id;
+
+// id 0 is never handed out, it marks empty slots and failed interning
+#define STRING_ID_NONE 0u
+
+#ifndef STRING_TABLE_MIN_SLOTS
+#define STRING_TABLE_MIN_SLOTS 64u
+#endif
+
+typedef struct
+{
+    uint64_t    hash;
+    const char* chars;
+    size_t      len;
+} string_entry_t;
+
+ARRAY_DEFINE(string_entry_array_t, string_entry_array, string_entry_t)
+
+typedef struct
+{
+    allocator* alloc;
+    arena_t    bytes;  // string storage, stable for the table's lifetime
+
+    string_entry_array_t* entries;  // indexed by string_id
+
+    string_id* slots;  // power-of-two sized, STRING_ID_NONE when empty
+    uint32_t   slot_count;
+} string_table_t;
+
+bool string_table_init(string_table_t* table, allocator* alloc, size_t bytes)
+{
+    *table = (string_table_t) { .alloc = alloc };
+
+    if (!arena_init(&table->bytes, alloc, bytes))
+    {
+        return false;
+    }
+
+    table->slot_count = STRING_TABLE_MIN_SLOTS;
+    table->slots      = alloc->malloc(
+        (ptrdiff_t) (table->slot_count * sizeof(string_id)), alloc->ctx);
+    table->entries = make_string_entry_array(alloc, STRING_TABLE_MIN_SLOTS);
+    if (!table->slots || !table->entries)
+    {
+        return false;
+    }
+
+    memset(table->slots, 0, table->slot_count * sizeof(string_id));
+
+    // reserve id 0
+    string_entry_array_push(alloc, &table->entries, (string_entry_t) { 0 });
+    return true;
+}
+
+void string_table_release(string_table_t* table)
+{
+    if (table->slots)
+    {
+        table->alloc->free(table->slots, table->alloc->ctx);
+    }
+
+    string_entry_array_free(table->alloc, table->entries);
+    arena_release(&table->bytes);
+
+    *table = (string_table_t) { 0 };
+}
+
+static uint32_t string_table__probe(const string_table_t* table,
+                                    string_t              str,
+                                    uint64_t              hash)
+{
+    uint32_t mask = table->slot_count - 1;
+    uint32_t slot = (uint32_t) hash & mask;
+
+    while (true)
+    {
+        string_id id = table->slots[slot];
+        if (id == STRING_ID_NONE)
+        {
+            return slot;
+        }
+
+        const string_entry_t* entry = &table->entries->data[id];
+        if (entry->hash == hash && entry->len == str.len
+            && memcmp(entry->chars, str.chars, str.len) == 0)
+        {
+            return slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Keep the load factor under 1/2
+static bool string_table__grow(string_table_t* table)
+{
+    uint32_t   slot_count = table->slot_count * 2;
+    string_id* slots      = table->alloc->malloc(
+        (ptrdiff_t) (slot_count * sizeof(string_id)), table->alloc->ctx);
+    if (!slots)
+    {
+        return false;
+    }
+
+    memset(slots, 0, slot_count * sizeof(string_id));
+
+    uint32_t mask = slot_count - 1;
+    for (string_id id = 1; id < table->entries->len; id++)
+    {
+        uint32_t slot = (uint32_t) table->entries->data[id].hash & mask;
+        while (slots[slot] != STRING_ID_NONE)
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        slots[slot] = id;
+    }
+
+    table->alloc->free(table->slots, table->alloc->ctx);
+    table->slots      = slots;
+    table->slot_count = slot_count;
+
+    return true;
+}
+
+// Returns STRING_ID_NONE if `str` has not been interned
+string_id string_table_find(const string_table_t* table, string_t str)
+{
+    uint32_t slot = string_table__probe(table, str, string_hash(str));
+    return table->slots[slot];
+}
+
+// Returns STRING_ID_NONE when the table runs out of memory
+string_id string_intern(string_table_t* table, string_t str)
+{
+    uint64_t hash = string_hash(str);
+    uint32_t slot = string_table__probe(table, str, hash);
+    if (table->slots[slot] != STRING_ID_NONE)
+    {
+        return table->slots[slot];
+    }
+
+    if ((table->entries->len + 1) * 2 > table->slot_count)
+    {
+        if (!string_table__grow(table))
+        {
+            return STRING_ID_NONE;
+        }
+
+        slot = string_table__probe(table, str, hash);
+    }
+
+    char* chars = arena_push(&table->bytes, str.len + 1, 1);
+    if (!chars)
+    {
+        return STRING_ID_NONE;
+    }
+
+    memcpy(chars, str.chars, str.len);
+    chars[str.len] = '\0';
+
+    string_id id = (string_id) table->entries->len;
+    if (!string_entry_array_push(
+            table->alloc,
+            &table->entries,
+            (string_entry_t) { .hash = hash, .chars = chars, .len = str.len }))
+    {
+        return STRING_ID_NONE;
+    }
+
+    table->slots[slot] = id;
+    return id;
+}
+
+string_id string_intern_c(string_table_t* table, const char* str)
+{
+    return string_intern(table, make_from_c_string(str));
+}
+
+// The returned chars are NUL terminated and live as long as the table
+string_t string_id_to_string(const string_table_t* table, string_id id)
+{
+    const string_entry_t* entry = &table->entries->data[id];
+    return (string_t) { .chars = entry->chars, .len = entry->len };
+}
+
+uint64_t string_id_hash(const string_table_t* table, string_id id)
+{
+    return table->entries->data[id].hash;
+}
+
+#endif  // INTERN_H
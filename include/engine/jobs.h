@@ -0,0 +1,562 @@
+//
+// Work-stealing job system.
+//
+// One worker per core, the thread that creates the system counts as worker 0
+// and the rest are background threads. Every worker owns a Chase-Lev deque:
+// it pushes and pops its own jobs at the bottom without contention while idle
+// workers steal from the top of a random victim.
+//
+// Jobs are grouped by a job_counter_t that counts the ones still running.
+// jobs_wait keeps the caller busy executing other jobs until the counter
+// drains, so waiting never parks a worker. Work that should run after a group
+// without anybody waiting for it is attached to the counter with jobs_then
+// and scheduled by whichever job finishes last.
+//
+// Job descriptors come from a per-thread ring of JOBS_RING_SIZE entries, a
+// thread must not have more than that many of its own jobs in flight.
+// Submitting and waiting is only allowed from the creating thread and from
+// inside jobs.
+//
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "prelude.h"
+#include "log.h"
+
+#ifndef JOBS_MAX_WORKERS
+#define JOBS_MAX_WORKERS 64
+#endif
+
+// deque and descriptor ring capacity per worker, powers of two
+#ifndef JOBS_DEQUE_SIZE
+#define JOBS_DEQUE_SIZE 4096
+#endif
+
+#ifndef JOBS_RING_SIZE
+#define JOBS_RING_SIZE 4096
+#endif
+
+// failed steal rounds before an idle worker goes to sleep
+#ifndef JOBS_IDLE_SPINS
+#define JOBS_IDLE_SPINS 64
+#endif
+
+typedef void (*job_fn_t)(void* data);
+
+typedef struct job_t job_t;
+
+// job_counter_init before first use. A counter is done once its jobs have
+// returned and its continuations have been scheduled, only then may it be
+// reused or go out of scope.
+typedef struct
+{
+    atomic_uint     pending;
+    _Atomic(job_t*) continuations;  // JOBS__RELEASED once they were scheduled
+} job_counter_t;
+
+typedef struct
+{
+    job_fn_t fn;
+    void*    data;
+} job_decl_t;
+
+struct job_t
+{
+    job_fn_t       fn;
+    void*          data;
+    job_counter_t* counter;  // decremented when fn returns, may be NULL
+    job_t*         next;     // continuation list
+};
+
+typedef struct
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(job_t*) buffer[JOBS_DEQUE_SIZE];
+} job_deque_t;
+
+typedef struct
+{
+    job_deque_t deque;
+    job_t       ring[JOBS_RING_SIZE];
+    uint32_t    ring_next;
+    uint32_t    rng;  // victim selection
+    uint32_t    index;
+    thrd_t      thread;
+    bool        started;
+
+    struct job_system_t* system;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+    allocator*    alloc;
+    job_worker_t* workers;
+    uint32_t      worker_count;  // including the creating thread
+
+    // sleeping workers wake up when `queued` becomes non-zero
+    atomic_uint queued;
+    atomic_uint sleeping;
+    atomic_bool stopping;
+    mtx_t       lock;
+    cnd_t       work_ready;
+} job_system_t;
+
+#define JOBS__RELEASED ((job_t*) (uintptr_t) 1)
+#define JOBS__NOT_A_WORKER UINT32_MAX
+
+static thread_local uint32_t jobs__worker_index = JOBS__NOT_A_WORKER;
+
+//
+// deque, Chase-Lev with the C11 orderings from Le et al.
+//
+
+// Owner only, false when full
+static bool jobs__deque_push(job_deque_t* deque, job_t* job)
+{
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t >= JOBS_DEQUE_SIZE)
+    {
+        return false;
+    }
+
+    atomic_store_explicit(&deque->buffer[b & (JOBS_DEQUE_SIZE - 1)],
+                          job,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+// Owner only, takes the newest job
+static job_t* jobs__deque_pop(job_deque_t* deque)
+{
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    job_t* job = atomic_load_explicit(
+        &deque->buffer[b & (JOBS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (t == b)
+    {
+        // last job, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top,
+                                                     &t,
+                                                     t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+        {
+            job = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+
+    return job;
+}
+
+// Any thread, takes the oldest job
+static job_t* jobs__deque_steal(job_deque_t* deque)
+{
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b)
+    {
+        return NULL;
+    }
+
+    job_t* job = atomic_load_explicit(
+        &deque->buffer[t & (JOBS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top,
+                                                 &t,
+                                                 t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+        return NULL;
+    }
+
+    return job;
+}
+
+//
+// scheduling
+//
+
+static job_worker_t* jobs__self(job_system_t* jobs)
+{
+    uint32_t index = jobs__worker_index;
+    if (index >= jobs->worker_count)
+    {
+        log_error(LOG_JOBS, "jobs used from a thread outside the job system\n");
+        log_flush();
+        abort();
+    }
+
+    return &jobs->workers[index];
+}
+
+static job_t* jobs__new_job(job_worker_t*  worker,
+                            job_fn_t       fn,
+                            void*          data,
+                            job_counter_t* counter)
+{
+    job_t* job = &worker->ring[worker->ring_next++ & (JOBS_RING_SIZE - 1)];
+    *job       = (job_t) { .fn = fn, .data = data, .counter = counter };
+    return job;
+}
+
+static void jobs__execute(job_system_t* jobs, job_t* job);
+
+static void jobs__schedule(job_system_t* jobs, job_t* job)
+{
+    // counted before it becomes visible, a thief may take it right away
+    job_worker_t* self = jobs__self(jobs);
+    atomic_fetch_add(&jobs->queued, 1);
+    if (!jobs__deque_push(&self->deque, job))
+    {
+        // deque full, nobody is keeping up anyway
+        atomic_fetch_sub(&jobs->queued, 1);
+        jobs__execute(jobs, job);
+        return;
+    }
+
+    if (atomic_load(&jobs->sleeping) > 0)
+    {
+        mtx_lock(&jobs->lock);
+        cnd_signal(&jobs->work_ready);
+        mtx_unlock(&jobs->lock);
+    }
+}
+
+// Schedules everything attached to a drained counter, exactly once
+static void jobs__release(job_system_t* jobs, job_counter_t* counter)
+{
+    job_t* job = atomic_exchange(&counter->continuations, JOBS__RELEASED);
+    while (job && job != JOBS__RELEASED)
+    {
+        job_t* next = job->next;
+        jobs__schedule(jobs, job);
+        job = next;
+    }
+}
+
+static void jobs__execute(job_system_t* jobs, job_t* job)
+{
+    // the descriptor may be recycled as soon as the counter drops
+    job_counter_t* counter = job->counter;
+    job->fn(job->data);
+
+    if (counter && atomic_fetch_sub(&counter->pending, 1) == 1)
+    {
+        jobs__release(jobs, counter);
+    }
+}
+
+static void jobs__counter_add(job_counter_t* counter, uint32_t count)
+{
+    if (atomic_fetch_add(&counter->pending, count) == 0)
+    {
+        // reopen a counter whose previous group has finished
+        job_t* released = JOBS__RELEASED;
+        atomic_compare_exchange_strong(
+            &counter->continuations, &released, NULL);
+    }
+}
+
+static job_t* jobs__find(job_system_t* jobs, job_worker_t* self)
+{
+    job_t* job = jobs__deque_pop(&self->deque);
+    if (!job && jobs->worker_count > 1)
+    {
+        // xorshift, a random victim spreads thieves over the deques
+        uint32_t start = self->rng;
+        start ^= start << 13;
+        start ^= start >> 17;
+        start ^= start << 5;
+        self->rng = start;
+
+        for (uint32_t i = 0; i < jobs->worker_count && !job; i++)
+        {
+            job_worker_t* victim
+                = &jobs->workers[(start + i) % jobs->worker_count];
+            if (victim != self)
+            {
+                job = jobs__deque_steal(&victim->deque);
+            }
+        }
+    }
+
+    if (job)
+    {
+        atomic_fetch_sub(&jobs->queued, 1);
+    }
+
+    return job;
+}
+
+static int jobs__worker(void* arg)
+{
+    job_worker_t* self   = arg;
+    job_system_t* jobs   = self->system;
+    uint32_t      misses = 0;
+
+    jobs__worker_index = self->index;
+
+    while (!atomic_load(&jobs->stopping))
+    {
+        job_t* job = jobs__find(jobs, self);
+        if (job)
+        {
+            jobs__execute(jobs, job);
+            misses = 0;
+            continue;
+        }
+
+        if (++misses < JOBS_IDLE_SPINS)
+        {
+            thrd_yield();
+            continue;
+        }
+
+        mtx_lock(&jobs->lock);
+        atomic_fetch_add(&jobs->sleeping, 1);
+        while (atomic_load(&jobs->queued) == 0
+               && !atomic_load(&jobs->stopping))
+        {
+            cnd_wait(&jobs->work_ready, &jobs->lock);
+        }
+        atomic_fetch_sub(&jobs->sleeping, 1);
+        mtx_unlock(&jobs->lock);
+        misses = 0;
+    }
+
+    return 0;
+}
+
+//
+// system
+//
+
+void jobs_destroy(job_system_t* jobs);
+
+// `worker_count` includes the calling thread, 0 = one per online core
+job_system_t* jobs_create(allocator* alloc, uint32_t worker_count)
+{
+    if (worker_count == 0)
+    {
+        long cores   = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 0 ? (uint32_t) cores : 1;
+    }
+    if (worker_count > JOBS_MAX_WORKERS)
+    {
+        worker_count = JOBS_MAX_WORKERS;
+    }
+
+    if (jobs__worker_index != JOBS__NOT_A_WORKER)
+    {
+        log_error(LOG_JOBS, "a job system already runs on this thread\n");
+        return NULL;
+    }
+
+    job_system_t* jobs = alloc->malloc(sizeof(job_system_t), alloc->ctx);
+    if (!jobs)
+    {
+        return NULL;
+    }
+
+    *jobs = (job_system_t) { .alloc = alloc };
+
+    jobs->workers = alloc->malloc(
+        (ptrdiff_t) (worker_count * sizeof(job_worker_t)), alloc->ctx);
+    if (!jobs->workers)
+    {
+        alloc->free(jobs, alloc->ctx);
+        return NULL;
+    }
+
+    if (mtx_init(&jobs->lock, mtx_plain) != thrd_success)
+    {
+        alloc->free(jobs->workers, alloc->ctx);
+        alloc->free(jobs, alloc->ctx);
+        return NULL;
+    }
+    cnd_init(&jobs->work_ready);
+
+    for (uint32_t i = 0; i < worker_count; i++)
+    {
+        job_worker_t* worker = &jobs->workers[i];
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        worker->ring_next = 0;
+        worker->rng       = 0x9e3779b9u * (i + 1);
+        worker->index     = i;
+        worker->started   = false;
+        worker->system    = jobs;
+    }
+
+    // the creating thread is worker 0 and only runs jobs while it waits.
+    // A worker that fails to start just leaves an empty deque behind.
+    jobs__worker_index = 0;
+    jobs->worker_count = worker_count;
+
+    for (uint32_t i = 1; i < worker_count; i++)
+    {
+        job_worker_t* worker = &jobs->workers[i];
+        if (thrd_create(&worker->thread, jobs__worker, worker) != thrd_success)
+        {
+            log_error(LOG_JOBS, "job worker %u failed to start\n", i);
+            continue;
+        }
+        worker->started = true;
+    }
+
+    return jobs;
+}
+
+// Stops and joins the workers. Every counter must have been waited on first:
+// a worker finishes the job it is running, but jobs still queued are
+// discarded without running and their counters never reach zero.
+void jobs_destroy(job_system_t* jobs)
+{
+    if (!jobs)
+    {
+        return;
+    }
+
+    mtx_lock(&jobs->lock);
+    atomic_store(&jobs->stopping, true);
+    cnd_broadcast(&jobs->work_ready);
+    mtx_unlock(&jobs->lock);
+
+    for (uint32_t i = 1; i < jobs->worker_count; i++)
+    {
+        if (jobs->workers[i].started)
+        {
+            thrd_join(jobs->workers[i].thread, NULL);
+        }
+    }
+
+    cnd_destroy(&jobs->work_ready);
+    mtx_destroy(&jobs->lock);
+
+    jobs__worker_index = JOBS__NOT_A_WORKER;
+
+    allocator* alloc = jobs->alloc;
+    alloc->free(jobs->workers, alloc->ctx);
+    alloc->free(jobs, alloc->ctx);
+}
+
+uint32_t jobs_worker_count(const job_system_t* jobs)
+{
+    return jobs->worker_count;
+}
+
+// Index of the calling worker, handy for per-thread scratch. Only valid on
+// the creating thread and inside jobs.
+uint32_t jobs_worker_index(void)
+{
+    return jobs__worker_index;
+}
+
+void job_counter_init(job_counter_t* counter)
+{
+    atomic_init(&counter->pending, 0);
+    atomic_init(&counter->continuations, JOBS__RELEASED);
+}
+
+// The last job still touches the counter after `pending` drops, checking for
+// the release as well keeps stack counters safe to leave
+bool jobs_done(job_counter_t* counter)
+{
+    return atomic_load(&counter->pending) == 0
+           && atomic_load(&counter->continuations) == JOBS__RELEASED;
+}
+
+// Queues `count` jobs on the calling worker, `counter` (may be NULL) goes up
+// by `count` and drops as each of them returns
+void jobs_run(job_system_t*     jobs,
+              const job_decl_t* decls,
+              uint32_t          count,
+              job_counter_t*    counter)
+{
+    job_worker_t* self = jobs__self(jobs);
+    if (counter && count > 0)
+    {
+        jobs__counter_add(counter, count);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        jobs__schedule(
+            jobs,
+            jobs__new_job(self, decls[i].fn, decls[i].data, counter));
+    }
+}
+
+// Runs `decl` once `after` has drained without blocking anyone for it. The
+// continuation counts against `counter` (may be NULL) right away, so it can
+// be waited on or chained further. A counter that is already done schedules
+// the continuation immediately, so attach continuations after the jobs they
+// depend on have been queued.
+void jobs_then(job_system_t*  jobs,
+               job_counter_t* after,
+               job_decl_t     decl,
+               job_counter_t* counter)
+{
+    job_worker_t* self = jobs__self(jobs);
+    if (counter)
+    {
+        jobs__counter_add(counter, 1);
+    }
+
+    job_t* job  = jobs__new_job(self, decl.fn, decl.data, counter);
+    job_t* head = atomic_load(&after->continuations);
+    do
+    {
+        if (head == JOBS__RELEASED)
+        {
+            jobs__schedule(jobs, job);
+            return;
+        }
+        job->next = head;
+    } while (!atomic_compare_exchange_weak(&after->continuations, &head, job));
+}
+
+// Executes other jobs until `counter` drains, the calling worker is never
+// parked so waiting inside a job is fine
+void jobs_wait(job_system_t* jobs, job_counter_t* counter)
+{
+    job_worker_t* self = jobs__self(jobs);
+    while (!jobs_done(counter))
+    {
+        job_t* job = jobs__find(jobs, self);
+        if (job)
+        {
+            jobs__execute(jobs, job);
+        }
+        else
+        {
+            thrd_yield();
+        }
+    }
+}
+
+#endif  // JOBS_H
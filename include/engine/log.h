@@ -0,0 +1,957 @@
+//
+// Asynchronous logging.
+//
+// log_error/warn/info/debug/trace(category, format, ...) never format or touch
+// stdio on the calling thread. A call copies the format pointer, its arguments
+// in binary form and the bytes of string arguments into a single-producer
+// ring owned by the calling thread, then returns. The flush thread formats the
+// records of all rings in timestamp order and writes them out in batches.
+//
+// Formats must be string literals, they are formatted long after the call.
+// String arguments are copied (up to LOG_MAX_STRING bytes), pointers passed
+// as %p are only printed. Supported conversions are the usual d i u x X o c
+// e f g a s p with flags, width and precision; length modifiers are ignored
+// since every argument is carried at full width.
+//
+// Levels below LOG_LEVEL compile to nothing, log_set_level filters further at
+// runtime. Before log_init and after log_shutdown messages are formatted and
+// written synchronously, so nothing is lost during startup and teardown. A
+// full ring drops messages rather than blocking, the flush thread reports how
+// many.
+//
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "prelude.h"
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+// compile-time threshold, calls below it are stripped
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+// bytes per thread, a power of two
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE (64 * 1024)
+#endif
+
+// longer string arguments are truncated
+#ifndef LOG_MAX_STRING
+#define LOG_MAX_STRING 1024
+#endif
+
+// flush thread sleep while every ring is empty
+#ifndef LOG_FLUSH_MS
+#define LOG_FLUSH_MS 5
+#endif
+
+#define LOG_MAX_ARGS 12
+#define LOG_LINE_SIZE 2048
+
+typedef enum
+{
+    LOG_TRACE = LOG_LEVEL_TRACE,
+    LOG_DEBUG = LOG_LEVEL_DEBUG,
+    LOG_INFO  = LOG_LEVEL_INFO,
+    LOG_WARN  = LOG_LEVEL_WARN,
+    LOG_ERROR = LOG_LEVEL_ERROR
+} log_level_t;
+
+typedef enum
+{
+    LOG_CORE,
+    LOG_DEVICE,
+    LOG_SURFACE,
+    LOG_FRAME,
+    LOG_MEMORY,
+    LOG_IO,
+    LOG_SHADERS,
+    LOG_JOBS,
+    LOG_VALIDATION,
+    LOG_CATEGORY_COUNT
+} log_category_t;
+
+typedef enum
+{
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_FLOAT,
+    LOG_ARG_STRING,  // in a ring, `u` is the copy's offset in the record
+    LOG_ARG_POINTER,
+    LOG_ARG_NONE
+} log_arg_type_t;
+
+typedef struct
+{
+    log_arg_type_t type;
+    union
+    {
+        int64_t     i;
+        uint64_t    u;
+        double      f;
+        const char* s;
+        const void* p;
+    };
+} log_arg_t;
+
+// One message in a ring, 8 byte aligned. The arguments follow the header and
+// the copied strings follow the arguments.
+typedef struct
+{
+    uint32_t    size;  // whole record, padded
+    uint8_t     level;
+    uint8_t     category;
+    uint8_t     arg_count;
+    uint64_t    time_ns;
+    const char* format;
+} log__record_t;
+
+#define LOG__PADDING 0xff  // level of the filler before a ring wraps
+
+// Written by its thread, read by the flush thread. The indices only grow and
+// sit on their own cache lines. Once the thread exited the ring is retired
+// and the flush thread frees it after the last record was written.
+typedef struct log__ring_t
+{
+    _Atomic uint64_t    head;
+    uint8_t             head_pad[56];
+    _Atomic uint64_t    tail;
+    uint8_t             tail_pad[56];
+    atomic_bool         retired;
+    struct log__ring_t* next;
+    _Alignas(8) uint8_t data[LOG_RING_SIZE];
+} log__ring_t;
+
+typedef struct
+{
+    allocator* alloc;
+    FILE*      out;
+    uint64_t   start_ns;
+
+    mtx_t                  lock;      // ring registration and removal
+    tss_t                  ring_key;  // retires a thread's ring at exit
+    _Atomic(log__ring_t*)  rings;
+    atomic_bool            running;
+    atomic_bool            stopping;
+    atomic_uint            generation;  // bumped by every log_init
+    atomic_uint            dropped;
+    atomic_uint            passes;  // drain passes written and flushed
+    atomic_int             level;
+    thrd_t                 thread;
+} log__state_t;
+
+static log__state_t log__state;
+
+static thread_local log__ring_t* log__thread_ring;
+static thread_local uint32_t     log__thread_generation;
+
+static const char* log__level_names[] = {
+    [LOG_TRACE] = "trace",
+    [LOG_DEBUG] = "debug",
+    [LOG_INFO]  = "info",
+    [LOG_WARN]  = "warn",
+    [LOG_ERROR] = "error",
+};
+
+static const char* log__category_names[LOG_CATEGORY_COUNT] = {
+    [LOG_CORE]       = "core",
+    [LOG_DEVICE]     = "device",
+    [LOG_SURFACE]    = "surface",
+    [LOG_FRAME]      = "frame",
+    [LOG_MEMORY]     = "memory",
+    [LOG_IO]         = "io",
+    [LOG_SHADERS]    = "shaders",
+    [LOG_JOBS]       = "jobs",
+    [LOG_VALIDATION] = "validation",
+};
+
+//
+// arguments
+//
+
+static inline log_arg_t log__arg_int(int64_t value)
+{
+    return (log_arg_t) { .type = LOG_ARG_INT, .i = value };
+}
+
+static inline log_arg_t log__arg_uint(uint64_t value)
+{
+    return (log_arg_t) { .type = LOG_ARG_UINT, .u = value };
+}
+
+static inline log_arg_t log__arg_float(double value)
+{
+    return (log_arg_t) { .type = LOG_ARG_FLOAT, .f = value };
+}
+
+static inline log_arg_t log__arg_string(const char* value)
+{
+    return (log_arg_t) { .type = LOG_ARG_STRING, .s = value };
+}
+
+static inline log_arg_t log__arg_pointer(const void* value)
+{
+    return (log_arg_t) { .type = LOG_ARG_POINTER, .p = value };
+}
+
+#define LOG__ARG(x)                                                            \
+    _Generic((x),                                                              \
+        _Bool: log__arg_uint,                                                  \
+        char: log__arg_int,                                                    \
+        signed char: log__arg_int,                                             \
+        unsigned char: log__arg_uint,                                          \
+        short: log__arg_int,                                                   \
+        unsigned short: log__arg_uint,                                         \
+        int: log__arg_int,                                                     \
+        unsigned int: log__arg_uint,                                           \
+        long: log__arg_int,                                                    \
+        unsigned long: log__arg_uint,                                          \
+        long long: log__arg_int,                                               \
+        unsigned long long: log__arg_uint,                                     \
+        float: log__arg_float,                                                 \
+        double: log__arg_float,                                                \
+        long double: log__arg_float,                                           \
+        char*: log__arg_string,                                                \
+        const char*: log__arg_string,                                          \
+        default: log__arg_pointer)(x)
+
+// The first argument is the format, these look at the ones after it
+#define LOG__COUNT(...)                                                        \
+    LOG__COUNT_(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, _)
+#define LOG__COUNT_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, n, \
+                    ...)                                                       \
+    n
+
+#define LOG__FORMAT(...) LOG__FORMAT_(__VA_ARGS__, _)
+#define LOG__FORMAT_(f, ...) f
+
+#define LOG__CONCAT(a, b) LOG__CONCAT_(a, b)
+#define LOG__CONCAT_(a, b) a##b
+
+#define LOG__MAP0(f)
+#define LOG__MAP1(f, a) LOG__ARG(a),
+#define LOG__MAP2(f, a, ...) LOG__ARG(a), LOG__MAP1(f, __VA_ARGS__)
+#define LOG__MAP3(f, a, ...) LOG__ARG(a), LOG__MAP2(f, __VA_ARGS__)
+#define LOG__MAP4(f, a, ...) LOG__ARG(a), LOG__MAP3(f, __VA_ARGS__)
+#define LOG__MAP5(f, a, ...) LOG__ARG(a), LOG__MAP4(f, __VA_ARGS__)
+#define LOG__MAP6(f, a, ...) LOG__ARG(a), LOG__MAP5(f, __VA_ARGS__)
+#define LOG__MAP7(f, a, ...) LOG__ARG(a), LOG__MAP6(f, __VA_ARGS__)
+#define LOG__MAP8(f, a, ...) LOG__ARG(a), LOG__MAP7(f, __VA_ARGS__)
+#define LOG__MAP9(f, a, ...) LOG__ARG(a), LOG__MAP8(f, __VA_ARGS__)
+#define LOG__MAP10(f, a, ...) LOG__ARG(a), LOG__MAP9(f, __VA_ARGS__)
+#define LOG__MAP11(f, a, ...) LOG__ARG(a), LOG__MAP10(f, __VA_ARGS__)
+#define LOG__MAP12(f, a, ...) LOG__ARG(a), LOG__MAP11(f, __VA_ARGS__)
+
+// LOG__ARG(x), for every argument after the format, each followed by a comma
+#define LOG__MAP(...)                                                          \
+    LOG__CONCAT(LOG__MAP, LOG__COUNT(__VA_ARGS__))(__VA_ARGS__)
+
+//
+// formatting
+//
+
+static size_t log__append(size_t cap, size_t len, int written)
+{
+    if (written < 0)
+    {
+        return len;
+    }
+
+    len += (size_t) written;
+    return len < cap ? len : cap - 1;
+}
+
+// The conversion specs come from the (literal) format of the call, the
+// argument types from the record, so the format checks cannot see them
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+
+static size_t log__format_arg(char*            out,
+                              size_t           cap,
+                              const char*      spec,
+                              size_t           spec_len,
+                              char             conversion,
+                              const log_arg_t* arg)
+{
+    // rebuild the spec with the length modifier the carried type needs
+    char buffer[32];
+    if (spec_len + 4 > sizeof(buffer))
+    {
+        return 0;
+    }
+
+    memcpy(buffer, spec, spec_len);
+    char* tail = buffer + spec_len;
+
+    bool integer  = strchr("diouxXc", conversion) != NULL;
+    bool floating = strchr("eEfFgGaA", conversion) != NULL;
+
+    int written = -1;
+    if (arg->type == LOG_ARG_STRING && conversion == 's')
+    {
+        memcpy(tail, "s", 2);
+        written = snprintf(out, cap, buffer, arg->s);
+    }
+    else if (arg->type == LOG_ARG_POINTER && conversion == 'p')
+    {
+        memcpy(tail, "p", 2);
+        written = snprintf(out, cap, buffer, arg->p);
+    }
+    else if (floating)
+    {
+        double value = arg->type == LOG_ARG_FLOAT ? arg->f
+                     : arg->type == LOG_ARG_INT   ? (double) arg->i
+                                                  : (double) arg->u;
+        tail[0] = conversion;
+        tail[1] = '\0';
+        written = snprintf(out, cap, buffer, value);
+    }
+    else if (integer && conversion == 'c')
+    {
+        memcpy(tail, "c", 2);
+        written = snprintf(out, cap, buffer, (int) arg->i);
+    }
+    else if (integer)
+    {
+        tail[0] = 'l';
+        tail[1] = 'l';
+        tail[2] = conversion;
+        tail[3] = '\0';
+
+        bool is_signed = conversion == 'd' || conversion == 'i';
+        if (arg->type == LOG_ARG_FLOAT)
+        {
+            written = is_signed
+                        ? snprintf(out, cap, buffer, (long long) arg->f)
+                        : snprintf(
+                              out, cap, buffer, (unsigned long long) arg->f);
+        }
+        else if (is_signed)
+        {
+            written = snprintf(out, cap, buffer, (long long) arg->i);
+        }
+        else
+        {
+            written = snprintf(out, cap, buffer, (unsigned long long) arg->u);
+        }
+    }
+    else
+    {
+        written = snprintf(out, cap, "<bad %c>", conversion);
+    }
+
+    return log__append(cap, 0, written);
+}
+
+#pragma GCC diagnostic pop
+
+// Formats into `out` (NUL terminated, truncated to `cap`) and returns the
+// length, trailing newlines dropped
+static size_t log__format(char*            out,
+                          size_t           cap,
+                          const char*      format,
+                          const log_arg_t* args,
+                          uint32_t         arg_count)
+{
+    size_t   len  = 0;
+    uint32_t next = 0;
+    out[0]        = '\0';
+
+    for (const char* c = format; *c && len + 1 < cap;)
+    {
+        if (*c != '%')
+        {
+            out[len++] = *c++;
+            continue;
+        }
+
+        if (c[1] == '%')
+        {
+            out[len++] = '%';
+            c += 2;
+            continue;
+        }
+
+        // %[flags][width][.precision][length]conversion
+        const char* spec = c++;
+        while (*c && strchr("-+ #0", *c))
+        {
+            c++;
+        }
+        while (*c >= '0' && *c <= '9')
+        {
+            c++;
+        }
+        if (*c == '.')
+        {
+            c++;
+            while (*c >= '0' && *c <= '9')
+            {
+                c++;
+            }
+        }
+        size_t spec_len = (size_t) (c - spec);
+        while (*c && strchr("hlLqjzt", *c))
+        {
+            c++;
+        }
+
+        char conversion = *c;
+        if (!conversion || next == arg_count)
+        {
+            break;
+        }
+        c++;
+
+        len += log__format_arg(
+            out + len, cap - len, spec, spec_len, conversion, &args[next++]);
+    }
+
+    while (len > 0 && out[len - 1] == '\n')
+    {
+        len--;
+    }
+    out[len] = '\0';
+
+    return len;
+}
+
+static size_t log__line(char*            out,
+                        size_t           cap,
+                        uint64_t         time_ns,
+                        uint32_t         level,
+                        uint32_t         category,
+                        const char*      format,
+                        const log_arg_t* args,
+                        uint32_t         arg_count)
+{
+    uint64_t since = time_ns > log__state.start_ns
+                       ? time_ns - log__state.start_ns
+                       : 0;
+
+    size_t len = log__append(cap,
+                             0,
+                             snprintf(out,
+                                      cap,
+                                      "%9.3f %-5s %-10s ",
+                                      (double) since / 1e9,
+                                      log__level_names[level],
+                                      log__category_names[category]));
+
+    len += log__format(out + len, cap - len - 1, format, args, arg_count);
+    out[len++] = '\n';
+    out[len]   = '\0';
+    return len;
+}
+
+//
+// rings
+//
+
+// tss destructor, runs as a thread that logged exits
+static void log__thread_exit(void* data)
+{
+    log__ring_t* ring = data;
+    atomic_store_explicit(&ring->retired, true, memory_order_release);
+    log__thread_ring = NULL;
+}
+
+static log__ring_t* log__thread_ring_get(void)
+{
+    uint32_t generation = atomic_load(&log__state.generation);
+    if (log__thread_ring && log__thread_generation == generation)
+    {
+        return log__thread_ring;
+    }
+
+    log__ring_t* ring = NULL;
+
+    mtx_lock(&log__state.lock);
+    if (atomic_load(&log__state.running))
+    {
+        allocator* alloc = log__state.alloc;
+        ring = alloc->malloc((ptrdiff_t) sizeof(log__ring_t), alloc->ctx);
+        if (ring)
+        {
+            atomic_init(&ring->head, 0);
+            atomic_init(&ring->tail, 0);
+            atomic_init(&ring->retired, false);
+            ring->next = atomic_load(&log__state.rings);
+            atomic_store_explicit(
+                &log__state.rings, ring, memory_order_release);
+        }
+    }
+    mtx_unlock(&log__state.lock);
+
+    if (ring)
+    {
+        tss_set(log__state.ring_key, ring);
+    }
+
+    log__thread_ring       = ring;
+    log__thread_generation = generation;
+    return ring;
+}
+
+static void log__write_now(uint64_t         time_ns,
+                           log_level_t      level,
+                           log_category_t   category,
+                           const char*      format,
+                           const log_arg_t* args,
+                           uint32_t         arg_count)
+{
+    char   line[LOG_LINE_SIZE];
+    size_t len = log__line(line,
+                           sizeof(line),
+                           time_ns,
+                           level,
+                           category,
+                           format,
+                           args,
+                           arg_count);
+    fwrite(line, 1, len, log__state.out ? log__state.out : stdout);
+}
+
+// Called by the log_* macros
+void log__write(log_level_t      level,
+                log_category_t   category,
+                const char*      format,
+                uint32_t         arg_count,
+                const log_arg_t* args)
+{
+    if ((int) level < atomic_load_explicit(&log__state.level,
+                                           memory_order_relaxed))
+    {
+        return;
+    }
+
+    uint64_t now = time_now_ns();
+
+    log__ring_t* ring = atomic_load_explicit(&log__state.running,
+                                             memory_order_acquire)
+                          ? log__thread_ring_get()
+                          : NULL;
+    if (!ring)
+    {
+        log__write_now(now, level, category, format, args, arg_count);
+        return;
+    }
+
+    size_t lengths[LOG_MAX_ARGS];
+    size_t size = sizeof(log__record_t) + arg_count * sizeof(log_arg_t);
+    for (uint32_t i = 0; i < arg_count; i++)
+    {
+        if (args[i].type == LOG_ARG_STRING)
+        {
+            const char* s = args[i].s ? args[i].s : "(null)";
+            lengths[i]    = strnlen(s, LOG_MAX_STRING - 1);
+            size += lengths[i] + 1;
+        }
+    }
+    size = (size + 7) & ~(size_t) 7;
+
+    // reserve, with a filler when the record would straddle the end
+    uint64_t head   = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail   = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t   offset = (size_t) (head & (LOG_RING_SIZE - 1));
+    size_t   to_end = LOG_RING_SIZE - offset;
+    size_t   needed = size + (to_end < size ? to_end : 0);
+    if (LOG_RING_SIZE - (head - tail) < needed)
+    {
+        atomic_fetch_add_explicit(&log__state.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (to_end < size)
+    {
+        log__record_t* filler = (log__record_t*) (void*) &ring->data[offset];
+        filler->size          = (uint32_t) to_end;
+        filler->level         = LOG__PADDING;
+        head += to_end;
+        offset = 0;
+    }
+
+    uint8_t*       base   = &ring->data[offset];
+    log__record_t* record = (log__record_t*) (void*) base;
+    log_arg_t*     copies = (log_arg_t*) (void*) (record + 1);
+    size_t         used
+        = sizeof(log__record_t) + arg_count * sizeof(log_arg_t);
+
+    *record = (log__record_t) {
+        .size      = (uint32_t) size,
+        .level     = (uint8_t) level,
+        .category  = (uint8_t) category,
+        .arg_count = (uint8_t) arg_count,
+        .time_ns   = now,
+        .format    = format,
+    };
+
+    for (uint32_t i = 0; i < arg_count; i++)
+    {
+        copies[i] = args[i];
+        if (args[i].type == LOG_ARG_STRING)
+        {
+            const char* s = args[i].s ? args[i].s : "(null)";
+            memcpy(base + used, s, lengths[i]);
+            base[used + lengths[i]] = '\0';
+            copies[i].u             = used;
+            used += lengths[i] + 1;
+        }
+    }
+
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+}
+
+// Oldest record of `ring` past any filler, NULL when it is empty
+static log__record_t* log__peek(log__ring_t* ring)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head)
+    {
+        log__record_t* record = (log__record_t*) (void*) &ring
+                                    ->data[tail & (LOG_RING_SIZE - 1)];
+        if (record->level != LOG__PADDING)
+        {
+            return record;
+        }
+
+        tail += record->size;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+// Flush thread only, writes out everything published so far oldest first
+static uint32_t log__drain(void)
+{
+    char     batch[4 * LOG_LINE_SIZE];
+    size_t   batch_len = 0;
+    uint32_t count     = 0;
+
+    log__ring_t* rings
+        = atomic_load_explicit(&log__state.rings, memory_order_acquire);
+
+    while (true)
+    {
+        log__ring_t*   oldest_ring = NULL;
+        log__record_t* oldest      = NULL;
+        for (log__ring_t* ring = rings; ring; ring = ring->next)
+        {
+            log__record_t* record = log__peek(ring);
+            if (record && (!oldest || record->time_ns < oldest->time_ns))
+            {
+                oldest      = record;
+                oldest_ring = ring;
+            }
+        }
+
+        if (!oldest)
+        {
+            break;
+        }
+
+        // string arguments point back into the record
+        log_arg_t        args[LOG_MAX_ARGS];
+        const log_arg_t* stored = (const log_arg_t*) (const void*) (oldest + 1);
+        for (uint32_t i = 0; i < oldest->arg_count; i++)
+        {
+            args[i] = stored[i];
+            if (args[i].type == LOG_ARG_STRING)
+            {
+                args[i].s = (const char*) oldest + stored[i].u;
+            }
+        }
+
+        if (batch_len + LOG_LINE_SIZE > sizeof(batch))
+        {
+            fwrite(batch, 1, batch_len, log__state.out);
+            batch_len = 0;
+        }
+
+        batch_len += log__line(batch + batch_len,
+                               LOG_LINE_SIZE,
+                               oldest->time_ns,
+                               oldest->level,
+                               oldest->category,
+                               oldest->format,
+                               args,
+                               oldest->arg_count);
+
+        uint64_t tail = atomic_load_explicit(&oldest_ring->tail,
+                                             memory_order_relaxed);
+        atomic_store_explicit(
+            &oldest_ring->tail, tail + oldest->size, memory_order_release);
+        count++;
+    }
+
+    uint32_t dropped = atomic_exchange(&log__state.dropped, 0);
+    if (dropped)
+    {
+        batch_len += log__append(
+            sizeof(batch) - batch_len,
+            0,
+            snprintf(batch + batch_len,
+                     sizeof(batch) - batch_len,
+                     "log: %u messages dropped, ring full\n",
+                     dropped));
+    }
+
+    if (batch_len > 0)
+    {
+        fwrite(batch, 1, batch_len, log__state.out);
+    }
+    if (batch_len > 0 || count > 0)
+    {
+        fflush(log__state.out);
+    }
+
+    return count;
+}
+
+// Flush thread only, frees the rings of exited threads once drained
+static void log__reclaim(void)
+{
+    allocator*   alloc = log__state.alloc;
+    log__ring_t* dead  = NULL;
+
+    // producers only push at the front, under the same lock
+    mtx_lock(&log__state.lock);
+    log__ring_t* prev = NULL;
+    log__ring_t* ring = atomic_load(&log__state.rings);
+    while (ring)
+    {
+        log__ring_t* next = ring->next;
+        if (atomic_load_explicit(&ring->retired, memory_order_acquire)
+            && atomic_load(&ring->tail) == atomic_load(&ring->head))
+        {
+            if (prev)
+            {
+                prev->next = next;
+            }
+            else
+            {
+                atomic_store(&log__state.rings, next);
+            }
+
+            ring->next = dead;
+            dead       = ring;
+        }
+        else
+        {
+            prev = ring;
+        }
+        ring = next;
+    }
+    mtx_unlock(&log__state.lock);
+
+    while (dead)
+    {
+        log__ring_t* next = dead->next;
+        alloc->free(dead, alloc->ctx);
+        dead = next;
+    }
+}
+
+static int log__thread(void* arg)
+{
+    (void) arg;
+
+    while (!atomic_load(&log__state.stopping))
+    {
+        uint32_t count = log__drain();
+        atomic_fetch_add(&log__state.passes, 1);
+        log__reclaim();
+
+        if (count == 0)
+        {
+            struct timespec nap = { .tv_nsec = LOG_FLUSH_MS * 1000000L };
+            thrd_sleep(&nap, NULL);
+        }
+    }
+
+    log__drain();
+    return 0;
+}
+
+//
+// logger
+//
+
+// Starts the flush thread writing to `out` (NULL = stdout). Rings come from
+// `alloc`, which has to be thread-safe.
+bool log_init(allocator* alloc, FILE* out)
+{
+    if (atomic_load(&log__state.running))
+    {
+        return true;
+    }
+
+    log__state.alloc    = alloc;
+    log__state.out      = out ? out : stdout;
+    log__state.start_ns = time_now_ns();
+    atomic_store(&log__state.rings, NULL);
+    atomic_store(&log__state.stopping, false);
+    atomic_store(&log__state.dropped, 0);
+
+    if (mtx_init(&log__state.lock, mtx_plain) != thrd_success)
+    {
+        return false;
+    }
+
+    if (tss_create(&log__state.ring_key, log__thread_exit) != thrd_success)
+    {
+        mtx_destroy(&log__state.lock);
+        return false;
+    }
+
+    atomic_fetch_add(&log__state.generation, 1);
+    atomic_store(&log__state.running, true);
+
+    if (thrd_create(&log__state.thread, log__thread, NULL) != thrd_success)
+    {
+        atomic_store(&log__state.running, false);
+        tss_delete(log__state.ring_key);
+        mtx_destroy(&log__state.lock);
+        return false;
+    }
+
+    return true;
+}
+
+// Every thread that logs must have stopped, later messages are written
+// synchronously to stdout
+void log_shutdown(void)
+{
+    if (!atomic_load(&log__state.running))
+    {
+        return;
+    }
+
+    mtx_lock(&log__state.lock);
+    atomic_store(&log__state.running, false);
+    mtx_unlock(&log__state.lock);
+
+    atomic_store(&log__state.stopping, true);
+    thrd_join(log__state.thread, NULL);
+
+    allocator*   alloc = log__state.alloc;
+    log__ring_t* ring  = atomic_load(&log__state.rings);
+    while (ring)
+    {
+        log__ring_t* next = ring->next;
+        alloc->free(ring, alloc->ctx);
+        ring = next;
+    }
+    atomic_store(&log__state.rings, NULL);
+    tss_delete(log__state.ring_key);
+
+    // the caller may close `out` now, later messages go to stdout
+    fflush(log__state.out);
+    log__state.out = NULL;
+
+    mtx_destroy(&log__state.lock);
+}
+
+// Blocks until every message logged before the call has been written, e.g.
+// before abort
+void log_flush(void)
+{
+    if (!atomic_load(&log__state.running))
+    {
+        fflush(log__state.out ? log__state.out : stdout);
+        return;
+    }
+
+    // A ring's tail moves before its records reach the stream, wait for a
+    // whole pass that began after the call instead. It saw every record
+    // published so far and flushed them.
+    uint32_t start = atomic_load(&log__state.passes);
+    while (atomic_load(&log__state.passes) - start < 2
+           && atomic_load(&log__state.running))
+    {
+        thrd_yield();
+    }
+
+    fflush(log__state.out);
+}
+
+// Runtime threshold on top of LOG_LEVEL
+void log_set_level(log_level_t level)
+{
+    atomic_store(&log__state.level, (int) level);
+}
+
+// Type checks the format like printf without evaluating anything
+#define LOG__CHECK(...)                                                        \
+    do                                                                         \
+    {                                                                          \
+        if (0)                                                                 \
+        {                                                                      \
+            printf(__VA_ARGS__);                                               \
+        }                                                                      \
+    } while (0)
+
+#define log_write(level, category, ...)                                       \
+    do                                                                         \
+    {                                                                          \
+        LOG__CHECK(__VA_ARGS__);                                               \
+        log__write((level),                                                    \
+                   (category),                                                 \
+                   LOG__FORMAT(__VA_ARGS__),                                   \
+                   LOG__COUNT(__VA_ARGS__),                                    \
+                   (const log_arg_t[]) {                                       \
+                       LOG__MAP(__VA_ARGS__)(log_arg_t) {                      \
+                           .type = LOG_ARG_NONE } });                          \
+    } while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_TRACE
+#define log_trace(category, ...) log_write(LOG_TRACE, category, __VA_ARGS__)
+#else
+#define log_trace(category, ...) LOG__CHECK(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define log_debug(category, ...) log_write(LOG_DEBUG, category, __VA_ARGS__)
+#else
+#define log_debug(category, ...) LOG__CHECK(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define log_info(category, ...) log_write(LOG_INFO, category, __VA_ARGS__)
+#else
+#define log_info(category, ...) LOG__CHECK(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define log_warn(category, ...) log_write(LOG_WARN, category, __VA_ARGS__)
+#else
+#define log_warn(category, ...) LOG__CHECK(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define log_error(category, ...) log_write(LOG_ERROR, category, __VA_ARGS__)
+#else
+#define log_error(category, ...) LOG__CHECK(__VA_ARGS__)
+#endif
+
+#endif  // LOG_H
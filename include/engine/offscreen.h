@@ -0,0 +1,200 @@
+//
+// Headless render targets.
+//
+// Stands in for the window when there is no display. The frame loop renders
+// into plain device-local VkImages described by a surface_info_t without a
+// swapchain, one image per frame slot, so the slot's ticket also guards its
+// image. Nothing is presented; finished frames are copied to host memory by
+// the frame readback and can be written out with offscreen_write_ppm.
+//
+
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "device.h"
+#include "gpu_memory.h"
+#include "surface.h"
+
+// RGBA byte order, so readbacks map straight onto image files
+#ifndef OFFSCREEN_FORMAT
+#define OFFSCREEN_FORMAT VK_FORMAT_R8G8B8A8_SRGB
+#endif
+
+void destroy_offscreen_surface(allocator*           alloc,
+                               gpu_memory_t*        memory,
+                               const device_info_t* device_info,
+                               surface_info_t*      surface)
+{
+    for (uint32_t i = 0; i < surface->image_count; i++)
+    {
+        vkDestroyImageView(device_info->device, surface->views[i], nullptr);
+        gpu_memory_destroy_image(alloc,
+                                 memory,
+                                 device_info,
+                                 surface->images[i],
+                                 &surface->image_allocations[i]);
+    }
+
+    alloc->free(surface->images, alloc->ctx);
+    alloc->free(surface->views, alloc->ctx);
+    alloc->free(surface->image_allocations, alloc->ctx);
+
+    *surface = (surface_info_t) { 0 };
+}
+
+// Creates `image_count` color targets of `width` x `height` in device local
+// memory. The usage covers clears, color attachment writes and copies out
+// for readback.
+surface_info_t create_offscreen_surface(allocator*           alloc,
+                                        gpu_memory_t*        memory,
+                                        const device_info_t* device_info,
+                                        uint32_t             width,
+                                        uint32_t             height,
+                                        uint32_t             image_count)
+{
+    VkDevice       device  = device_info->device;
+    surface_info_t surface = {
+        .image_format = OFFSCREEN_FORMAT,
+        .image_usage  = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                       | VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                       | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        .extent       = (VkExtent2D) { width, height },
+    };
+
+    surface.images = alloc->malloc(
+        (ptrdiff_t) (image_count * sizeof(VkImage)), alloc->ctx);
+    surface.views = alloc->malloc(
+        (ptrdiff_t) (image_count * sizeof(VkImageView)), alloc->ctx);
+    surface.image_allocations = alloc->malloc(
+        (ptrdiff_t) (image_count * sizeof(gpu_allocation_t)), alloc->ctx);
+    if (!surface.images || !surface.views || !surface.image_allocations)
+    {
+        destroy_offscreen_surface(alloc, memory, device_info, &surface);
+        surface.status = SURFACE_CREATION_FAILED;
+        return surface;
+    }
+
+    VkImageCreateInfo image_info = {
+        .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType     = VK_IMAGE_TYPE_2D,
+        .format        = surface.image_format,
+        .extent        = (VkExtent3D) { width, height, 1 },
+        .mipLevels     = 1,
+        .arrayLayers   = 1,
+        .samples       = VK_SAMPLE_COUNT_1_BIT,
+        .tiling        = VK_IMAGE_TILING_OPTIMAL,
+        .usage         = surface.image_usage,
+        .sharingMode   = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    VkImageViewCreateInfo view_info = {
+        .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .viewType         = VK_IMAGE_VIEW_TYPE_2D,
+        .format           = surface.image_format,
+        .subresourceRange = (VkImageSubresourceRange) {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .levelCount = 1,
+            .layerCount = 1,
+        },
+    };
+
+    gpu_memory_request_t request = {
+        .required = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    };
+
+    for (uint32_t i = 0; i < image_count; i++)
+    {
+        VkImage          image      = VK_NULL_HANDLE;
+        gpu_allocation_t allocation = { 0 };
+        VkImageView      view       = VK_NULL_HANDLE;
+
+        if (!gpu_memory_create_image(alloc,
+                                     memory,
+                                     device_info,
+                                     &image_info,
+                                     &request,
+                                     &image,
+                                     &allocation))
+        {
+            log_error(LOG_FRAME, "failed to create offscreen image %u\n", i);
+            destroy_offscreen_surface(alloc, memory, device_info, &surface);
+            surface.status = SURFACE_CREATION_FAILED;
+            return surface;
+        }
+
+        view_info.image = image;
+        if (vkCreateImageView(device, &view_info, nullptr, &view)
+            != VK_SUCCESS)
+        {
+            log_error(LOG_FRAME, "failed to create offscreen view %u\n", i);
+            gpu_memory_destroy_image(
+                alloc, memory, device_info, image, &allocation);
+            destroy_offscreen_surface(alloc, memory, device_info, &surface);
+            surface.status = SURFACE_CREATION_FAILED;
+            return surface;
+        }
+
+        surface.images[i]            = image;
+        surface.image_allocations[i] = allocation;
+        surface.views[i]             = view;
+        surface.image_count++;
+    }
+
+    return surface;
+}
+
+// Writes tightly packed or padded RGBA rows as a binary PPM, dropping alpha
+bool offscreen_write_ppm(const char* path,
+                         const void* pixels,
+                         VkExtent2D  extent,
+                         uint32_t    row_pitch)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        log_error(LOG_FRAME, "failed to open %s for writing\n", path);
+        return false;
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", extent.width, extent.height);
+
+    const uint8_t* row = pixels;
+    uint8_t        rgb[3 * 256];
+    for (uint32_t y = 0; y < extent.height; y++, row += row_pitch)
+    {
+        for (uint32_t x = 0; x < extent.width;)
+        {
+            uint32_t run = extent.width - x < 256 ? extent.width - x : 256;
+            for (uint32_t i = 0; i < run; i++)
+            {
+                memcpy(&rgb[3 * i], &row[4 * (x + i)], 3);
+            }
+
+            fwrite(rgb, 3, run, file);
+            x += run;
+        }
+    }
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0)
+    {
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        log_error(LOG_FRAME, "failed to write %s\n", path);
+    }
+
+    return ok;
+}
+
+#endif  // OFFSCREEN_H
@@ -0,0 +1,102 @@
+//
+// Frame pacing and latency measurement.
+//
+// frame_pacer_wait holds the main loop to a target frame rate. Sleep wakeups
+// overshoot by tens to hundreds of microseconds, so it sleeps until
+// FRAME_PACER_SPIN_NS before the deadline and spins the rest. Deadlines
+// advance by a fixed period rather than from the wakeup, so overshoot does
+// not accumulate into drift. The engine waits before it polls input, which
+// keeps the wait out of the input-to-present latency.
+//
+// frame_latency_t accumulates input-to-present samples: from the input poll a
+// frame was built after to the moment its submission is seen retired, which
+// is when the image is handed to the presentation engine. FIFO modes add up
+// to one refresh on top while the image waits for vblank.
+//
+
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "prelude.h"
+
+// Busy-wait margin before a deadline, covers the scheduler's wakeup latency
+#ifndef FRAME_PACER_SPIN_NS
+#define FRAME_PACER_SPIN_NS 1000000ull
+#endif
+
+typedef struct
+{
+    uint64_t period_ns;  // 0 = uncapped
+    uint64_t deadline_ns;
+} frame_pacer_t;
+
+// `max_fps` of 0 disables the limiter
+void frame_pacer_init(frame_pacer_t* pacer, uint32_t max_fps)
+{
+    *pacer = (frame_pacer_t) {
+        .period_ns = max_fps ? 1000000000ull / max_fps : 0,
+    };
+}
+
+// Returns once the next frame may start
+void frame_pacer_wait(frame_pacer_t* pacer)
+{
+    if (pacer->period_ns == 0)
+    {
+        return;
+    }
+
+    uint64_t now = time_now_ns();
+
+    // first frame, or a hitch left us more than a frame behind: restart the
+    // schedule instead of running the missed frames back to back
+    if (pacer->deadline_ns == 0 || now > pacer->deadline_ns + pacer->period_ns)
+    {
+        pacer->deadline_ns = now + pacer->period_ns;
+        return;
+    }
+
+    if (now + FRAME_PACER_SPIN_NS < pacer->deadline_ns)
+    {
+        uint64_t        wake = pacer->deadline_ns - FRAME_PACER_SPIN_NS;
+        struct timespec until = {
+            .tv_sec  = (time_t) (wake / 1000000000ull),
+            .tv_nsec = (long) (wake % 1000000000ull),
+        };
+
+        // EINTR only makes the spin below longer
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+    }
+
+    while (time_now_ns() < pacer->deadline_ns)
+    {
+    }
+
+    pacer->deadline_ns += pacer->period_ns;
+}
+
+typedef struct
+{
+    uint64_t samples;
+    double   last_ms;
+    double   mean_ms;
+    double   max_ms;
+} frame_latency_t;
+
+void frame_latency_record(frame_latency_t* latency, uint64_t ns)
+{
+    double ms = time_ns_to_ms(ns);
+
+    latency->samples++;
+    latency->last_ms = ms;
+    latency->mean_ms += (ms - latency->mean_ms) / (double) latency->samples;
+    if (ms > latency->max_ms)
+    {
+        latency->max_ms = ms;
+    }
+}
+
+#endif  // PACING_H
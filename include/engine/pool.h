@@ -0,0 +1,489 @@
+//
+// Size-class pool allocator behind the prelude `allocator` interface.
+//
+// Small requests are rounded up to a power-of-two size class and served from
+// slabs carved by the calling thread. Every thread has its own free list per
+// class, so malloc/free on the owning thread never takes a lock. A block freed
+// by another thread is pushed onto the owner's lock-free return queue and
+// picked up the next time the owner runs dry. Requests bigger than the last
+// class, or from a thread that finds all POOL_MAX_THREADS slots taken, go to
+// the backing allocator. A slot is freed when its thread exits and the next
+// new thread takes it over along with whatever its caches still hold, so
+// threads started per batch keep using the fast path.
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+
+#include "prelude.h"
+#include "log.h"
+
+// size classes are 16, 32, ... 2048 bytes
+#define POOL_MIN_CLASS_SHIFT 4
+#define POOL_CLASS_COUNT     8
+#define POOL_LARGE_CLASS     POOL_CLASS_COUNT
+
+#ifndef POOL_SLAB_SIZE
+#define POOL_SLAB_SIZE (64 * 1024)
+#endif
+
+#ifndef POOL_MAX_THREADS
+#define POOL_MAX_THREADS 64
+#endif
+
+// Sits right in front of every block handed out, keeps user memory 16 aligned
+typedef struct
+{
+    alignas(16) uint32_t class_index;
+    uint32_t owner;
+    uint64_t size;  // class size, or the requested size for large blocks
+} pool_header_t;
+
+typedef struct pool_block_t
+{
+    struct pool_block_t* next;
+} pool_block_t;
+
+typedef struct pool_slab_t
+{
+    alignas(16) struct pool_slab_t* next;
+} pool_slab_t;
+
+// Only touched by the owning thread, except `returned`
+typedef struct
+{
+    pool_block_t* free_list[POOL_CLASS_COUNT];
+    char*         bump[POOL_CLASS_COUNT];
+    char*         bump_end[POOL_CLASS_COUNT];
+
+    // blocks freed by other threads, drained in one exchange by the owner
+    _Atomic(pool_block_t*) returned;
+} pool_thread_cache_t;
+
+typedef struct
+{
+    size_t bytes_live;
+    size_t high_water;
+    size_t allocs[POOL_CLASS_COUNT + 1];  // last entry counts large blocks
+} pool_stats_t;
+
+typedef struct
+{
+    allocator* backing;
+
+    mtx_t        lock;  // guards the backing allocator and the slab list
+    pool_slab_t* slabs;
+
+    pool_thread_cache_t caches[POOL_MAX_THREADS];
+
+    atomic_size_t bytes_live;
+    atomic_size_t high_water;
+    atomic_size_t allocs[POOL_CLASS_COUNT + 1];
+} pool_t;
+
+static atomic_bool            pool__slot_taken[POOL_MAX_THREADS];
+static _Thread_local uint32_t pool__thread_id = UINT32_MAX;
+
+// frees a thread's slot at exit, created once by the first pool_init
+static once_flag pool__slot_once = ONCE_FLAG_INIT;
+static tss_t     pool__slot_key;
+static bool      pool__slot_key_valid;
+
+// tss destructor, runs as a thread holding a slot exits. Release pairs with
+// the acquire in pool__current_thread so the next owner sees its caches
+static void pool__thread_exit(void* data)
+{
+    atomic_bool* taken = data;
+    pool__thread_id    = UINT32_MAX;
+    atomic_store_explicit(taken, false, memory_order_release);
+}
+
+static void pool__slot_key_create(void)
+{
+    pool__slot_key_valid
+        = tss_create(&pool__slot_key, pool__thread_exit) == thrd_success;
+}
+
+// POOL_MAX_THREADS while every slot is taken, retried on the next call
+static uint32_t pool__current_thread(void)
+{
+    if (pool__thread_id != UINT32_MAX)
+    {
+        return pool__thread_id;
+    }
+
+    for (uint32_t i = 0; i < POOL_MAX_THREADS; i++)
+    {
+        bool expected = false;
+        if (!atomic_load_explicit(&pool__slot_taken[i], memory_order_relaxed)
+            && atomic_compare_exchange_strong_explicit(&pool__slot_taken[i],
+                                                       &expected,
+                                                       true,
+                                                       memory_order_acquire,
+                                                       memory_order_relaxed))
+        {
+            // without the key the slot is simply never handed back
+            if (pool__slot_key_valid)
+            {
+                tss_set(pool__slot_key, &pool__slot_taken[i]);
+            }
+
+            pool__thread_id = i;
+            return i;
+        }
+    }
+
+    return POOL_MAX_THREADS;
+}
+
+static uint32_t pool__class_for(size_t size)
+{
+    uint32_t index = 0;
+    size_t   cap   = (size_t) 1 << POOL_MIN_CLASS_SHIFT;
+    while (cap < size && index < POOL_CLASS_COUNT)
+    {
+        cap <<= 1;
+        index++;
+    }
+
+    return index;
+}
+
+static size_t pool__class_size(uint32_t class_index)
+{
+    return (size_t) 1 << (class_index + POOL_MIN_CLASS_SHIFT);
+}
+
+bool pool_init(pool_t* pool, allocator* backing)
+{
+    call_once(&pool__slot_once, pool__slot_key_create);
+
+    *pool = (pool_t) { .backing = backing };
+
+    return mtx_init(&pool->lock, mtx_plain) == thrd_success;
+}
+
+// Every block must have been freed (or be abandoned) before this is called
+void pool_destroy(pool_t* pool)
+{
+    pool_slab_t* slab = pool->slabs;
+    while (slab)
+    {
+        pool_slab_t* next = slab->next;
+        pool->backing->free(slab, pool->backing->ctx);
+        slab = next;
+    }
+
+    pool->slabs = NULL;
+    mtx_destroy(&pool->lock);
+}
+
+static void* pool__backing_alloc(pool_t* pool, size_t size)
+{
+    mtx_lock(&pool->lock);
+    void* ptr = pool->backing->malloc((ptrdiff_t) size, pool->backing->ctx);
+    mtx_unlock(&pool->lock);
+
+    return ptr;
+}
+
+static void pool__track_live(pool_t* pool, size_t size)
+{
+    size_t live = atomic_fetch_add_explicit(
+                      &pool->bytes_live, size, memory_order_relaxed)
+                  + size;
+
+    size_t high = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    while (live > high
+           && !atomic_compare_exchange_weak_explicit(&pool->high_water,
+                                                     &high,
+                                                     live,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+    {
+    }
+}
+
+static void pool__track_alloc(pool_t* pool, const pool_header_t* header)
+{
+    atomic_fetch_add_explicit(
+        &pool->allocs[header->class_index], 1, memory_order_relaxed);
+
+    pool__track_live(pool, header->size);
+}
+
+// Move everything other threads gave back into the local free lists
+static void pool__drain_returned(pool_thread_cache_t* cache)
+{
+    pool_block_t* block = atomic_exchange_explicit(
+        &cache->returned, NULL, memory_order_acquire);
+
+    while (block)
+    {
+        pool_block_t* next = block->next;
+        uint32_t      c    = ((pool_header_t*) (void*) block - 1)->class_index;
+
+        block->next         = cache->free_list[c];
+        cache->free_list[c] = block;
+
+        block = next;
+    }
+}
+
+static bool pool__refill(pool_t* pool, pool_thread_cache_t* cache, uint32_t c)
+{
+    pool_slab_t* slab = pool__backing_alloc(pool, POOL_SLAB_SIZE);
+    if (!slab)
+    {
+        return false;
+    }
+
+    mtx_lock(&pool->lock);
+    slab->next  = pool->slabs;
+    pool->slabs = slab;
+    mtx_unlock(&pool->lock);
+
+    cache->bump[c]     = (char*) (slab + 1);
+    cache->bump_end[c] = (char*) slab + POOL_SLAB_SIZE;
+
+    return true;
+}
+
+void* pool_alloc(pool_t* pool, size_t size)
+{
+    uint32_t class_index = pool__class_for(size);
+    uint32_t thread      = pool__current_thread();
+
+    if (class_index == POOL_LARGE_CLASS || thread >= POOL_MAX_THREADS)
+    {
+        pool_header_t* header
+            = pool__backing_alloc(pool, sizeof(pool_header_t) + size);
+        if (!header)
+        {
+            return NULL;
+        }
+
+        header->class_index = POOL_LARGE_CLASS;
+        header->owner       = UINT32_MAX;
+        header->size        = size;
+
+        pool__track_alloc(pool, header);
+        return header + 1;
+    }
+
+    pool_thread_cache_t* cache      = &pool->caches[thread];
+    size_t               class_size = pool__class_size(class_index);
+    size_t               block_size = sizeof(pool_header_t) + class_size;
+
+    if (!cache->free_list[class_index])
+    {
+        pool__drain_returned(cache);
+    }
+
+    pool_header_t* header = NULL;
+    if (cache->free_list[class_index])
+    {
+        pool_block_t* block           = cache->free_list[class_index];
+        cache->free_list[class_index] = block->next;
+
+        header = (pool_header_t*) (void*) block - 1;
+    }
+    else
+    {
+        if ((size_t) (cache->bump_end[class_index] - cache->bump[class_index])
+                < block_size
+            && !pool__refill(pool, cache, class_index))
+        {
+            return NULL;
+        }
+
+        header = (pool_header_t*) (void*) cache->bump[class_index];
+        cache->bump[class_index] += block_size;
+    }
+
+    header->class_index = class_index;
+    header->owner       = thread;
+    header->size        = class_size;
+
+    pool__track_alloc(pool, header);
+    return header + 1;
+}
+
+void pool_free(pool_t* pool, void* ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    pool_header_t* header = (pool_header_t*) ptr - 1;
+    atomic_fetch_sub_explicit(
+        &pool->bytes_live, header->size, memory_order_relaxed);
+
+    if (header->class_index == POOL_LARGE_CLASS)
+    {
+        mtx_lock(&pool->lock);
+        pool->backing->free(header, pool->backing->ctx);
+        mtx_unlock(&pool->lock);
+        return;
+    }
+
+    uint32_t             c     = header->class_index;
+    pool_thread_cache_t* cache = &pool->caches[header->owner];
+    pool_block_t*        block = ptr;
+
+    if (header->owner == pool__current_thread())
+    {
+        block->next         = cache->free_list[c];
+        cache->free_list[c] = block;
+        return;
+    }
+
+    // cross-thread free, push onto the owner's return queue. The owner only
+    // ever takes the whole list with an exchange, so there is no ABA here
+    block->next = atomic_load_explicit(&cache->returned, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&cache->returned,
+                                                  &block->next,
+                                                  block,
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+    {
+    }
+}
+
+// Blocks stay put while the new size still fits their class, large blocks
+// are resized through the backing allocator so it can extend them in place
+void* pool_realloc(pool_t* pool, void* ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr)
+    {
+        return pool_alloc(pool, new_size);
+    }
+
+    pool_header_t* header = (pool_header_t*) ptr - 1;
+    if (header->class_index != POOL_LARGE_CLASS)
+    {
+        if (new_size <= header->size)
+        {
+            return ptr;
+        }
+
+        void* new_ptr = pool_alloc(pool, new_size);
+        if (new_ptr)
+        {
+            memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+            pool_free(pool, ptr);
+        }
+
+        return new_ptr;
+    }
+
+    size_t old_block = sizeof(pool_header_t) + header->size;
+
+    mtx_lock(&pool->lock);
+    pool_header_t* new_header = allocator_realloc(
+        pool->backing, header, old_block, sizeof(pool_header_t) + new_size);
+    mtx_unlock(&pool->lock);
+
+    if (!new_header)
+    {
+        return NULL;
+    }
+
+    // the same block, only its size changes in the stats
+    atomic_fetch_sub_explicit(
+        &pool->bytes_live, new_header->size, memory_order_relaxed);
+    new_header->size = new_size;
+    pool__track_live(pool, new_size);
+
+    return new_header + 1;
+}
+
+pool_stats_t pool_get_stats(pool_t* pool)
+{
+    pool_stats_t stats = {
+        .bytes_live
+        = atomic_load_explicit(&pool->bytes_live, memory_order_relaxed),
+        .high_water
+        = atomic_load_explicit(&pool->high_water, memory_order_relaxed),
+    };
+
+    for (uint32_t i = 0; i <= POOL_CLASS_COUNT; i++)
+    {
+        stats.allocs[i]
+            = atomic_load_explicit(&pool->allocs[i], memory_order_relaxed);
+    }
+
+    return stats;
+}
+
+void pool_print_stats(pool_t* pool)
+{
+    pool_stats_t stats = pool_get_stats(pool);
+
+    log_info(LOG_MEMORY,
+             "pool: %zu bytes live, high water %zu bytes\n",
+             stats.bytes_live,
+             stats.high_water);
+
+    for (uint32_t i = 0; i < POOL_CLASS_COUNT; i++)
+    {
+        log_debug(LOG_MEMORY,
+                  "  class %5zu: %zu allocs\n",
+                  pool__class_size(i),
+                  stats.allocs[i]);
+    }
+    log_debug(LOG_MEMORY,
+              "  large      : %zu allocs\n",
+              stats.allocs[POOL_LARGE_CLASS]);
+}
+
+static void* pool__malloc(ptrdiff_t size, void* ctx)
+{
+    if (size < 0)
+    {
+        return NULL;
+    }
+
+    return pool_alloc((pool_t*) ctx, (size_t) size);
+}
+
+static void pool__free(void* ptr, void* ctx)
+{
+    pool_free((pool_t*) ctx, ptr);
+}
+
+static void* pool__realloc(void*     ptr,
+                           ptrdiff_t old_size,
+                           ptrdiff_t new_size,
+                           void*     ctx)
+{
+    if (old_size < 0 || new_size < 0)
+    {
+        return NULL;
+    }
+
+    return pool_realloc(
+        (pool_t*) ctx, ptr, (size_t) old_size, (size_t) new_size);
+}
+
+// The returned allocator points at `pool`, it must not outlive it
+allocator pool_allocator(pool_t* pool)
+{
+    return (allocator) {
+        .malloc  = pool__malloc,
+        .free    = pool__free,
+        .realloc = pool__realloc,
+        .ctx     = pool,
+    };
+}
+
+#endif  // POOL_H
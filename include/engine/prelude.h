@@ -7,13 +7,26 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef struct
 {
     void* (*malloc)(ptrdiff_t, void* ctx);
     void (*free)(void*, void* ctx);
+    // Resize a block, extending it in place when the allocator can. A NULL
+    // ptr behaves like malloc, on failure NULL is returned and ptr stays valid.
+    // Optional, allocator_realloc falls back to malloc + memcpy + free.
+    void* (*realloc)(void*, ptrdiff_t old_size, ptrdiff_t new_size, void* ctx);
     void* ctx;
 } allocator;
 
@@ -28,26 +41,41 @@ typedef struct
     size_t      len;
 } string_t;
 
-typedef struct string_array_t
-{
-    size_t   len;
-    size_t   cap;
-    string_t data[];
-} string_array_t;
-
-
 #define MAKE_STR(literal) { .chars = (literal), .len = sizeof(literal) - 1 }
 
 
+// Word-at-a-time strlen. Bytes are checked one by one up to an 8 byte
+// boundary, after that a whole word is tested per step with the
+// (w - 0x01..) & ~w & 0x80.. zero-byte trick. Aligned loads never cross a
+// page, so reading the tail of the last word is safe, but ASan cannot tell.
+typedef uint64_t __attribute__((__may_alias__)) prelude__word_t;
+
+__attribute__((no_sanitize_address))
 size_t find_length_of_c_string(const char str[])
 {
-    size_t len = 0;
-    while (str[len] != '\0')
+    const char* cursor = str;
+    while ((uintptr_t) cursor % sizeof(prelude__word_t) != 0)
+    {
+        if (*cursor == '\0')
+        {
+            return (size_t) (cursor - str);
+        }
+        cursor++;
+    }
+
+    const prelude__word_t* word = (const prelude__word_t*) (const void*) cursor;
+    while (!((*word - 0x0101010101010101ull) & ~*word & 0x8080808080808080ull))
+    {
+        word++;
+    }
+
+    cursor = (const char*) word;
+    while (*cursor != '\0')
     {
-        len++;
+        cursor++;
     }
 
-    return len;
+    return (size_t) (cursor - str);
 }
 
 string_t make_from_c_string(const char* str)
@@ -62,80 +90,212 @@ bool string_equal(string_t lhs, string_t rhs)
         return false;
     }
 
-    for (size_t i = 0; i < lhs.len; i++)
-    {
-        if (lhs.chars[i] != rhs.chars[i])
-        {
-            return false;
-        }
-    }
-
-    return true;
+    return memcmp(lhs.chars, rhs.chars, lhs.len) == 0;
 }
 
-string_array_t* make_string_array(allocator* alloc, size_t cap)
+// 64-bit FNV-1a, `seed` lets callers chain several buffers into one hash
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed)
 {
-    size_t size = sizeof(string_array_t) + cap * sizeof(string_t);
+    const unsigned char* bytes = data;
 
-    string_array_t* arr = alloc->malloc(size, alloc->ctx);
-    if (!arr)
+    uint64_t hash = seed;
+    for (size_t i = 0; i < len; i++)
     {
-        return NULL;
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
     }
 
-    arr->len = 0;
-    arr->cap = cap;
+    return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ull
 
-    return arr;
+uint64_t string_hash(string_t str)
+{
+    return hash_bytes(str.chars, str.len, HASH_SEED);
 }
 
-bool string_array_push(allocator* alloc, string_array_t* arr, string_t str)
+void* allocator_realloc(allocator* alloc,
+                        void*      ptr,
+                        size_t     old_size,
+                        size_t     new_size)
 {
-    if (!arr)
+    if (alloc->realloc)
     {
-        return false;
+        return alloc->realloc(
+            ptr, (ptrdiff_t) old_size, (ptrdiff_t) new_size, alloc->ctx);
     }
 
-    // Check if we need to grow the array
-    if (arr->len >= arr->cap)
+    void* new_ptr = alloc->malloc((ptrdiff_t) new_size, alloc->ctx);
+    if (!new_ptr)
     {
-        size_t new_cap  = arr->cap == 0 ? 8 : arr->cap * 2;
-        size_t new_size = sizeof(string_array_t) + new_cap * sizeof(string_t);
-        string_array_t* new_arr = alloc->malloc(new_size, alloc->ctx);
-        if (!new_arr)
-        {
-            return false;
-        }
-
-        new_arr->len = arr->len;
-        new_arr->cap = new_cap;
-
-        // copy existing data
-        for (size_t i = 0; i < arr->len; i++)
-        {
-            new_arr->data[i] = arr->data[i];
-        }
+        return NULL;
+    }
 
-        // Free old array
-        alloc->free(arr, alloc->ctx);
-        arr = new_arr;
+    if (ptr)
+    {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        alloc->free(ptr, alloc->ctx);
     }
 
-    // Add the new string
-    arr->data[arr->len++] = str;
-    return true;
+    return new_ptr;
 }
 
-void string_array_free(allocator* alloc, string_array_t* arr)
+// Grow a header-prefixed array block to hold at least `min_cap` elements.
+// Capacity grows geometrically and the block is resized through
+// allocator_realloc, so it is extended in place whenever the allocator can.
+// Returns the (possibly moved) block, or NULL with the old block untouched.
+void* array__grow(allocator* alloc,
+                  void*      block,
+                  size_t     header_size,
+                  size_t     elem_size,
+                  size_t     cap,
+                  size_t     min_cap,
+                  size_t*    new_cap)
 {
-    if (!arr)
+    size_t grown = cap < 4 ? 8 : cap * 2;
+    if (grown < min_cap)
+    {
+        grown = min_cap;
+    }
+
+    size_t old_size  = block ? header_size + cap * elem_size : 0;
+    void*  new_block = allocator_realloc(
+        alloc, block, old_size, header_size + grown * elem_size);
+    if (new_block)
     {
-        return;
+        *new_cap = grown;
     }
 
-    alloc->free(arr, alloc->ctx);
+    return new_block;
 }
 
+// Typed growable array stored as one block: `len`, `cap`, then the elements.
+// Growing may move the block, so every operation that can grow takes the
+// array by pointer-to-pointer and updates the caller's handle.
+//
+//   ARRAY_DEFINE(int_array_t, int_array, int)
+//
+// defines int_array_t plus make_int_array, int_array_reserve, int_array_push,
+// int_array_pop, int_array_insert, int_array_swap_remove and int_array_free.
+#define ARRAY_DEFINE(type, prefix, elem_t)                                     \
+    typedef struct type                                                        \
+    {                                                                          \
+        size_t len;                                                            \
+        size_t cap;                                                            \
+        elem_t data[];                                                         \
+    } type;                                                                    \
+                                                                               \
+    static inline type* make_##prefix(allocator* alloc, size_t cap)            \
+    {                                                                          \
+        type* arr = alloc->malloc(                                             \
+            (ptrdiff_t) (sizeof(type) + cap * sizeof(elem_t)), alloc->ctx);    \
+        if (!arr)                                                              \
+        {                                                                      \
+            return NULL;                                                       \
+        }                                                                      \
+                                                                               \
+        arr->len = 0;                                                          \
+        arr->cap = cap;                                                        \
+        return arr;                                                            \
+    }                                                                          \
+                                                                               \
+    static inline bool prefix##_reserve(                                       \
+        allocator* alloc, type** arr, size_t min_cap)                          \
+    {                                                                          \
+        size_t cap = *arr ? (*arr)->cap : 0;                                   \
+        if (cap >= min_cap)                                                    \
+        {                                                                      \
+            return true;                                                       \
+        }                                                                      \
+                                                                               \
+        size_t new_cap = 0;                                                    \
+        type*  grown   = array__grow(                                          \
+            alloc, *arr, sizeof(type), sizeof(elem_t), cap, min_cap,           \
+            &new_cap);                                                         \
+        if (!grown)                                                            \
+        {                                                                      \
+            return false;                                                      \
+        }                                                                      \
+                                                                               \
+        if (!*arr)                                                             \
+        {                                                                      \
+            grown->len = 0;                                                    \
+        }                                                                      \
+        grown->cap = new_cap;                                                  \
+        *arr       = grown;                                                    \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline bool prefix##_push(                                          \
+        allocator* alloc, type** arr, elem_t value)                            \
+    {                                                                          \
+        size_t len = *arr ? (*arr)->len : 0;                                   \
+        if (!prefix##_reserve(alloc, arr, len + 1))                            \
+        {                                                                      \
+            return false;                                                      \
+        }                                                                      \
+                                                                               \
+        (*arr)->data[(*arr)->len++] = value;                                   \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline bool prefix##_pop(type* arr, elem_t* out)                    \
+    {                                                                          \
+        if (!arr || arr->len == 0)                                             \
+        {                                                                      \
+            return false;                                                      \
+        }                                                                      \
+                                                                               \
+        arr->len--;                                                            \
+        if (out)                                                               \
+        {                                                                      \
+            *out = arr->data[arr->len];                                        \
+        }                                                                      \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline bool prefix##_insert(                                        \
+        allocator* alloc, type** arr, size_t index, elem_t value)              \
+    {                                                                          \
+        size_t len = *arr ? (*arr)->len : 0;                                   \
+        if (index > len || !prefix##_reserve(alloc, arr, len + 1))             \
+        {                                                                      \
+            return false;                                                      \
+        }                                                                      \
+                                                                               \
+        memmove(&(*arr)->data[index + 1],                                      \
+                &(*arr)->data[index],                                          \
+                (len - index) * sizeof(elem_t));                               \
+        (*arr)->data[index] = value;                                           \
+        (*arr)->len++;                                                         \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    /* O(1) removal, the last element takes the removed slot */                \
+    static inline bool prefix##_swap_remove(type* arr, size_t index)           \
+    {                                                                          \
+        if (!arr || index >= arr->len)                                         \
+        {                                                                      \
+            return false;                                                      \
+        }                                                                      \
+                                                                               \
+        arr->data[index] = arr->data[--arr->len];                              \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline void prefix##_free(allocator* alloc, type* arr)              \
+    {                                                                          \
+        if (arr)                                                               \
+        {                                                                      \
+            alloc->free(arr, alloc->ctx);                                      \
+        }                                                                      \
+    }
+
+ARRAY_DEFINE(string_array_t, string_array, string_t)
+ARRAY_DEFINE(list_t, list, void*)
+
+
 // Convert string_array_t to const char** for C APIs like Vulkan
 // Returns a contiguous array of char pointers for cache efficiency
 const char** string_array_to_cstrings(const string_array_t* arr)
@@ -168,30 +328,17 @@ const char* string_to_cstring(const string_t* str)
     return str ? str->chars : NULL;
 }
 
-typedef struct
+// Monotonic clock for timing and frame pacing
+uint64_t time_now_ns(void)
 {
-    size_t len;
-    size_t cap;
-    void*  data[];
-} list_t;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
 
-list_t* make_list(allocator* alloc, size_t len)
+double time_ns_to_ms(uint64_t ns)
 {
-    // allocate twice the capacity, so if it grows
-    // we dont have to re-allocate right away
-    size_t buffer = 2;
-
-    size_t  size     = sizeof(list_t) + len * sizeof(void*) * buffer;
-    list_t* new_list = alloc->malloc(size, alloc->ctx);
-    if (!new_list)
-    {
-        return nullptr;
-    }
-
-    new_list->len = 0;
-    new_list->cap = len * 2;
-
-    return new_list;
+    return (double) ns / 1e6;
 }
 
 int clamp(int d, int min, int max)
@@ -201,7 +348,7 @@ int clamp(int d, int min, int max)
 }
 
 // Read file data to string_t
-static string_t* read_file(allocator* alloc, const char* path)
+string_t* read_file(allocator* alloc, const char* path)
 {
     FILE *file = fopen(path, "rb");
     if (!file)
@@ -250,7 +397,7 @@ static string_t* read_file(allocator* alloc, const char* path)
 }
 
 // write to file
-static bool write_file(const char* path, const char* data, size_t size)
+bool write_file(const char* path, const char* data, size_t size)
 {
     FILE* file = fopen(path, "wb");
     if (!file)
@@ -264,16 +411,112 @@ static bool write_file(const char* path, const char* data, size_t size)
     return bytes_written == size;
 }
 
+// Write to `<path>.<pid>.tmp` and rename it over `path`, so readers and a
+// crash mid-write only ever see the old or the new contents
+bool write_file_atomic(const char* path, const char* data, size_t size)
+{
+    char tmp_path[PATH_MAX];
+    int  written = snprintf(
+        tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+    if (written < 0 || (size_t) written >= sizeof(tmp_path))
+    {
+        return false;
+    }
+
+    if (!write_file(tmp_path, data, size) || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
 // Helper to check if a file exists and is not empty
-static bool file_exists(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (!file) {
+bool file_exists(const char* path)
+{
+    struct stat info;
+    return stat(path, &info) == 0 && info.st_size > 0;
+}
+
+typedef enum
+{
+    FILE_ACCESS_DEFAULT,
+    FILE_ACCESS_SEQUENTIAL,  // read once front to back (shader source, SPIR-V)
+    FILE_ACCESS_WILL_NEED    // whole file needed soon, start paging it in now
+} file_access_t;
+
+// Read-only view of a file mapped straight from the page cache, no copy and
+// no heap allocation. `data` is not NUL terminated.
+typedef struct
+{
+    const char* data;
+    size_t      len;
+} file_view_t;
+
+bool file_view_open(file_view_t* view, const char* path, file_access_t access)
+{
+    *view = (file_view_t) { 0 };
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
         return false;
     }
-    fseek(file, 0, SEEK_END);
-    const bool is_not_empty = ftell(file) > 0;
-    fclose(file);
-    return is_not_empty;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // mmap cannot map zero bytes, an empty file is an empty view
+    if (info.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void* data
+        = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping keeps its own reference to the file
+
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    switch (access)
+    {
+        case FILE_ACCESS_SEQUENTIAL:
+            posix_madvise(data, (size_t) info.st_size, POSIX_MADV_SEQUENTIAL);
+            break;
+        case FILE_ACCESS_WILL_NEED:
+            posix_madvise(data, (size_t) info.st_size, POSIX_MADV_WILLNEED);
+            break;
+        case FILE_ACCESS_DEFAULT:
+            break;
+    }
+
+    view->data = data;
+    view->len  = (size_t) info.st_size;
+    return true;
+}
+
+void file_view_release(file_view_t* view)
+{
+    if (view->data)
+    {
+        munmap((void*) (uintptr_t) view->data, view->len);
+    }
+
+    *view = (file_view_t) { 0 };
+}
+
+string_t file_view_string(file_view_t view)
+{
+    return (string_t) { .chars = view.data, .len = view.len };
 }
 
 #endif  // PRELUDE_H
@@ -0,0 +1,510 @@
+//
+// Cross-queue submission and GPU completion tracking.
+//
+// Every queue kind in device_info_t owns a timeline semaphore. A submit
+// signals the next value of its queue's timeline and returns it as a ticket.
+// Work on another queue depends on it by waiting for that value, so an
+// upload on the transfer queue or a dispatch on the compute queue overlaps
+// rendering until the exact point the graphics work needs its result.
+//
+// The CPU uses the same tickets in place of per-submit fences. The last
+// completed value of each timeline is cached in device_queue_t, a ticket at
+// or below it is known complete without calling into the driver, and one
+// counter read answers for every older ticket at once. Anything the GPU may
+// still be using, command buffers, staging memory, objects awaiting
+// destruction, is released once the ticket of its last use completed;
+// queue_deletions_t does this for deferred destruction.
+//
+// Resources moving between queues of different families also need a queue
+// family ownership transfer: a release barrier recorded on the source queue
+// and a matching acquire barrier on the destination queue, ordered by the
+// timeline wait. Between queues of one family the release is skipped and the
+// acquire is an ordinary barrier.
+//
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "device.h"
+
+// Per submit limits, for each of timeline waits, binary waits and signals
+#ifndef QUEUE_MAX_WAITS
+#define QUEUE_MAX_WAITS 8
+#endif
+
+#ifndef QUEUE_MAX_COMMAND_BUFFERS
+#define QUEUE_MAX_COMMAND_BUFFERS 16
+#endif
+
+// A point on one queue's timeline. Value 0 is complete from the start, the
+// zero ticket stands for "nothing submitted".
+typedef struct
+{
+    queue_kind_t queue;
+    uint64_t     value;
+} queue_ticket_t;
+
+// Work up to `ticket`, needed before `stage` runs
+typedef struct
+{
+    queue_ticket_t        ticket;
+    VkPipelineStageFlags2 stage;
+} queue_wait_t;
+
+typedef struct
+{
+    const VkCommandBuffer* command_buffers;
+    uint32_t               command_buffer_count;
+
+    const queue_wait_t* waits;
+    uint32_t            wait_count;
+
+    // binary semaphores, e.g. swapchain acquire and present
+    const VkSemaphoreSubmitInfo* extra_waits;
+    uint32_t                     extra_wait_count;
+    const VkSemaphoreSubmitInfo* extra_signals;
+    uint32_t                     extra_signal_count;
+
+    VkFence fence;  // optional
+} queue_submit_t;
+
+// Submits to `kind` and returns the ticket that completes with the work, one
+// with value 0 on failure. Queues are externally synchronized: submit to one
+// kind (and the kinds sharing its VkQueue) from one thread at a time.
+queue_ticket_t queue_submit(device_info_t*        device_info,
+                            queue_kind_t          kind,
+                            const queue_submit_t* submit)
+{
+    device_queue_t* queue  = &device_info->queues[kind];
+    queue_ticket_t  ticket = { .queue = kind };
+
+    uint32_t wait_count = submit->wait_count + submit->extra_wait_count;
+    if (submit->wait_count > QUEUE_MAX_WAITS
+        || submit->extra_wait_count > QUEUE_MAX_WAITS
+        || submit->extra_signal_count > QUEUE_MAX_WAITS
+        || submit->command_buffer_count > QUEUE_MAX_COMMAND_BUFFERS)
+    {
+        log_error(LOG_FRAME, "submit exceeds the QUEUE_MAX_* limits\n");
+        return ticket;
+    }
+
+    VkSemaphoreSubmitInfo waits[2 * QUEUE_MAX_WAITS];
+    for (uint32_t i = 0; i < submit->wait_count; i++)
+    {
+        const queue_wait_t* wait = &submit->waits[i];
+
+        waits[i] = (VkSemaphoreSubmitInfo) {
+            .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = device_info->queues[wait->ticket.queue].timeline,
+            .value     = wait->ticket.value,
+            .stageMask = wait->stage,
+        };
+    }
+
+    for (uint32_t i = 0; i < submit->extra_wait_count; i++)
+    {
+        waits[submit->wait_count + i] = submit->extra_waits[i];
+    }
+
+    uint64_t value = queue->submitted + 1;
+
+    VkSemaphoreSubmitInfo signals[QUEUE_MAX_WAITS + 1];
+    signals[0] = (VkSemaphoreSubmitInfo) {
+        .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = queue->timeline,
+        .value     = value,
+        .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+    };
+
+    for (uint32_t i = 0; i < submit->extra_signal_count; i++)
+    {
+        signals[1 + i] = submit->extra_signals[i];
+    }
+
+    VkCommandBufferSubmitInfo command_infos[QUEUE_MAX_COMMAND_BUFFERS];
+    for (uint32_t i = 0; i < submit->command_buffer_count; i++)
+    {
+        command_infos[i] = (VkCommandBufferSubmitInfo) {
+            .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = submit->command_buffers[i],
+        };
+    }
+
+    VkSubmitInfo2 submit_info = {
+        .sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .waitSemaphoreInfoCount   = wait_count,
+        .pWaitSemaphoreInfos      = waits,
+        .commandBufferInfoCount   = submit->command_buffer_count,
+        .pCommandBufferInfos      = command_infos,
+        .signalSemaphoreInfoCount = 1 + submit->extra_signal_count,
+        .pSignalSemaphoreInfos    = signals,
+    };
+
+    if (vkQueueSubmit2(queue->queue, 1, &submit_info, submit->fence)
+        != VK_SUCCESS)
+    {
+        return ticket;
+    }
+
+    queue->submitted = value;
+    ticket.value     = value;
+    return ticket;
+}
+
+// Ticket the next submit to `kind` will return, for resources used by work
+// that is being recorded now
+queue_ticket_t queue_next_ticket(const device_info_t* device_info,
+                                 queue_kind_t         kind)
+{
+    return (queue_ticket_t) {
+        .queue = kind,
+        .value = device_info->queues[kind].submitted + 1,
+    };
+}
+
+// Reads the timeline's counter, the most recent value the GPU completed
+uint64_t queue_completed(device_info_t* device_info, queue_kind_t kind)
+{
+    device_queue_t* queue = &device_info->queues[kind];
+
+    uint64_t value;
+    if (vkGetSemaphoreCounterValue(device_info->device, queue->timeline, &value)
+            == VK_SUCCESS
+        && value > queue->completed)
+    {
+        queue->completed = value;
+    }
+
+    return queue->completed;
+}
+
+// Never blocks, only reads the counter when the cached value is too old
+bool queue_ticket_done(device_info_t* device_info, queue_ticket_t ticket)
+{
+    return ticket.value <= device_info->queues[ticket.queue].completed
+           || ticket.value <= queue_completed(device_info, ticket.queue);
+}
+
+// Blocks for at most `timeout_ns` (UINT64_MAX for no limit), false if the
+// ticket has not completed by then or the device was lost
+bool queue_wait_ticket(device_info_t* device_info,
+                       queue_ticket_t ticket,
+                       uint64_t       timeout_ns)
+{
+    device_queue_t* queue = &device_info->queues[ticket.queue];
+    if (ticket.value <= queue->completed)
+    {
+        return true;
+    }
+
+    VkSemaphoreWaitInfo wait_info = {
+        .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores    = &queue->timeline,
+        .pValues        = &ticket.value,
+    };
+
+    if (vkWaitSemaphores(device_info->device, &wait_info, timeout_ns)
+        != VK_SUCCESS)
+    {
+        return false;
+    }
+
+    if (ticket.value > queue->completed)
+    {
+        queue->completed = ticket.value;
+    }
+
+    return true;
+}
+
+// Waits for everything submitted so far on every queue. Unlike
+// vkDeviceWaitIdle this does not cover presentation.
+bool queue_wait_all(device_info_t* device_info)
+{
+    for (uint32_t kind = 0; kind < QUEUE_KIND_COUNT; kind++)
+    {
+        queue_ticket_t last = {
+            .queue = kind,
+            .value = device_info->queues[kind].submitted,
+        };
+
+        if (!queue_wait_ticket(device_info, last, UINT64_MAX))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+typedef void (*queue_destroy_fn)(const device_info_t* device_info,
+                                 void*                object);
+
+typedef struct
+{
+    queue_ticket_t   ticket;
+    queue_destroy_fn destroy;
+    void*            object;
+} queue_deletion_t;
+
+// Objects destroyed once the GPU is done with them, in submission order
+typedef struct
+{
+    uint32_t          count;
+    uint32_t          capacity;
+    queue_deletion_t* items;
+} queue_deletions_t;
+
+// Calls `destroy(device_info, object)` once `ticket` completed. If the list
+// cannot grow it waits for the ticket and destroys the object right away.
+void queue_defer_destroy(allocator*         alloc,
+                         device_info_t*     device_info,
+                         queue_deletions_t* deletions,
+                         queue_ticket_t     ticket,
+                         queue_destroy_fn   destroy,
+                         void*              object)
+{
+    if (deletions->count == deletions->capacity)
+    {
+        uint32_t capacity = deletions->capacity ? 2 * deletions->capacity : 16;
+        queue_deletion_t* items
+            = allocator_realloc(alloc,
+                                deletions->items,
+                                deletions->capacity * sizeof(queue_deletion_t),
+                                capacity * sizeof(queue_deletion_t));
+        if (!items)
+        {
+            queue_wait_ticket(device_info, ticket, UINT64_MAX);
+            destroy(device_info, object);
+            return;
+        }
+
+        deletions->items    = items;
+        deletions->capacity = capacity;
+    }
+
+    deletions->items[deletions->count++] = (queue_deletion_t) {
+        .ticket  = ticket,
+        .destroy = destroy,
+        .object  = object,
+    };
+}
+
+// Destroys every object whose ticket completed, never blocks
+void queue_collect(device_info_t* device_info, queue_deletions_t* deletions)
+{
+    // refresh each timeline once instead of once per entry
+    for (uint32_t kind = 0; kind < QUEUE_KIND_COUNT; kind++)
+    {
+        queue_completed(device_info, kind);
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < deletions->count; i++)
+    {
+        queue_deletion_t* item = &deletions->items[i];
+        if (item->ticket.value
+            <= device_info->queues[item->ticket.queue].completed)
+        {
+            item->destroy(device_info, item->object);
+        }
+        else
+        {
+            deletions->items[kept++] = *item;
+        }
+    }
+
+    deletions->count = kept;
+}
+
+// Destroys everything still pending, the caller has idled the queues
+void queue_deletions_destroy(allocator*           alloc,
+                             const device_info_t* device_info,
+                             queue_deletions_t*   deletions)
+{
+    for (uint32_t i = 0; i < deletions->count; i++)
+    {
+        deletions->items[i].destroy(device_info, deletions->items[i].object);
+    }
+
+    alloc->free(deletions->items, alloc->ctx);
+    *deletions = (queue_deletions_t) { 0 };
+}
+
+// Describes one resource moving from the queue family of `src` to `dst`.
+// The layouts are ignored for buffers; for images the transition is done by
+// the pair, both halves must use the same old and new layout.
+typedef struct
+{
+    queue_kind_t          src;
+    VkPipelineStageFlags2 src_stage;
+    VkAccessFlags2        src_access;
+
+    queue_kind_t          dst;
+    VkPipelineStageFlags2 dst_stage;
+    VkAccessFlags2        dst_access;
+
+    VkImageLayout old_layout;
+    VkImageLayout new_layout;
+} queue_transfer_t;
+
+static bool queue__same_family(const device_info_t*    device_info,
+                               const queue_transfer_t* transfer)
+{
+    return device_info->queues[transfer->src].family
+           == device_info->queues[transfer->dst].family;
+}
+
+static void queue__barrier(VkCommandBuffer               command_buffer,
+                           const VkBufferMemoryBarrier2* buffer_barrier,
+                           const VkImageMemoryBarrier2*  image_barrier)
+{
+    VkDependencyInfo dependency = {
+        .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .bufferMemoryBarrierCount = buffer_barrier ? 1 : 0,
+        .pBufferMemoryBarriers    = buffer_barrier,
+        .imageMemoryBarrierCount  = image_barrier ? 1 : 0,
+        .pImageMemoryBarriers     = image_barrier,
+    };
+
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+}
+
+// Builds the release (`acquire` false) or acquire half of a transfer. The
+// release only has a source scope and the acquire only a destination scope,
+// the timeline wait between the two queues orders them.
+static void queue__scopes(const device_info_t*    device_info,
+                          const queue_transfer_t* transfer,
+                          bool                    acquire,
+                          VkPipelineStageFlags2*  src_stage,
+                          VkAccessFlags2*         src_access,
+                          VkPipelineStageFlags2*  dst_stage,
+                          VkAccessFlags2*         dst_access,
+                          uint32_t*               src_family,
+                          uint32_t*               dst_family)
+{
+    bool same_family = queue__same_family(device_info, transfer);
+
+    *src_stage  = acquire ? VK_PIPELINE_STAGE_2_NONE : transfer->src_stage;
+    *src_access = acquire ? VK_ACCESS_2_NONE : transfer->src_access;
+    *dst_stage  = acquire ? transfer->dst_stage : VK_PIPELINE_STAGE_2_NONE;
+    *dst_access = acquire ? transfer->dst_access : VK_ACCESS_2_NONE;
+
+    // one family: a single full barrier on the destination queue
+    if (same_family)
+    {
+        *src_stage  = transfer->src_stage;
+        *src_access = transfer->src_access;
+    }
+
+    *src_family = same_family ? VK_QUEUE_FAMILY_IGNORED
+                              : device_info->queues[transfer->src].family;
+    *dst_family = same_family ? VK_QUEUE_FAMILY_IGNORED
+                              : device_info->queues[transfer->dst].family;
+}
+
+static void queue__buffer(VkCommandBuffer         command_buffer,
+                          const device_info_t*    device_info,
+                          const queue_transfer_t* transfer,
+                          bool                    acquire,
+                          VkBuffer                buffer)
+{
+    VkBufferMemoryBarrier2 barrier = {
+        .sType  = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+        .buffer = buffer,
+        .size   = VK_WHOLE_SIZE,
+    };
+
+    queue__scopes(device_info,
+                  transfer,
+                  acquire,
+                  &barrier.srcStageMask,
+                  &barrier.srcAccessMask,
+                  &barrier.dstStageMask,
+                  &barrier.dstAccessMask,
+                  &barrier.srcQueueFamilyIndex,
+                  &barrier.dstQueueFamilyIndex);
+
+    queue__barrier(command_buffer, &barrier, NULL);
+}
+
+static void queue__image(VkCommandBuffer         command_buffer,
+                         const device_info_t*    device_info,
+                         const queue_transfer_t* transfer,
+                         bool                    acquire,
+                         VkImage                 image,
+                         VkImageSubresourceRange range)
+{
+    VkImageMemoryBarrier2 barrier = {
+        .sType            = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .oldLayout        = transfer->old_layout,
+        .newLayout        = transfer->new_layout,
+        .image            = image,
+        .subresourceRange = range,
+    };
+
+    queue__scopes(device_info,
+                  transfer,
+                  acquire,
+                  &barrier.srcStageMask,
+                  &barrier.srcAccessMask,
+                  &barrier.dstStageMask,
+                  &barrier.dstAccessMask,
+                  &barrier.srcQueueFamilyIndex,
+                  &barrier.dstQueueFamilyIndex);
+
+    queue__barrier(command_buffer, NULL, &barrier);
+}
+
+// Recorded on the source queue after its last use of the buffer
+void queue_release_buffer(VkCommandBuffer         command_buffer,
+                          const device_info_t*    device_info,
+                          const queue_transfer_t* transfer,
+                          VkBuffer                buffer)
+{
+    if (!queue__same_family(device_info, transfer))
+    {
+        queue__buffer(command_buffer, device_info, transfer, false, buffer);
+    }
+}
+
+// Recorded on the destination queue before its first use of the buffer, in
+// a submit that waits for the timeline value of the release
+void queue_acquire_buffer(VkCommandBuffer         command_buffer,
+                          const device_info_t*    device_info,
+                          const queue_transfer_t* transfer,
+                          VkBuffer                buffer)
+{
+    queue__buffer(command_buffer, device_info, transfer, true, buffer);
+}
+
+void queue_release_image(VkCommandBuffer         command_buffer,
+                         const device_info_t*    device_info,
+                         const queue_transfer_t* transfer,
+                         VkImage                 image,
+                         VkImageSubresourceRange range)
+{
+    if (!queue__same_family(device_info, transfer))
+    {
+        queue__image(
+            command_buffer, device_info, transfer, false, image, range);
+    }
+}
+
+void queue_acquire_image(VkCommandBuffer         command_buffer,
+                         const device_info_t*    device_info,
+                         const queue_transfer_t* transfer,
+                         VkImage                 image,
+                         VkImageSubresourceRange range)
+{
+    queue__image(command_buffer, device_info, transfer, true, image, range);
+}
+
+#endif  // QUEUE_H
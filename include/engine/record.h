@@ -0,0 +1,333 @@
+//
+// Parallel command recording.
+//
+// Every frame slot owns one command pool per job worker (see jobs.h). A pool
+// is only touched by its own worker, so recording needs no locks. It is reset
+// in recorder_begin_frame once the slot's ticket completed, and the secondary
+// command buffers allocated from it are kept and reused the next time the
+// slot comes round rather than freed.
+//
+// recorder_record turns every chunk into a job that records one secondary
+// command buffer on whichever worker picks it up, then executes them in the
+// frame's primary buffer in chunk order. Secondaries can continue a render
+// pass or dynamic rendering through the inheritance info.
+//
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "arena.h"
+#include "device.h"
+#include "jobs.h"
+
+// secondaries recorded per frame. Any worker may end up recording all of
+// them, every pool can hold this many.
+#ifndef RECORD_MAX_BUFFERS
+#define RECORD_MAX_BUFFERS 256
+#endif
+
+// allocated at once when a pool runs out
+#ifndef RECORD_BUFFER_BATCH
+#define RECORD_BUFFER_BATCH 8
+#endif
+
+typedef void (*record_fn_t)(VkCommandBuffer command_buffer, void* data);
+
+typedef struct
+{
+    record_fn_t fn;
+    void*       data;
+} record_chunk_t;
+
+typedef struct
+{
+    VkCommandPool   pool;
+    uint32_t        used;  // this frame
+    uint32_t        allocated;
+    VkCommandBuffer buffers[RECORD_MAX_BUFFERS];
+} recorder_pool_t;
+
+typedef struct
+{
+    allocator* alloc;
+    VkDevice   device;  // for the jobs, the device_info is copied around
+    uint32_t   frame_count;
+    uint32_t   worker_count;
+    uint32_t   slot;      // frame slot being recorded
+    uint32_t   recorded;  // secondaries so far this frame
+
+    recorder_pool_t* pools;  // frame_count x worker_count
+} recorder_t;
+
+typedef struct
+{
+    recorder_t*                     recorder;
+    const VkCommandBufferBeginInfo* begin_info;
+    record_chunk_t                  chunk;
+    VkCommandBuffer*                out;
+    atomic_bool*                    failed;
+} recorder__job_t;
+
+// The slots' previous submissions must have completed
+void recorder_destroy(recorder_t* recorder)
+{
+    if (!recorder)
+    {
+        return;
+    }
+
+    // pools free their command buffers with them
+    uint32_t count = recorder->frame_count * recorder->worker_count;
+    for (uint32_t i = 0; i < count && recorder->pools; i++)
+    {
+        vkDestroyCommandPool(
+            recorder->device, recorder->pools[i].pool, nullptr);
+    }
+
+    allocator* alloc = recorder->alloc;
+    alloc->free(recorder->pools, alloc->ctx);
+    alloc->free(recorder, alloc->ctx);
+}
+
+// Records from the workers of `jobs`, which must outlive the recorder
+recorder_t* recorder_create(allocator*           alloc,
+                            const device_info_t* device_info,
+                            const job_system_t*  jobs,
+                            uint32_t             frame_count)
+{
+    recorder_t* recorder = alloc->malloc(sizeof(recorder_t), alloc->ctx);
+    if (!recorder)
+    {
+        return NULL;
+    }
+
+    *recorder = (recorder_t) {
+        .alloc        = alloc,
+        .device       = device_info->device,
+        .frame_count  = frame_count,
+        .worker_count = jobs_worker_count(jobs),
+    };
+
+    uint32_t count  = frame_count * recorder->worker_count;
+    recorder->pools = alloc->malloc(
+        (ptrdiff_t) (count * sizeof(recorder_pool_t)), alloc->ctx);
+    if (!recorder->pools)
+    {
+        alloc->free(recorder, alloc->ctx);
+        return NULL;
+    }
+
+    VkCommandPoolCreateInfo pool_info = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = device_info->queues[QUEUE_GRAPHICS].family,
+    };
+
+    // unused pools stay VK_NULL_HANDLE, destroying those is a no-op
+    memset(recorder->pools, 0, count * sizeof(recorder_pool_t));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (vkCreateCommandPool(recorder->device,
+                                &pool_info,
+                                nullptr,
+                                &recorder->pools[i].pool)
+            != VK_SUCCESS)
+        {
+            log_error(LOG_FRAME, "failed to create recording pool %u\n", i);
+            recorder_destroy(recorder);
+            return NULL;
+        }
+    }
+
+    return recorder;
+}
+
+// Call after frame_begin, which waited for the slot's ticket
+void recorder_begin_frame(recorder_t* recorder, uint32_t slot)
+{
+    recorder->slot     = slot;
+    recorder->recorded = 0;
+
+    recorder_pool_t* pools = &recorder->pools[slot * recorder->worker_count];
+    for (uint32_t i = 0; i < recorder->worker_count; i++)
+    {
+        if (pools[i].used > 0)
+        {
+            vkResetCommandPool(recorder->device, pools[i].pool, 0);
+            pools[i].used = 0;
+        }
+    }
+}
+
+// Next free secondary of the calling worker's pool, NULL when allocation
+// failed
+static VkCommandBuffer recorder__next_buffer(recorder_t* recorder)
+{
+    uint32_t         worker = jobs_worker_index();
+    recorder_pool_t* pool   = &recorder->pools[recorder->slot
+                                                 * recorder->worker_count
+                                             + worker];
+
+    if (pool->used == pool->allocated)
+    {
+        uint32_t batch = RECORD_MAX_BUFFERS - pool->allocated;
+        if (batch == 0)
+        {
+            return VK_NULL_HANDLE;
+        }
+        if (batch > RECORD_BUFFER_BATCH)
+        {
+            batch = RECORD_BUFFER_BATCH;
+        }
+
+        VkCommandBufferAllocateInfo buffer_info = {
+            .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool        = pool->pool,
+            .level              = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = batch,
+        };
+
+        if (vkAllocateCommandBuffers(recorder->device,
+                                     &buffer_info,
+                                     &pool->buffers[pool->allocated])
+            != VK_SUCCESS)
+        {
+            return VK_NULL_HANDLE;
+        }
+        pool->allocated += batch;
+    }
+
+    return pool->buffers[pool->used++];
+}
+
+static void recorder__job(void* data)
+{
+    recorder__job_t* job = data;
+
+    VkCommandBuffer command_buffer = recorder__next_buffer(job->recorder);
+    if (!command_buffer
+        || vkBeginCommandBuffer(command_buffer, job->begin_info) != VK_SUCCESS)
+    {
+        atomic_store(job->failed, true);
+        return;
+    }
+
+    job->chunk.fn(command_buffer, job->chunk.data);
+
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+    {
+        atomic_store(job->failed, true);
+        return;
+    }
+
+    *job->out = command_buffer;
+}
+
+// Records `chunks` in parallel and executes them in order in `primary`.
+// `inheritance` may be NULL outside a render pass, otherwise its render pass
+// or chained VkCommandBufferInheritanceRenderingInfo is continued and the
+// primary must have begun it with secondary contents. Job bookkeeping comes
+// from `scratch`. Returns false without executing anything when any chunk
+// failed to record.
+bool recorder_record(recorder_t*                           recorder,
+                     job_system_t*                         jobs,
+                     arena_t*                              scratch,
+                     VkCommandBuffer                       primary,
+                     const VkCommandBufferInheritanceInfo* inheritance,
+                     const record_chunk_t*                 chunks,
+                     uint32_t                              chunk_count)
+{
+    if (chunk_count == 0)
+    {
+        return true;
+    }
+
+    if (chunk_count > RECORD_MAX_BUFFERS - recorder->recorded)
+    {
+        log_error(LOG_FRAME,
+                  "more than %u secondary command buffers in a frame\n",
+                  RECORD_MAX_BUFFERS);
+        return false;
+    }
+    recorder->recorded += chunk_count;
+
+    VkCommandBufferInheritanceInfo outside = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+    };
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags            = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        .pInheritanceInfo = inheritance ? inheritance : &outside,
+    };
+    if (inheritance
+        && (inheritance->renderPass != VK_NULL_HANDLE || inheritance->pNext))
+    {
+        begin_info.flags |= VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    }
+
+    arena_mark_t     mark = arena_save(scratch);
+    recorder__job_t* ctx  = arena_push(scratch,
+                                      chunk_count * sizeof(recorder__job_t),
+                                      _Alignof(recorder__job_t));
+    job_decl_t*      decls = arena_push(
+        scratch, chunk_count * sizeof(job_decl_t), _Alignof(job_decl_t));
+    VkCommandBuffer* secondaries
+        = arena_push(scratch,
+                     chunk_count * sizeof(VkCommandBuffer),
+                     _Alignof(VkCommandBuffer));
+    if (!ctx || !decls || !secondaries)
+    {
+        log_error(
+            LOG_FRAME, "out of scratch recording %u chunks\n", chunk_count);
+        arena_restore(scratch, mark);
+        return false;
+    }
+
+    atomic_bool failed;
+    atomic_init(&failed, false);
+
+    for (uint32_t i = 0; i < chunk_count; i++)
+    {
+        ctx[i] = (recorder__job_t) {
+            .recorder   = recorder,
+            .begin_info = &begin_info,
+            .chunk      = chunks[i],
+            .out        = &secondaries[i],
+            .failed     = &failed,
+        };
+        decls[i] = (job_decl_t) { recorder__job, &ctx[i] };
+    }
+
+    job_counter_t counter;
+    job_counter_init(&counter);
+    jobs_run(jobs, decls, chunk_count, &counter);
+    jobs_wait(jobs, &counter);
+
+    bool ok = !atomic_load(&failed);
+    if (ok)
+    {
+        vkCmdExecuteCommands(primary, chunk_count, secondaries);
+    }
+    else
+    {
+        log_error(LOG_FRAME,
+                  "failed to record %u secondary command buffers\n",
+                  chunk_count);
+    }
+
+    arena_restore(scratch, mark);
+    return ok;
+}
+
+#endif  // RECORD_H
@@ -0,0 +1,522 @@
+//
+// Shader hot reload.
+//
+// A background thread watches the shader directory with inotify. A saved
+// shader source is recompiled on that thread with a shaderc compiler it keeps
+// for its whole life, a saved header recompiles every shader that includes
+// it. Finished SPIR-V is pushed onto a lock-free list and handed to the
+// reload callback from shader_watcher_poll, which the engine calls once per
+// frame. New shaders therefore only become visible at a frame boundary and
+// the frame loop never waits on a compile.
+//
+
+#ifndef SHADER_WATCHER_H
+#define SHADER_WATCHER_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "intern.h"
+#include "shaders.h"
+
+// Editors often save in several writes, wait for the directory to go quiet
+// this long before compiling
+#ifndef SHADER_WATCHER_DEBOUNCE_MS
+#define SHADER_WATCHER_DEBOUNCE_MS 50
+#endif
+
+#ifndef SHADER_WATCHER_NAME_BYTES
+#define SHADER_WATCHER_NAME_BYTES (16 * 1024)
+#endif
+
+// A recompiled shader, only valid during the reload callback
+typedef struct shader_reload_t
+{
+    const char* glsl_path;
+    const char* spirv_path;
+    shader_type type;
+    string_t*   spirv;
+
+    struct shader_reload_t* next;
+} shader_reload_t;
+
+typedef void (*shader_reload_fn)(const shader_reload_t* reload,
+                                 void*                  user_data);
+
+typedef struct
+{
+    shader_job_t job;
+    bool         dirty;  // source saved since the last compile
+} shader_watch_entry_t;
+
+ARRAY_DEFINE(shader_watch_array_t, shader_watch_array, shader_watch_entry_t)
+
+typedef struct
+{
+    allocator* alloc;  // also used by the watcher thread, must be thread safe
+    char       dir[256];
+
+    int    inotify_fd;
+    int    wake_fd;  // eventfd, signalled once to stop the thread
+    thrd_t thread;
+
+    // only touched by the watcher thread once it runs
+    shader_compiler_t      compiler;
+    shader_cache_t         cache;
+    bool                   has_cache;
+    shader_include_cache_t includes;
+    string_table_t         paths;  // stable storage for the job paths
+    shader_watch_array_t*  shaders;
+    bool                   headers_changed;
+
+    // finished reloads, newest first, taken in one exchange by poll
+    _Atomic(shader_reload_t*) published;
+
+    // called from shader_watcher_poll, may be changed between polls
+    shader_reload_fn on_reload;
+    void*            user_data;
+} shader_watcher_t;
+
+static bool shader_watcher__has_extension(const char* name,
+                                          const char* extension)
+{
+    const char* dot = strrchr(name, '.');
+    return dot && strcmp(dot, extension) == 0;
+}
+
+static bool shader_watcher__type_for(const char* name, shader_type* type)
+{
+    if (shader_watcher__has_extension(name, ".vert"))
+    {
+        *type = VERTEX_SHADER;
+    }
+    else if (shader_watcher__has_extension(name, ".frag"))
+    {
+        *type = FRAGMENT_SHADER;
+    }
+    else if (shader_watcher__has_extension(name, ".geom"))
+    {
+        *type = GEOMETRY_SHADER;
+    }
+    else if (shader_watcher__has_extension(name, ".comp"))
+    {
+        *type = COMPUTE_SHADER;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static bool shader_watcher__is_header(const char* name)
+{
+    return shader_watcher__has_extension(name, ".glsl")
+           || shader_watcher__has_extension(name, ".h")
+           || shader_watcher__has_extension(name, ".inc");
+}
+
+// Finds or adds the job for `name`. SPIR-V goes next to the source with .spv
+// appended, shader.vert -> shader.vert.spv, so stages sharing a base name do
+// not overwrite each other. The pointer is only good until the next entry is
+// added.
+static shader_watch_entry_t* shader_watcher__entry(shader_watcher_t* watcher,
+                                                   const char*       name,
+                                                   shader_type       type)
+{
+    char path[PATH_MAX];
+    int  written = snprintf(path, sizeof(path), "%s/%s", watcher->dir, name);
+    if (written < 0 || (size_t) written >= sizeof(path))
+    {
+        return NULL;
+    }
+
+    string_id glsl_id = string_intern_c(&watcher->paths, path);
+    if (glsl_id == STRING_ID_NONE)
+    {
+        return NULL;
+    }
+
+    // interned, so the same path always has the same chars
+    const char* glsl_path = string_id_to_string(&watcher->paths, glsl_id).chars;
+    for (size_t i = 0; i < watcher->shaders->len; i++)
+    {
+        if (watcher->shaders->data[i].job.glsl_path == glsl_path)
+        {
+            return &watcher->shaders->data[i];
+        }
+    }
+
+    if ((size_t) written + sizeof(".spv") > sizeof(path))
+    {
+        return NULL;
+    }
+    memcpy(path + written, ".spv", sizeof(".spv"));
+
+    string_id spirv_id = string_intern_c(&watcher->paths, path);
+    if (spirv_id == STRING_ID_NONE)
+    {
+        return NULL;
+    }
+
+    shader_watch_entry_t entry = {
+        .job = {
+            .glsl_path  = glsl_path,
+            .spirv_path = string_id_to_string(&watcher->paths, spirv_id).chars,
+            .type       = type,
+        },
+    };
+
+    if (!shader_watch_array_push(watcher->alloc, &watcher->shaders, entry))
+    {
+        return NULL;
+    }
+
+    return &watcher->shaders->data[watcher->shaders->len - 1];
+}
+
+// Returns true if `name` is something the watcher compiles or includes
+static bool shader_watcher__mark(shader_watcher_t* watcher, const char* name)
+{
+    shader_type type;
+    if (shader_watcher__type_for(name, &type))
+    {
+        shader_watch_entry_t* entry
+            = shader_watcher__entry(watcher, name, type);
+        if (entry)
+        {
+            entry->dirty = true;
+        }
+        return entry != NULL;
+    }
+
+    if (shader_watcher__is_header(name))
+    {
+        watcher->headers_changed = true;
+        return true;
+    }
+
+    return false;
+}
+
+static void shader_watcher__scan(shader_watcher_t* watcher)
+{
+    DIR* dir = opendir(watcher->dir);
+    if (!dir)
+    {
+        return;
+    }
+
+    struct dirent* file;
+    while ((file = readdir(dir)))
+    {
+        shader_watcher__mark(watcher, file->d_name);
+    }
+
+    closedir(dir);
+}
+
+static void shader_watcher__publish(shader_watcher_t*   watcher,
+                                    const shader_job_t* job)
+{
+    allocator*       alloc = watcher->alloc;
+    string_t*        spirv = read_file(alloc, job->spirv_path);
+    shader_reload_t* reload
+        = alloc->malloc(sizeof(shader_reload_t), alloc->ctx);
+    if (!spirv || !reload)
+    {
+        log_error(LOG_SHADERS, "Shader reload failed: %s\n", job->spirv_path);
+        if (spirv)
+        {
+            alloc->free(spirv, alloc->ctx);
+        }
+        if (reload)
+        {
+            alloc->free(reload, alloc->ctx);
+        }
+        return;
+    }
+
+    *reload = (shader_reload_t) {
+        .glsl_path  = job->glsl_path,
+        .spirv_path = job->spirv_path,
+        .type       = job->type,
+        .spirv      = spirv,
+        .next = atomic_load_explicit(&watcher->published, memory_order_relaxed),
+    };
+
+    while (!atomic_compare_exchange_weak_explicit(&watcher->published,
+                                                  &reload->next,
+                                                  reload,
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+    {
+    }
+}
+
+// Recompiles saved shaders, or every shader after a header changed. The job
+// dependency lists make shaders that do not include the header a no-op.
+static void shader_watcher__compile(shader_watcher_t* watcher, bool publish)
+{
+    bool all = watcher->headers_changed;
+    if (all)
+    {
+        shader_include_cache_refresh(&watcher->includes);
+        watcher->headers_changed = false;
+    }
+
+    for (size_t i = 0; i < watcher->shaders->len; i++)
+    {
+        shader_watch_entry_t* entry = &watcher->shaders->data[i];
+        if (!all && !entry->dirty)
+        {
+            continue;
+        }
+
+        entry->dirty = false;
+        if (!shader_compile_job(&watcher->compiler,
+                                watcher->has_cache ? &watcher->cache : NULL,
+                                &watcher->includes,
+                                &entry->job))
+        {
+            log_error(
+                LOG_SHADERS, "Shader reload failed: %s\n", entry->job.error);
+            continue;
+        }
+
+        if (publish && !entry->job.skipped)
+        {
+            shader_watcher__publish(watcher, &entry->job);
+        }
+    }
+}
+
+static int shader_watcher__thread(void* arg)
+{
+    shader_watcher_t* watcher = arg;
+
+    // the first pass only records dependency lists (mostly cache hits), the
+    // engine already loads whatever SPIR-V is on disk at startup
+    shader_watcher__scan(watcher);
+    shader_watcher__compile(watcher, false);
+
+    alignas(struct inotify_event) char events[4096];
+    bool pending = false;
+
+    while (true)
+    {
+        struct pollfd fds[2] = {
+            { .fd = watcher->inotify_fd, .events = POLLIN },
+            { .fd = watcher->wake_fd, .events = POLLIN },
+        };
+
+        int ready = poll(fds, 2, pending ? SHADER_WATCHER_DEBOUNCE_MS : -1);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready < 0 || fds[1].revents)
+        {
+            break;
+        }
+
+        if (ready == 0)
+        {
+            shader_watcher__compile(watcher, true);
+            pending = false;
+            continue;
+        }
+
+        ssize_t len = read(watcher->inotify_fd, events, sizeof(events));
+        for (ssize_t offset = 0; offset < len;)
+        {
+            const struct inotify_event* event
+                = (const void*) (events + offset);
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // events were dropped, look at everything again
+                shader_watcher__scan(watcher);
+                watcher->headers_changed = true;
+                pending                  = true;
+            }
+            else if (event->len > 0)
+            {
+                pending = shader_watcher__mark(watcher, event->name) || pending;
+            }
+
+            offset += (ssize_t) (sizeof(struct inotify_event) + event->len);
+        }
+    }
+
+    return 0;
+}
+
+static void shader_watcher__release(shader_watcher_t* watcher)
+{
+    allocator* alloc = watcher->alloc;
+
+    shader_reload_t* reload = atomic_exchange_explicit(
+        &watcher->published, NULL, memory_order_acquire);
+    while (reload)
+    {
+        shader_reload_t* next = reload->next;
+        alloc->free(reload->spirv, alloc->ctx);
+        alloc->free(reload, alloc->ctx);
+        reload = next;
+    }
+
+    shader_watch_array_free(alloc, watcher->shaders);
+    string_table_release(&watcher->paths);
+    if (watcher->includes.files)
+    {
+        shader_include_cache_release(&watcher->includes);
+    }
+    shader_compiler_release(&watcher->compiler);
+
+    if (watcher->wake_fd >= 0)
+    {
+        close(watcher->wake_fd);
+    }
+    if (watcher->inotify_fd >= 0)
+    {
+        close(watcher->inotify_fd);
+    }
+
+    alloc->free(watcher, alloc->ctx);
+}
+
+// Watches `dir` (not recursive). `cache_dir` may be NULL to always compile.
+// Returns NULL if inotify, shaderc or the thread are unavailable.
+shader_watcher_t* shader_watcher_create(allocator*       alloc,
+                                        const char*      dir,
+                                        const char*      cache_dir,
+                                        shader_reload_fn on_reload,
+                                        void*            user_data)
+{
+    shader_watcher_t* watcher
+        = alloc->malloc(sizeof(shader_watcher_t), alloc->ctx);
+    if (!watcher)
+    {
+        return NULL;
+    }
+
+    *watcher = (shader_watcher_t) {
+        .alloc      = alloc,
+        .inotify_fd = -1,
+        .wake_fd    = -1,
+        .on_reload  = on_reload,
+        .user_data  = user_data,
+    };
+
+    int written = snprintf(watcher->dir, sizeof(watcher->dir), "%s", dir);
+    if (written < 0 || (size_t) written >= sizeof(watcher->dir))
+    {
+        shader_watcher__release(watcher);
+        return NULL;
+    }
+
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watcher->wake_fd    = eventfd(0, EFD_CLOEXEC);
+    if (watcher->inotify_fd < 0 || watcher->wake_fd < 0
+        || inotify_add_watch(
+               watcher->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)
+               < 0)
+    {
+        log_error(LOG_SHADERS, "Cannot watch %s: %s\n", dir, strerror(errno));
+        shader_watcher__release(watcher);
+        return NULL;
+    }
+
+    watcher->has_cache = cache_dir && shader_cache_init(&watcher->cache,
+                                                        cache_dir);
+    watcher->shaders   = make_shader_watch_array(alloc, 16);
+
+    if (!watcher->shaders || !shader_compiler_init(&watcher->compiler)
+        || !shader_include_cache_init(&watcher->includes, alloc, dir)
+        || !string_table_init(
+            &watcher->paths, alloc, SHADER_WATCHER_NAME_BYTES))
+    {
+        shader_watcher__release(watcher);
+        return NULL;
+    }
+
+    if (thrd_create(&watcher->thread, shader_watcher__thread, watcher)
+        != thrd_success)
+    {
+        shader_watcher__release(watcher);
+        return NULL;
+    }
+
+    return watcher;
+}
+
+// Hands every shader finished since the last call to the reload callback,
+// oldest first, on the calling thread. Never blocks. Returns the count.
+size_t shader_watcher_poll(shader_watcher_t* watcher)
+{
+    if (!watcher)
+    {
+        return 0;
+    }
+
+    shader_reload_t* newest = atomic_exchange_explicit(
+        &watcher->published, NULL, memory_order_acquire);
+
+    shader_reload_t* oldest = NULL;
+    while (newest)
+    {
+        shader_reload_t* next = newest->next;
+        newest->next          = oldest;
+        oldest                = newest;
+        newest                = next;
+    }
+
+    allocator* alloc = watcher->alloc;
+    size_t     count = 0;
+    while (oldest)
+    {
+        shader_reload_t* next = oldest->next;
+        if (watcher->on_reload)
+        {
+            watcher->on_reload(oldest, watcher->user_data);
+        }
+
+        alloc->free(oldest->spirv, alloc->ctx);
+        alloc->free(oldest, alloc->ctx);
+
+        oldest = next;
+        count++;
+    }
+
+    return count;
+}
+
+void shader_watcher_destroy(shader_watcher_t* watcher)
+{
+    if (!watcher)
+    {
+        return;
+    }
+
+    eventfd_write(watcher->wake_fd, 1);
+    thrd_join(watcher->thread, NULL);
+
+    shader_watcher__release(watcher);
+}
+
+#endif  // SHADER_WATCHER_H
@@ -9,9 +9,16 @@
 #include <stdlib.h>
 #include <shaderc/shaderc.h>
 #include "prelude.h"
+#include "log.h"
+#include "intern.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <unistd.h>
 
 typedef enum shader_type
 {
@@ -23,70 +30,1069 @@ typedef enum shader_type
 
 
 
-// This function releases the resources of a compiled shader result.
-void release_compiled_shader_result(shaderc_compilation_result_t compile_result, shaderc_compile_options_t compile_options, shaderc_compiler_t compiler) {
-    shaderc_result_release(compile_result);
-    shaderc_compile_options_release(compile_options);
-    shaderc_compiler_release(compiler);
+static bool shader_kind_from_type(shader_type type, shaderc_shader_kind* kind)
+{
+    switch (type) {
+        case VERTEX_SHADER:   *kind = shaderc_glsl_vertex_shader;   return true;
+        case FRAGMENT_SHADER: *kind = shaderc_glsl_fragment_shader; return true;
+        case GEOMETRY_SHADER: *kind = shaderc_glsl_geometry_shader; return true;
+        case COMPUTE_SHADER:  *kind = shaderc_glsl_compute_shader;  return true;
+    }
+
+    return false;
 }
 
-// This function compiles a GLSL shader to SPIR-V by running an external script.
-void glsl_to_spirv(allocator* alloc, const char* glsl_path, const char* spirv_path, shader_type type)
+//
+// Persistent SPIR-V cache
+//
+// Compiled SPIR-V is stored under `<dir>/<key>.spv`, where the key hashes
+// everything that affects the output: the GLSL source, the shader kind, the
+// entry point, the compile options, the SPIR-V version and revision shaderc
+// reports and the contents of every included file. A hit maps the cached file
+// and never touches shaderc.
+//
+
+// Bump when the compile options or the cache layout change, a new shaderc is
+// picked up through shaderc_get_spv_version
+#define SHADER_CACHE_VERSION 2u
+
+typedef struct
 {
-    // read glsl file
-    string_t* glsl_code = read_file(alloc, glsl_path);
+    char dir[256];
+} shader_cache_t;
 
-    // compile shader
-    shaderc_compiler_t compiler = shaderc_compiler_initialize();
-    shaderc_compile_options_t compile_options = shaderc_compile_options_initialize();
-    shaderc_shader_kind kind;
-    switch (type) {
-        case VERTEX_SHADER:   kind = shaderc_glsl_vertex_shader;   break;
-        case FRAGMENT_SHADER: kind = shaderc_glsl_fragment_shader; break;
-        case GEOMETRY_SHADER: kind = shaderc_glsl_geometry_shader; break;
-        case COMPUTE_SHADER:  kind = shaderc_glsl_compute_shader;  break;
-        default:
-            fprintf(stderr, "Invalid shader type: %d\n", type);
-            // Must release the resources we've already acquired before returning.
-            shaderc_compile_options_release(compile_options);
-            shaderc_compiler_release(compiler);
+bool shader_cache_init(shader_cache_t* cache, const char* dir)
+{
+    int written = snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    if (written < 0 || (size_t) written >= sizeof(cache->dir))
+    {
+        return false;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        log_error(LOG_SHADERS,
+                  "Error creating shader cache %s: %s\n",
+                  dir,
+                  strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Covers the main source only, see shader_deps_key for the full key
+uint64_t shader_cache_key(string_t            source,
+                          shaderc_shader_kind kind,
+                          const char*         entry_point)
+{
+    uint32_t version = SHADER_CACHE_VERSION;
+    uint32_t kind_id = (uint32_t) kind;
+
+    // SPIR-V from an older compiler is not reused after an upgrade
+    unsigned int spv[2];
+    shaderc_get_spv_version(&spv[0], &spv[1]);
+
+    uint64_t key = hash_bytes(&version, sizeof(version), HASH_SEED);
+    key          = hash_bytes(spv, sizeof(spv), key);
+    key          = hash_bytes(&kind_id, sizeof(kind_id), key);
+    key          = hash_bytes(
+        entry_point, find_length_of_c_string(entry_point) + 1, key);
+    key          = hash_bytes(source.chars, source.len, key);
+
+    return key;
+}
+
+static bool shader_cache__path(const shader_cache_t* cache,
+                               uint64_t              key,
+                               const char*           extension,
+                               char*                 path,
+                               size_t                size)
+{
+    int written = snprintf(path,
+                           size,
+                           "%s/%016llx%s",
+                           cache->dir,
+                           (unsigned long long) key,
+                           extension);
+    return written >= 0 && (size_t) written < size;
+}
+
+static bool shader_cache__temp_path(const char* path, char* tmp, size_t size)
+{
+    int written = snprintf(tmp, size, "%s.%ld.tmp", path, (long) getpid());
+    return written >= 0 && (size_t) written < size;
+}
+
+bool shader_cache_lookup(const shader_cache_t* cache,
+                         uint64_t              key,
+                         file_view_t*          spirv)
+{
+    char path[320];
+    if (!shader_cache__path(cache, key, ".spv", path, sizeof(path)))
+    {
+        return false;
+    }
+
+    return file_view_open(spirv, path, FILE_ACCESS_WILL_NEED) && spirv->len > 0;
+}
+
+// Written to a temporary file and renamed into place, so a concurrent reader
+// or a crash never sees a half-written entry
+bool shader_cache_store(const shader_cache_t* cache,
+                        uint64_t              key,
+                        const char*           spirv,
+                        size_t                size)
+{
+    char path[320];
+    return shader_cache__path(cache, key, ".spv", path, sizeof(path))
+           && write_file_atomic(path, spirv, size);
+}
+
+//
+// Includes and dependency tracking
+//
+// `#include` is resolved by shaderc through callbacks into an include cache.
+// Every header is read once, hashed and kept in memory under its canonical
+// path, so a header shared by many shaders is loaded a single time. Each
+// shader records the headers it pulled in, and its full cache key folds in
+// their content hashes. When a header changes only the shaders that list it
+// get a new key and are recompiled, the rest are skipped.
+//
+
+#ifndef SHADER_MAX_DEPENDENCIES
+#define SHADER_MAX_DEPENDENCIES 32
+#endif
+
+#ifndef SHADER_INCLUDE_PATH_BYTES
+#define SHADER_INCLUDE_PATH_BYTES (16 * 1024)
+#endif
+
+typedef struct
+{
+    string_t* source;  // NULL when the file could not be read
+    uint64_t  hash;
+    int64_t   mtime_ns;
+    int64_t   size;
+} shader_include_t;
+
+ARRAY_DEFINE(shader_include_array_t, shader_include_array, shader_include_t)
+
+typedef struct
+{
+    allocator* alloc;
+    mtx_t      lock;  // batch workers resolve includes concurrently
+
+    string_table_t          paths;  // canonical paths
+    shader_include_array_t* files;  // indexed by the path's string_id
+
+    char include_dir[256];  // searched for <...> and unresolved "..." includes
+} shader_include_cache_t;
+
+// Headers a shader was built from, in first-include order
+typedef struct
+{
+    uint64_t  source_key;  // main source only
+    uint64_t  key;         // full cache key of the last build, 0 if none
+    uint32_t  count;
+    bool      overflow;  // too many headers to track, never skipped
+    string_id files[SHADER_MAX_DEPENDENCIES];
+} shader_deps_t;
+
+bool shader_include_cache_init(shader_include_cache_t* cache,
+                               allocator*              alloc,
+                               const char*             include_dir)
+{
+    *cache = (shader_include_cache_t) { .alloc = alloc };
+
+    int written = snprintf(
+        cache->include_dir, sizeof(cache->include_dir), "%s", include_dir);
+    if (written < 0 || (size_t) written >= sizeof(cache->include_dir))
+    {
+        return false;
+    }
+
+    if (mtx_init(&cache->lock, mtx_plain) != thrd_success)
+    {
+        return false;
+    }
+
+    if (!string_table_init(&cache->paths, alloc, SHADER_INCLUDE_PATH_BYTES))
+    {
+        string_table_release(&cache->paths);
+        mtx_destroy(&cache->lock);
+        return false;
+    }
+
+    // mirror the string table, id 0 is never handed out
+    cache->files = make_shader_include_array(alloc, STRING_TABLE_MIN_SLOTS);
+    if (!cache->files
+        || !shader_include_array_push(
+            alloc, &cache->files, (shader_include_t) { 0 }))
+    {
+        shader_include_array_free(alloc, cache->files);
+        string_table_release(&cache->paths);
+        mtx_destroy(&cache->lock);
+        return false;
+    }
+
+    return true;
+}
+
+void shader_include_cache_release(shader_include_cache_t* cache)
+{
+    for (size_t id = 1; id < cache->files->len; id++)
+    {
+        if (cache->files->data[id].source)
+        {
+            cache->alloc->free(cache->files->data[id].source,
+                               cache->alloc->ctx);
+        }
+    }
+
+    shader_include_array_free(cache->alloc, cache->files);
+    string_table_release(&cache->paths);
+    mtx_destroy(&cache->lock);
+
+    *cache = (shader_include_cache_t) { 0 };
+}
+
+static int64_t shader_include__mtime_ns(const struct stat* info)
+{
+    return (int64_t) info->st_mtim.tv_sec * 1000000000
+           + (int64_t) info->st_mtim.tv_nsec;
+}
+
+// Lock held. The file is stat'ed before reading, so a write racing with the
+// read leaves an old mtime behind and the next refresh picks it up again.
+static void shader_include__load(shader_include_cache_t* cache, string_id id)
+{
+    shader_include_t* file = &cache->files->data[id];
+    if (file->source)
+    {
+        cache->alloc->free(file->source, cache->alloc->ctx);
+    }
+
+    *file = (shader_include_t) { 0 };
+
+    const char* path = string_id_to_string(&cache->paths, id).chars;
+    struct stat info;
+    if (stat(path, &info) != 0)
+    {
+        return;
+    }
+
+    file->source = read_file(cache->alloc, path);
+    if (!file->source)
+    {
+        return;
+    }
+
+    file->hash = hash_bytes(file->source->chars, file->source->len, HASH_SEED);
+    file->mtime_ns = shader_include__mtime_ns(&info);
+    file->size     = (int64_t) info.st_size;
+}
+
+// `path` must be canonical. Reads the file the first time it is seen.
+string_id shader_include_cache_get(shader_include_cache_t* cache,
+                                   const char*             path)
+{
+    mtx_lock(&cache->lock);
+
+    string_id id = string_intern_c(&cache->paths, path);
+    if (id != STRING_ID_NONE && id >= cache->files->len)
+    {
+        if (shader_include_array_push(
+                cache->alloc, &cache->files, (shader_include_t) { 0 }))
+        {
+            shader_include__load(cache, id);
+        }
+        else
+        {
+            id = STRING_ID_NONE;
+        }
+    }
+
+    mtx_unlock(&cache->lock);
+    return id;
+}
+
+// Canonicalizes `path`, STRING_ID_NONE if no shader has included it
+string_id shader_include_cache_find(shader_include_cache_t* cache,
+                                    const char*             path)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved))
+    {
+        return STRING_ID_NONE;
+    }
+
+    mtx_lock(&cache->lock);
+    string_id id
+        = string_table_find(&cache->paths, make_from_c_string(resolved));
+    mtx_unlock(&cache->lock);
+
+    return id;
+}
+
+// Copy of the entry, `source` stays valid until the next refresh
+shader_include_t shader_include_cache_file(shader_include_cache_t* cache,
+                                           string_id               id)
+{
+    mtx_lock(&cache->lock);
+    shader_include_t file = cache->files->data[id];
+    mtx_unlock(&cache->lock);
+
+    return file;
+}
+
+const char* shader_include_cache_path(shader_include_cache_t* cache,
+                                      string_id               id)
+{
+    mtx_lock(&cache->lock);
+    const char* path = string_id_to_string(&cache->paths, id).chars;
+    mtx_unlock(&cache->lock);
+
+    return path;
+}
+
+// Re-reads every header whose size or mtime changed and returns how many did.
+// Frees the old contents, so it must not run while shaders are compiling.
+size_t shader_include_cache_refresh(shader_include_cache_t* cache)
+{
+    size_t changed = 0;
+
+    mtx_lock(&cache->lock);
+    for (string_id id = 1; id < cache->files->len; id++)
+    {
+        const shader_include_t* file = &cache->files->data[id];
+        const char* path = string_id_to_string(&cache->paths, id).chars;
+
+        struct stat info;
+        bool        exists = stat(path, &info) == 0;
+        if (exists == (file->source != NULL)
+            && (!exists
+                || (file->mtime_ns == shader_include__mtime_ns(&info)
+                    && file->size == (int64_t) info.st_size)))
+        {
+            continue;
+        }
+
+        shader_include__load(cache, id);
+        changed++;
+    }
+    mtx_unlock(&cache->lock);
+
+    return changed;
+}
+
+static void shader_deps__add(shader_deps_t* deps, string_id id)
+{
+    for (uint32_t i = 0; i < deps->count; i++)
+    {
+        if (deps->files[i] == id)
+        {
             return;
+        }
+    }
+
+    if (deps->count == SHADER_MAX_DEPENDENCIES)
+    {
+        deps->overflow = true;
+        return;
+    }
+
+    deps->files[deps->count++] = id;
+}
+
+bool shader_deps_contains(const shader_deps_t* deps, string_id id)
+{
+    for (uint32_t i = 0; i < deps->count; i++)
+    {
+        if (deps->files[i] == id)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Full cache key: the source key folded with the current contents of every
+// dependency. Returns 0 when a dependency is gone or the list overflowed,
+// such a shader always has to be recompiled.
+uint64_t shader_deps_key(shader_include_cache_t* includes,
+                         const shader_deps_t*    deps)
+{
+    if (deps->overflow || (deps->count > 0 && !includes))
+    {
+        return 0;
+    }
+
+    uint64_t key = deps->source_key;
+    for (uint32_t i = 0; i < deps->count; i++)
+    {
+        shader_include_t file = shader_include_cache_file(includes,
+                                                          deps->files[i]);
+        if (!file.source)
+        {
+            return 0;
+        }
+
+        key = hash_bytes(&file.hash, sizeof(file.hash), key);
+    }
+
+    return key ? key : 1;
+}
+
+// The dependency list is stored next to the SPIR-V as `<source_key>.dep`,
+// one canonical path per line. Without it a fresh process could not work out
+// the full key of a shader that has includes.
+bool shader_cache_store_deps(const shader_cache_t*   cache,
+                             shader_include_cache_t* includes,
+                             const shader_deps_t*    deps)
+{
+    char path[320];
+    char tmp_path[352];
+    if (!shader_cache__path(cache, deps->source_key, ".dep", path, sizeof(path))
+        || !shader_cache__temp_path(path, tmp_path, sizeof(tmp_path)))
+    {
+        return false;
+    }
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    bool success = true;
+    for (uint32_t i = 0; i < deps->count && success; i++)
+    {
+        const char* include = shader_include_cache_path(includes,
+                                                        deps->files[i]);
+        success = fputs(include, file) >= 0 && fputc('\n', file) != EOF;
+    }
+
+    success = fclose(file) == 0 && success;
+    if (!success || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+// Fills `deps` with the list stored for `deps->source_key`. Leaves it empty
+// and returns false when there is none (the shader has no includes, or was
+// never built).
+bool shader_cache_load_deps(const shader_cache_t*   cache,
+                            shader_include_cache_t* includes,
+                            shader_deps_t*          deps)
+{
+    *deps = (shader_deps_t) { .source_key = deps->source_key };
+
+    char        path[320];
+    file_view_t list;
+    if (!includes
+        || !shader_cache__path(
+            cache, deps->source_key, ".dep", path, sizeof(path))
+        || !file_view_open(&list, path, FILE_ACCESS_SEQUENTIAL))
+    {
+        return false;
     }
-    shaderc_compilation_result_t compile_result = shaderc_compile_into_spv(
-        compiler,
-        glsl_code->chars,
-        glsl_code->len,
+
+    bool   success = true;
+    size_t start   = 0;
+    for (size_t i = 0; i <= list.len && success; i++)
+    {
+        if (i < list.len && list.data[i] != '\n')
+        {
+            continue;
+        }
+
+        size_t len = i - start;
+        if (len > 0)
+        {
+            char include[PATH_MAX];
+            if (len >= sizeof(include))
+            {
+                success = false;
+                break;
+            }
+
+            memcpy(include, list.data + start, len);
+            include[len] = '\0';
+
+            string_id id = shader_include_cache_get(includes, include);
+            success      = id != STRING_ID_NONE;
+            shader_deps__add(deps, id);
+        }
+
+        start = i + 1;
+    }
+
+    file_view_release(&list);
+
+    if (!success || deps->overflow)
+    {
+        *deps = (shader_deps_t) { .source_key = deps->source_key };
+        return false;
+    }
+
+    return true;
+}
+
+typedef struct
+{
+    shader_include_cache_t* includes;  // NULL when #include is disabled
+    shader_deps_t*          deps;
+} shader_include__ctx_t;
+
+typedef struct
+{
+    shaderc_include_result result;
+    char                   error[320];
+} shader_include__result_t;
+
+#define SHADER_INCLUDE__UNAVAILABLE "#include is not available for this shader"
+
+// Handed out when there is no include cache or no memory for a result
+static shaderc_include_result shader_include__unavailable = {
+    .source_name        = "",
+    .source_name_length = 0,
+    .content            = SHADER_INCLUDE__UNAVAILABLE,
+    .content_length     = sizeof(SHADER_INCLUDE__UNAVAILABLE) - 1,
+};
+
+// `dir` + '/' + `name` into `out`, false if it does not fit
+static bool shader_include__join(char*       out,
+                                 size_t      size,
+                                 const char* dir,
+                                 size_t      dir_len,
+                                 const char* name)
+{
+    size_t name_len = find_length_of_c_string(name);
+    if (dir_len + 1 + name_len >= size)
+    {
+        return false;
+    }
+
+    memcpy(out, dir, dir_len);
+    out[dir_len] = '/';
+    memcpy(out + dir_len + 1, name, name_len + 1);
+    return true;
+}
+
+// "file" is looked up next to the including file first, <file> and misses
+// fall back to the cache's include directory
+static bool shader_include__resolve_path(const shader_include_cache_t* cache,
+                                         const char* requested_source,
+                                         int         type,
+                                         const char* requesting_source,
+                                         char*       resolved)
+{
+    char candidate[PATH_MAX];
+
+    if (type == shaderc_include_type_relative)
+    {
+        const char* slash = strrchr(requesting_source, '/');
+        const char* dir   = slash ? requesting_source : ".";
+        size_t      len   = slash ? (size_t) (slash - requesting_source) : 1;
+
+        if (shader_include__join(
+                candidate, sizeof(candidate), dir, len, requested_source)
+            && realpath(candidate, resolved))
+        {
+            return true;
+        }
+    }
+
+    return shader_include__join(candidate,
+                                sizeof(candidate),
+                                cache->include_dir,
+                                find_length_of_c_string(cache->include_dir),
+                                requested_source)
+           && realpath(candidate, resolved);
+}
+
+static shaderc_include_result* shader_include__resolve(
+    void*       user_data,
+    const char* requested_source,
+    int         type,
+    const char* requesting_source,
+    size_t      include_depth)
+{
+    (void) include_depth;
+
+    shader_include__ctx_t*  ctx   = user_data;
+    shader_include_cache_t* cache = ctx->includes;
+    if (!cache)
+    {
+        return &shader_include__unavailable;
+    }
+
+    char      resolved[PATH_MAX];
+    string_id id = STRING_ID_NONE;
+    if (shader_include__resolve_path(
+            cache, requested_source, type, requesting_source, resolved))
+    {
+        id = shader_include_cache_get(cache, resolved);
+    }
+
+    mtx_lock(&cache->lock);
+    shader_include__result_t* out = cache->alloc->malloc(
+        (ptrdiff_t) sizeof(shader_include__result_t), cache->alloc->ctx);
+    shader_include_t file = id != STRING_ID_NONE ? cache->files->data[id]
+                                                 : (shader_include_t) { 0 };
+    string_t         name = string_id_to_string(&cache->paths, id);
+    mtx_unlock(&cache->lock);
+
+    if (!out)
+    {
+        return &shader_include__unavailable;
+    }
+
+    *out = (shader_include__result_t) { 0 };
+
+    // an empty source name tells shaderc the include failed
+    if (!file.source)
+    {
+        snprintf(out->error,
+                 sizeof(out->error),
+                 "Cannot open include \"%s\" from %s",
+                 requested_source,
+                 requesting_source);
+
+        out->result.source_name    = "";
+        out->result.content        = out->error;
+        out->result.content_length = find_length_of_c_string(out->error);
+        return &out->result;
+    }
+
+    shader_deps__add(ctx->deps, id);
+
+    out->result.source_name        = name.chars;
+    out->result.source_name_length = name.len;
+    out->result.content            = file.source->chars;
+    out->result.content_length     = file.source->len;
+    return &out->result;
+}
+
+static void shader_include__release(void*                   user_data,
+                                    shaderc_include_result* result)
+{
+    shader_include__ctx_t* ctx = user_data;
+    if (!ctx->includes || result == &shader_include__unavailable)
+    {
+        return;
+    }
+
+    mtx_lock(&ctx->includes->lock);
+    ctx->includes->alloc->free(result, ctx->includes->alloc->ctx);
+    mtx_unlock(&ctx->includes->lock);
+}
+
+//
+// Batch compilation
+//
+// A batch spreads its jobs over N threads (the caller is one of them). Every
+// worker owns one shaderc compiler and options instance for the whole batch
+// and pulls the next job off a shared counter, so hundreds of shaders cost
+// one compiler setup per thread instead of one per shader.
+//
+
+typedef struct
+{
+    shaderc_compiler_t        compiler;
+    shaderc_compile_options_t options;
+} shader_compiler_t;
+
+bool shader_compiler_init(shader_compiler_t* compiler)
+{
+    compiler->compiler = shaderc_compiler_initialize();
+    compiler->options  = shaderc_compile_options_initialize();
+
+    return compiler->compiler && compiler->options;
+}
+
+void shader_compiler_release(shader_compiler_t* compiler)
+{
+    if (compiler->options)
+    {
+        shaderc_compile_options_release(compiler->options);
+    }
+    if (compiler->compiler)
+    {
+        shaderc_compiler_release(compiler->compiler);
+    }
+
+    *compiler = (shader_compiler_t) { 0 };
+}
+
+// Zero-initialize a job before its first batch and keep it around, `deps`
+// carries what the next batch needs to skip it when nothing changed
+typedef struct
+{
+    const char* glsl_path;
+    const char* spirv_path;
+    shader_type type;
+    bool        keep_cached;  // hand a cache hit's mapping back in `cached`
+
+    // filled in by the batch
+    bool          ok;
+    bool          cache_hit;
+    bool          skipped;  // up to date, nothing was compiled or written
+    double        milliseconds;
+    char          error[512];
+    shader_deps_t deps;
+    file_view_t   cached;  // only with keep_cached, the caller releases it
+} shader_job_t;
+
+static void shader_job__fail(shader_job_t* job,
+                             const char*   what,
+                             const char*   detail)
+{
+    job->ok = false;
+    snprintf(job->error,
+             sizeof(job->error),
+             "%s %s: %s",
+             what,
+             job->glsl_path,
+             detail);
+}
+
+// Compile one job with an existing compiler. `cache` and `includes` may be
+// NULL, without `includes` any #include fails to compile.
+bool shader_compile_job(shader_compiler_t*      compiler,
+                        shader_cache_t*         cache,
+                        shader_include_cache_t* includes,
+                        shader_job_t*           job)
+{
+    uint64_t start = time_now_ns();
+
+    job->ok        = false;
+    job->cache_hit = false;
+    job->skipped   = false;
+    job->error[0]  = '\0';
+
+    shaderc_shader_kind kind;
+    if (!shader_kind_from_type(job->type, &kind))
+    {
+        shader_job__fail(job, "Invalid shader type for", "unknown kind");
+        return false;
+    }
+
+    file_view_t glsl_code;
+    if (!file_view_open(&glsl_code, job->glsl_path, FILE_ACCESS_SEQUENTIAL))
+    {
+        shader_job__fail(job, "Error reading shader", strerror(errno));
+        return false;
+    }
+
+    uint64_t source_key
+        = shader_cache_key(file_view_string(glsl_code), kind, "main");
+
+    // same source and same headers as the last build
+    if (job->deps.key != 0 && job->deps.source_key == source_key
+        && shader_deps_key(includes, &job->deps) == job->deps.key
+        && (!job->spirv_path || file_exists(job->spirv_path)))
+    {
+        file_view_release(&glsl_code);
+
+        job->ok           = true;
+        job->skipped      = true;
+        job->milliseconds = time_ns_to_ms(time_now_ns() - start);
+        return true;
+    }
+
+    shader_deps_t deps = { .source_key = source_key };
+    if (cache)
+    {
+        shader_cache_load_deps(cache, includes, &deps);
+
+        file_view_t cached;
+        uint64_t    key = shader_deps_key(includes, &deps);
+        if (key && shader_cache_lookup(cache, key, &cached))
+        {
+            file_view_release(&glsl_code);
+
+            job->cache_hit = true;
+            job->ok        = !job->spirv_path
+                      || write_file(job->spirv_path, cached.data, cached.len);
+            if (!job->ok)
+            {
+                shader_job__fail(
+                    job, "Error writing SPIR-V for", strerror(errno));
+            }
+
+            deps.key  = job->ok ? key : 0;
+            job->deps = deps;
+
+            if (job->ok && job->keep_cached)
+            {
+                job->cached = cached;
+            }
+            else
+            {
+                file_view_release(&cached);
+            }
+            job->milliseconds = time_ns_to_ms(time_now_ns() - start);
+            return job->ok;
+        }
+
+        // recorded again while compiling
+        deps = (shader_deps_t) { .source_key = source_key };
+    }
+
+    shader_include__ctx_t include_ctx = { .includes = includes,
+                                          .deps     = &deps };
+    shaderc_compile_options_set_include_callbacks(compiler->options,
+                                                  shader_include__resolve,
+                                                  shader_include__release,
+                                                  &include_ctx);
+
+    shaderc_compilation_result_t result = shaderc_compile_into_spv(
+        compiler->compiler,
+        glsl_code.data,
+        glsl_code.len,
         kind,
-        glsl_path,
+        job->glsl_path,
         "main",
-        compile_options
+        compiler->options
     );
 
-    // free string memory
-    if (glsl_code)
+    file_view_release(&glsl_code);
+
+    if (shaderc_result_get_compilation_status(result)
+        != shaderc_compilation_status_success)
     {
-        alloc->free(glsl_code, alloc->ctx);
+        shader_job__fail(job,
+                         "Error compiling shader",
+                         shaderc_result_get_error_message(result));
     }
+    else
+    {
+        const char* spirv_bytes = shaderc_result_get_bytes(result);
+        size_t      spirv_size  = shaderc_result_get_length(result);
 
-    // check compilation errors
-    if (shaderc_result_get_compilation_status(compile_result) != shaderc_compilation_status_success) {
-        fprintf(stderr, "Error compiling shader %s: %s\n", glsl_path, shaderc_result_get_error_message(compile_result));
-        release_compiled_shader_result(compile_result, compile_options, compiler);
-        return;
+        job->ok  = true;
+        deps.key = shader_deps_key(includes, &deps);
+
+        // a failed cache write only costs a recompile next time
+        if (cache && deps.key
+            && (!shader_cache_store(cache, deps.key, spirv_bytes, spirv_size)
+                || (deps.count > 0
+                    && !shader_cache_store_deps(cache, includes, &deps))))
+        {
+            log_error(LOG_SHADERS,
+                      "Error writing shader cache entry for %s\n",
+                      job->glsl_path);
+        }
+
+        if (job->spirv_path
+            && !write_file(job->spirv_path, spirv_bytes, spirv_size))
+        {
+            shader_job__fail(job, "Error writing SPIR-V for", strerror(errno));
+        }
+    }
+
+    shaderc_result_release(result);
+
+    // the dependency list is kept on failure too, a fix to any of the
+    // headers is what the next build is waiting for
+    if (!job->ok)
+    {
+        deps.key = 0;
+    }
+    job->deps = deps;
+
+    job->milliseconds = time_ns_to_ms(time_now_ns() - start);
+    return job->ok;
+}
+
+#ifndef SHADER_BATCH_MAX_THREADS
+#define SHADER_BATCH_MAX_THREADS 32
+#endif
+
+typedef struct
+{
+    shader_job_t*           jobs;
+    size_t                  count;
+    shader_cache_t*         cache;
+    shader_include_cache_t* includes;
+    atomic_size_t           next;
+    atomic_size_t           failed;
+} shader_batch__ctx_t;
+
+static int shader_batch__worker(void* arg)
+{
+    shader_batch__ctx_t* ctx = arg;
+
+    shader_compiler_t compiler;
+    bool              ready = shader_compiler_init(&compiler);
+
+    while (true)
+    {
+        size_t index
+            = atomic_fetch_add_explicit(&ctx->next, 1, memory_order_relaxed);
+        if (index >= ctx->count)
+        {
+            break;
+        }
+
+        shader_job_t* job = &ctx->jobs[index];
+        if (!ready)
+        {
+            shader_job__fail(
+                job, "Error compiling shader", "shaderc initialization failed");
+        }
+
+        if (!ready
+            || !shader_compile_job(&compiler, ctx->cache, ctx->includes, job))
+        {
+            atomic_fetch_add_explicit(&ctx->failed, 1, memory_order_relaxed);
+        }
+    }
+
+    shader_compiler_release(&compiler);
+    return 0;
+}
+
+// Compile `count` jobs on up to `thread_count` threads (0 picks the number of
+// online cores). `cache` and `includes` may be NULL. Jobs whose source and
+// headers are unchanged since the previous batch are skipped. Returns how
+// many jobs failed, per-job status, error text and timing are left in the
+// jobs. Call shader_include_cache_refresh between batches to pick up edited
+// headers.
+size_t compile_shader_batch(shader_job_t*           jobs,
+                            size_t                  count,
+                            uint32_t                thread_count,
+                            shader_cache_t*         cache,
+                            shader_include_cache_t* includes)
+{
+    if (thread_count == 0)
+    {
+        long cores   = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 0 ? (uint32_t) cores : 1;
+    }
+    if (thread_count > count)
+    {
+        thread_count = (uint32_t) count;
+    }
+    if (thread_count > SHADER_BATCH_MAX_THREADS)
+    {
+        thread_count = SHADER_BATCH_MAX_THREADS;
+    }
+
+    shader_batch__ctx_t ctx = {
+        .jobs     = jobs,
+        .count    = count,
+        .cache    = cache,
+        .includes = includes,
+    };
+
+    // the calling thread is worker 0
+    thrd_t   threads[SHADER_BATCH_MAX_THREADS];
+    uint32_t spawned = 0;
+    for (uint32_t i = 1; i < thread_count; i++)
+    {
+        if (thrd_create(&threads[spawned], shader_batch__worker, &ctx)
+            == thrd_success)
+        {
+            spawned++;
+        }
     }
 
-    // spirv returned shader with size
-    size_t spirv_size = shaderc_result_get_length(compile_result);
-    const char* spirv_bytes = shaderc_result_get_bytes(compile_result);
+    shader_batch__worker(&ctx);
 
-    // write to file
-    bool success = write_file(spirv_path, spirv_bytes, spirv_size);
-    if (!success) {
-        fprintf(stderr, "Error writing SPIR-V file %s\n", spirv_path);
+    for (uint32_t i = 0; i < spawned; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+
+    return atomic_load(&ctx.failed);
+}
+
+// One job on a compiler of its own, failures are logged
+static bool shader__compile_one(shader_cache_t*         cache,
+                                shader_include_cache_t* includes,
+                                shader_job_t*           job)
+{
+    shader_compiler_t compiler;
+    if (!shader_compiler_init(&compiler))
+    {
+        shader_compiler_release(&compiler);
+        log_error(LOG_SHADERS,
+                  "Error compiling shader %s: shaderc init\n",
+                  job->glsl_path);
+        return false;
+    }
+
+    bool ok = shader_compile_job(&compiler, cache, includes, job);
+    shader_compiler_release(&compiler);
+
+    if (!ok)
+    {
+        log_error(LOG_SHADERS, "%s\n", job->error);
+    }
+
+    return ok;
+}
+
+// Compile `glsl_path` into `spirv_path`. With a `cache` an unchanged shader
+// is copied out of it instead of compiled. `cache` and `includes` may be
+// NULL. Batches of shaders should use compile_shader_batch.
+bool glsl_to_spirv(shader_cache_t*         cache,
+                   shader_include_cache_t* includes,
+                   const char*             glsl_path,
+                   const char*             spirv_path,
+                   shader_type             type)
+{
+    shader_job_t job = {
+        .glsl_path  = glsl_path,
+        .spirv_path = spirv_path,
+        .type       = type,
+    };
+
+    return shader__compile_one(cache, includes, &job);
+}
+
+// Compile through the cache. On a hit `spirv` is the mapping the lookup
+// already made, on a miss the shader is compiled, stored and then mapped from
+// the cache. `includes` may be NULL. Release the view with file_view_release.
+bool glsl_to_spirv_cached(shader_cache_t*         cache,
+                          shader_include_cache_t* includes,
+                          const char*             glsl_path,
+                          shader_type             type,
+                          file_view_t*            spirv)
+{
+    shader_job_t job = {
+        .glsl_path   = glsl_path,
+        .type        = type,
+        .keep_cached = true,
+    };
+    if (!shader__compile_one(cache, includes, &job))
+    {
+        return false;
+    }
+
+    if (job.cache_hit)
+    {
+        *spirv = job.cached;
+        return true;
+    }
+
+    if (!job.deps.key || !shader_cache_lookup(cache, job.deps.key, spirv))
+    {
+        log_error(LOG_SHADERS,
+                  "Error reading shader cache entry for %s\n",
+                  glsl_path);
+        return false;
     }
 
-    // release memory of shader result
-    release_compiled_shader_result(compile_result, compile_options, compiler);
+    return true;
 }
 
 #endif //SHADERS_H
@@ -0,0 +1,585 @@
+//
+// Streaming uploads to device local memory.
+//
+// Every upload goes through one persistently mapped, host visible ring
+// buffer sized for STAGING_DEFAULT_FRAME_SIZE (or the size asked for) per
+// frame in flight. An upload copies its data into the ring and records the
+// copy into the open batch, a command buffer on the transfer queue, which
+// falls back to the graphics queue when there is no DMA engine. All uploads
+// since the last frame are submitted together by staging_acquire at the
+// start of the next frame, and the frame waits on the batch's timeline
+// ticket on the GPU only.
+//
+// Ring space is reclaimed as soon as the batch that read it completed,
+// which is never later than the frame that consumed the data. When the ring
+// is full the open batch is submitted early and the oldest batch waited for.
+//
+// Exclusive resources filled on a dedicated transfer family need a queue
+// family ownership transfer: the release is recorded after the copy, the
+// matching acquire goes into the frame's command buffer in staging_acquire.
+// Images are transitioned from UNDEFINED, so an upload replaces the whole
+// subresource it covers.
+//
+// Not thread safe, record uploads from the render thread.
+//
+
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+#include "device.h"
+#include "gpu_memory.h"
+#include "queue.h"
+
+#ifndef STAGING_DEFAULT_FRAME_SIZE
+#define STAGING_DEFAULT_FRAME_SIZE (8ull << 20)
+#endif
+
+// Batches in flight, a batch is submitted at least once per frame
+#ifndef STAGING_MAX_BATCHES
+#define STAGING_MAX_BATCHES 8
+#endif
+
+typedef struct
+{
+    VkCommandPool   command_pool;
+    VkCommandBuffer command_buffer;
+    queue_ticket_t  ticket;  // zero until submitted
+    uint64_t        end;     // ring position after its last upload
+    bool            recording;
+} staging_batch_t;
+
+// Ownership acquire the frame still has to record
+typedef struct
+{
+    queue_transfer_t        transfer;
+    VkBuffer                buffer;  // VK_NULL_HANDLE for images
+    VkImage                 image;
+    VkImageSubresourceRange range;
+} staging_acquire_t;
+
+typedef struct
+{
+    allocator*    alloc;
+    gpu_memory_t* memory;
+
+    VkBuffer         buffer;
+    gpu_allocation_t allocation;
+    VkDeviceSize     size;
+    VkDeviceSize     alignment;
+
+    // positions grow forever, the offset is position % size
+    uint64_t head;
+    uint64_t tail;
+
+    // oldest submitted first, `open` is recording or about to
+    staging_batch_t batches[STAGING_MAX_BATCHES];
+    uint32_t        oldest;
+    uint32_t        open;
+    uint32_t        in_flight;
+
+    staging_acquire_t* acquires;
+    uint32_t           acquire_count;
+    uint32_t           acquire_capacity;
+
+    // last batch the frame has not waited on, and the stages that use it
+    queue_ticket_t        pending;
+    VkPipelineStageFlags2 pending_stages;
+} staging_t;
+
+// The device must be idle
+void staging_destroy(staging_t* staging, const device_info_t* device_info)
+{
+    if (!staging)
+    {
+        return;
+    }
+
+    allocator* alloc  = staging->alloc;
+    VkDevice   device = device_info->device;
+
+    for (uint32_t i = 0; i < STAGING_MAX_BATCHES; i++)
+    {
+        vkDestroyCommandPool(device, staging->batches[i].command_pool, nullptr);
+    }
+
+    gpu_memory_destroy_buffer(alloc,
+                              staging->memory,
+                              device_info,
+                              staging->buffer,
+                              &staging->allocation);
+
+    alloc->free(staging->acquires, alloc->ctx);
+    alloc->free(staging, alloc->ctx);
+}
+
+// `frame_size` of 0 uses STAGING_DEFAULT_FRAME_SIZE, the ring holds
+// `frame_count` of them
+staging_t* staging_create(allocator*           alloc,
+                          gpu_memory_t*        memory,
+                          const device_info_t* device_info,
+                          uint32_t             frame_count,
+                          VkDeviceSize         frame_size)
+{
+    staging_t* staging = alloc->malloc(sizeof(staging_t), alloc->ctx);
+    if (!staging)
+    {
+        return NULL;
+    }
+
+    VkDeviceSize alignment
+        = device_info->properties.limits.optimalBufferCopyOffsetAlignment;
+
+    *staging = (staging_t) {
+        .alloc  = alloc,
+        .memory = memory,
+        .size   = (frame_size ? frame_size : STAGING_DEFAULT_FRAME_SIZE)
+                * frame_count,
+        // texel blocks are at most 16 bytes, copies need 4 byte offsets
+        .alignment = alignment > 16 ? alignment : 16,
+    };
+
+    VkBufferCreateInfo buffer_info = {
+        .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size        = staging->size,
+        .usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    // coherent memory spares the flush, most hosts only have coherent types
+    gpu_memory_request_t request = {
+        .required  = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        .preferred = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    };
+
+    if (!gpu_memory_create_buffer(alloc,
+                                  memory,
+                                  device_info,
+                                  &buffer_info,
+                                  &request,
+                                  &staging->buffer,
+                                  &staging->allocation)
+        || !staging->allocation.mapped)
+    {
+        log_error(LOG_MEMORY, "failed to create the staging ring\n");
+        staging_destroy(staging, device_info);
+        return NULL;
+    }
+
+    VkCommandPoolCreateInfo pool_info = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = device_info->queues[QUEUE_TRANSFER].family,
+    };
+
+    for (uint32_t i = 0; i < STAGING_MAX_BATCHES; i++)
+    {
+        staging_batch_t* batch = &staging->batches[i];
+
+        VkCommandBufferAllocateInfo buffer_alloc_info = {
+            .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+
+        if (vkCreateCommandPool(device_info->device,
+                                &pool_info,
+                                nullptr,
+                                &batch->command_pool)
+            != VK_SUCCESS)
+        {
+            log_error(
+                LOG_MEMORY, "failed to create staging command pool %u\n", i);
+            staging_destroy(staging, device_info);
+            return NULL;
+        }
+
+        buffer_alloc_info.commandPool = batch->command_pool;
+        if (vkAllocateCommandBuffers(device_info->device,
+                                     &buffer_alloc_info,
+                                     &batch->command_buffer)
+            != VK_SUCCESS)
+        {
+            log_error(LOG_MEMORY,
+                      "failed to allocate staging command buffer %u\n",
+                      i);
+            staging_destroy(staging, device_info);
+            return NULL;
+        }
+    }
+
+    return staging;
+}
+
+// Frees the ring space of every batch that completed, oldest first
+static void staging__reclaim(staging_t* staging, device_info_t* device_info)
+{
+    while (staging->in_flight)
+    {
+        staging_batch_t* batch = &staging->batches[staging->oldest];
+        if (!queue_ticket_done(device_info, batch->ticket))
+        {
+            return;
+        }
+
+        staging->tail   = batch->end;
+        batch->ticket   = (queue_ticket_t) { 0 };
+        staging->oldest = (staging->oldest + 1) % STAGING_MAX_BATCHES;
+        staging->in_flight--;
+    }
+}
+
+static bool staging__wait_oldest(staging_t* staging, device_info_t* device_info)
+{
+    if (!staging->in_flight)
+    {
+        return false;
+    }
+
+    staging_batch_t* batch = &staging->batches[staging->oldest];
+    if (!queue_wait_ticket(device_info, batch->ticket, UINT64_MAX))
+    {
+        return false;
+    }
+
+    staging__reclaim(staging, device_info);
+    return true;
+}
+
+// Submits the open batch, if anything was recorded into it
+static bool staging__submit(staging_t* staging, device_info_t* device_info)
+{
+    staging_batch_t* batch = &staging->batches[staging->open];
+    if (!batch->recording)
+    {
+        return true;
+    }
+
+    batch->recording = false;
+    if (vkEndCommandBuffer(batch->command_buffer) != VK_SUCCESS)
+    {
+        return false;
+    }
+
+    gpu_memory_flush(device_info, &staging->allocation);
+
+    queue_submit_t submit = {
+        .command_buffers      = &batch->command_buffer,
+        .command_buffer_count = 1,
+    };
+
+    batch->ticket = queue_submit(device_info, QUEUE_TRANSFER, &submit);
+    if (batch->ticket.value == 0)
+    {
+        return false;
+    }
+
+    batch->end       = staging->head;
+    staging->pending = batch->ticket;
+    staging->open    = (staging->open + 1) % STAGING_MAX_BATCHES;
+    staging->in_flight++;
+    return true;
+}
+
+// The open batch's command buffer, begun on first use
+static VkCommandBuffer staging__command_buffer(staging_t*     staging,
+                                               device_info_t* device_info)
+{
+    staging__reclaim(staging, device_info);
+
+    // every batch in flight, the next one is still owned by the GPU
+    if (staging->in_flight == STAGING_MAX_BATCHES
+        && !staging__wait_oldest(staging, device_info))
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    staging_batch_t* batch = &staging->batches[staging->open];
+    if (batch->recording)
+    {
+        return batch->command_buffer;
+    }
+
+    vkResetCommandPool(device_info->device, batch->command_pool, 0);
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    if (vkBeginCommandBuffer(batch->command_buffer, &begin_info) != VK_SUCCESS)
+    {
+        return VK_NULL_HANDLE;
+    }
+
+    batch->recording = true;
+    return batch->command_buffer;
+}
+
+// Reserves `size` bytes of the ring and copies `data` in, returns the
+// buffer offset or -1 if the upload can never fit
+static int64_t staging__write(staging_t*     staging,
+                              device_info_t* device_info,
+                              const void*    data,
+                              VkDeviceSize   size)
+{
+    if (size > staging->size)
+    {
+        log_error(LOG_MEMORY,
+                  "upload of %llu bytes exceeds the %llu byte staging ring\n",
+                  (unsigned long long) size,
+                  (unsigned long long) staging->size);
+        return -1;
+    }
+
+    while (true)
+    {
+        uint64_t start = (staging->head + staging->alignment - 1)
+                         / staging->alignment * staging->alignment;
+
+        // never straddle the end of the buffer
+        if (start % staging->size + size > staging->size)
+        {
+            start = (start / staging->size + 1) * staging->size;
+        }
+
+        if (start + size - staging->tail <= staging->size)
+        {
+            memcpy((char*) staging->allocation.mapped + start % staging->size,
+                   data,
+                   size);
+            staging->head = start + size;
+            return (int64_t) (start % staging->size);
+        }
+
+        staging__reclaim(staging, device_info);
+        if (start + size - staging->tail <= staging->size)
+        {
+            continue;
+        }
+
+        // the space is held by the batch being recorded, or by batches
+        // still executing
+        if (staging->in_flight == 0
+            && !staging__submit(staging, device_info))
+        {
+            return -1;
+        }
+        if (!staging__wait_oldest(staging, device_info))
+        {
+            return -1;
+        }
+    }
+}
+
+static bool staging__queue_acquire(staging_t*               staging,
+                                   const staging_acquire_t* acquire)
+{
+    allocator* alloc = staging->alloc;
+
+    if (staging->acquire_count == staging->acquire_capacity)
+    {
+        uint32_t capacity
+            = staging->acquire_capacity ? 2 * staging->acquire_capacity : 32;
+        staging_acquire_t* acquires = allocator_realloc(
+            alloc,
+            staging->acquires,
+            staging->acquire_capacity * sizeof(staging_acquire_t),
+            capacity * sizeof(staging_acquire_t));
+        if (!acquires)
+        {
+            return false;
+        }
+
+        staging->acquires         = acquires;
+        staging->acquire_capacity = capacity;
+    }
+
+    staging->acquires[staging->acquire_count++] = *acquire;
+    staging->pending_stages |= acquire->transfer.dst_stage;
+    return true;
+}
+
+// Copies `size` bytes of `data` to `dst` at `dst_offset`. The frame that
+// next calls staging_acquire sees the data from `dst_stage` on with
+// `dst_access`, e.g. VERTEX_ATTRIBUTE_INPUT and VERTEX_ATTRIBUTE_READ.
+bool staging_upload_buffer(staging_t*            staging,
+                           device_info_t*        device_info,
+                           VkBuffer              dst,
+                           VkDeviceSize          dst_offset,
+                           const void*           data,
+                           VkDeviceSize          size,
+                           VkPipelineStageFlags2 dst_stage,
+                           VkAccessFlags2        dst_access)
+{
+    int64_t offset = staging__write(staging, device_info, data, size);
+    if (offset < 0)
+    {
+        return false;
+    }
+
+    VkCommandBuffer command_buffer
+        = staging__command_buffer(staging, device_info);
+    if (!command_buffer)
+    {
+        return false;
+    }
+
+    VkBufferCopy region = {
+        .srcOffset = (VkDeviceSize) offset,
+        .dstOffset = dst_offset,
+        .size      = size,
+    };
+    vkCmdCopyBuffer(command_buffer, staging->buffer, dst, 1, &region);
+
+    staging_acquire_t acquire = {
+        .transfer = (queue_transfer_t) {
+            .src        = QUEUE_TRANSFER,
+            .src_stage  = VK_PIPELINE_STAGE_2_COPY_BIT,
+            .src_access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dst        = QUEUE_GRAPHICS,
+            .dst_stage  = dst_stage,
+            .dst_access = dst_access,
+        },
+        .buffer = dst,
+    };
+
+    queue_release_buffer(command_buffer, device_info, &acquire.transfer, dst);
+    return staging__queue_acquire(staging, &acquire);
+}
+
+// Uploads one region of `dst`, tightly packed in `data`. `region` describes
+// the image side, its buffer fields are filled in here. The whole
+// subresource range is left in `final_layout` for `dst_stage`/`dst_access`.
+bool staging_upload_image(staging_t*               staging,
+                          device_info_t*           device_info,
+                          VkImage                  dst,
+                          VkImageSubresourceRange  range,
+                          const VkBufferImageCopy* region,
+                          const void*              data,
+                          VkDeviceSize             size,
+                          VkImageLayout            final_layout,
+                          VkPipelineStageFlags2    dst_stage,
+                          VkAccessFlags2           dst_access)
+{
+    int64_t offset = staging__write(staging, device_info, data, size);
+    if (offset < 0)
+    {
+        return false;
+    }
+
+    VkCommandBuffer command_buffer
+        = staging__command_buffer(staging, device_info);
+    if (!command_buffer)
+    {
+        return false;
+    }
+
+    VkImageMemoryBarrier2 to_transfer = {
+        .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .srcStageMask        = VK_PIPELINE_STAGE_2_NONE,
+        .srcAccessMask       = VK_ACCESS_2_NONE,
+        .dstStageMask        = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image               = dst,
+        .subresourceRange    = range,
+    };
+
+    VkDependencyInfo dependency = {
+        .sType                   = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers    = &to_transfer,
+    };
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+
+    VkBufferImageCopy copy = *region;
+    copy.bufferOffset      = (VkDeviceSize) offset;
+    copy.bufferRowLength   = 0;
+    copy.bufferImageHeight = 0;
+    vkCmdCopyBufferToImage(command_buffer,
+                           staging->buffer,
+                           dst,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           1,
+                           &copy);
+
+    staging_acquire_t acquire = {
+        .transfer = (queue_transfer_t) {
+            .src        = QUEUE_TRANSFER,
+            .src_stage  = VK_PIPELINE_STAGE_2_COPY_BIT,
+            .src_access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dst        = QUEUE_GRAPHICS,
+            .dst_stage  = dst_stage,
+            .dst_access = dst_access,
+            .old_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .new_layout = final_layout,
+        },
+        .image = dst,
+        .range = range,
+    };
+
+    queue_release_image(
+        command_buffer, device_info, &acquire.transfer, dst, range);
+    return staging__queue_acquire(staging, &acquire);
+}
+
+// Submits the uploads recorded so far and records their acquire barriers
+// into `command_buffer`, at the start of a graphics frame. Returns what the
+// frame must wait for, a zero ticket when there were no uploads.
+queue_wait_t staging_acquire(staging_t*      staging,
+                             device_info_t*  device_info,
+                             VkCommandBuffer command_buffer)
+{
+    staging__reclaim(staging, device_info);
+
+    queue_wait_t wait = { 0 };
+    if (!staging__submit(staging, device_info))
+    {
+        log_error(LOG_MEMORY, "failed to submit staged uploads\n");
+        return wait;
+    }
+
+    for (uint32_t i = 0; i < staging->acquire_count; i++)
+    {
+        staging_acquire_t* acquire = &staging->acquires[i];
+        if (acquire->buffer)
+        {
+            queue_acquire_buffer(command_buffer,
+                                 device_info,
+                                 &acquire->transfer,
+                                 acquire->buffer);
+        }
+        else
+        {
+            queue_acquire_image(command_buffer,
+                                device_info,
+                                &acquire->transfer,
+                                acquire->image,
+                                acquire->range);
+        }
+    }
+
+    wait = (queue_wait_t) {
+        .ticket = staging->pending,
+        .stage  = staging->pending_stages
+                     ? staging->pending_stages
+                     : VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+    };
+
+    staging->acquire_count  = 0;
+    staging->pending        = (queue_ticket_t) { 0 };
+    staging->pending_stages = VK_PIPELINE_STAGE_2_NONE;
+    return wait;
+}
+
+#endif  // STAGING_H
@@ -8,6 +8,9 @@
 
 #define GLFW_INCLUDE_VULKAN
 #include "prelude.h"
+#include "log.h"
+#include "device.h"
+#include "gpu_memory.h"
 #include "GLFW/glfw3.h"
 
 typedef enum
@@ -18,9 +21,20 @@ typedef enum
     SURFACE_FORMAT_NOT_FOUND,
     SURFACE_PRESENT_MODE_NOT_FOUND,
     SURFACE_SWAPCHAIN_CREATION_FAILED,
-    SURFACE_SWAPCHAIN_IMAGES_NOT_FOUND
+    SURFACE_SWAPCHAIN_IMAGES_NOT_FOUND,
+    SURFACE_MINIMIZED
 } surface_status_t;
 
+// How images reach the screen. A mode the surface lacks falls back to the
+// next lowest latency one it has, FIFO is always available.
+typedef enum
+{
+    PRESENT_MAILBOX,       // newest frame at vblank, no tearing, GPU uncapped
+    PRESENT_VSYNC,         // FIFO, capped to the refresh rate
+    PRESENT_IMMEDIATE,     // no vblank wait, may tear, lowest latency
+    PRESENT_FIFO_RELAXED,  // FIFO, tears instead of stuttering when late
+} present_policy_t;
+
 
 GLFWwindow* make_window()
 {
@@ -35,6 +49,10 @@ string_array_t* get_glfw_extensions(allocator* alloc)
     const char** glfw_extensions = glfwGetRequiredInstanceExtensions(&count);
 
     string_array_t* extensions = make_string_array(alloc, count + 1);
+    if (!extensions)
+    {
+        return NULL;
+    }
 
     for (uint32_t i = 0; i < count; i++)
     {
@@ -45,28 +63,268 @@ string_array_t* get_glfw_extensions(allocator* alloc)
     return extensions;
 }
 
+// Written by the GLFW callbacks, heap allocated so the window user pointer
+// stays valid while surface_info_t is copied around by value
 typedef struct
 {
-    surface_status_t status;
-    GLFWwindow*      window;
+    bool resized;
+} surface_events_t;
+
+typedef struct
+{
+    surface_status_t  status;
+    GLFWwindow*       window;
+    surface_events_t* events;
 
     VkSurfaceKHR   surface;
     VkSwapchainKHR swapchain;
 
-    VkFormat   image_format;
-    VkExtent2D extent;
+    // chosen once, recreating the swapchain only re-reads the capabilities
+    VkFormat          image_format;
+    VkColorSpaceKHR   color_space;
+    VkPresentModeKHR  present_mode;
+    VkImageUsageFlags image_usage;
+    VkExtent2D        extent;
+
+    // 0 = one more than the surface minimum, clamped to what it supports
+    uint32_t requested_image_count;
 
     uint32_t     image_count;
     VkImage*     images;
     VkImageView* views;
+
+    // backing for offscreen targets, NULL for swapchain images
+    gpu_allocation_t* image_allocations;
 } surface_info_t;
 
-surface_info_t create_surface(allocator*    alloc,
-                              VkInstance    instance,
-                              device_info_t device_info)
+static void surface__framebuffer_resized(GLFWwindow* window,
+                                         int         width,
+                                         int         height)
+{
+    (void) width;
+    (void) height;
+
+    surface_events_t* events = glfwGetWindowUserPointer(window);
+    events->resized          = true;
+}
+
+// Builds a swapchain for the surface's current size, handing the existing
+// one (if any) to the driver as oldSwapchain. On success the swapchain,
+// extent, images and views in `surface` are replaced and the caller owns the
+// old ones; on failure `surface` is left untouched.
+static surface_status_t surface__create_swapchain(
+    allocator*           alloc,
+    const device_info_t* device_info,
+    surface_info_t*      surface)
+{
+    VkSurfaceCapabilitiesKHR surface_capabilities;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device_info->physical_device,
+                                              surface->surface,
+                                              &surface_capabilities);
+
+    VkExtent2D extent = surface_capabilities.currentExtent;
+    if (extent.width == UINT32_MAX)
+    {
+        int width, height;
+        glfwGetFramebufferSize(surface->window, &width, &height);
+
+        extent.width  = clamp(width,
+                             surface_capabilities.minImageExtent.width,
+                             surface_capabilities.maxImageExtent.width);
+        extent.height = clamp(height,
+                              surface_capabilities.minImageExtent.height,
+                              surface_capabilities.maxImageExtent.height);
+    }
+
+    // a minimized window has nothing to present to
+    if (extent.width == 0 || extent.height == 0)
+    {
+        return SURFACE_MINIMIZED;
+    }
+
+    uint32_t image_count = surface->requested_image_count;
+    if (image_count == 0)
+    {
+        image_count = surface_capabilities.minImageCount + 1;
+    }
+    if (image_count < surface_capabilities.minImageCount)
+    {
+        image_count = surface_capabilities.minImageCount;
+    }
+    if (surface_capabilities.maxImageCount != 0
+        && image_count > surface_capabilities.maxImageCount)
+    {
+        image_count = surface_capabilities.maxImageCount;
+    }
+
+    VkSwapchainCreateInfoKHR create_info = {
+        .sType            = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        .pNext            = NULL,
+        .surface          = surface->surface,
+        .minImageCount    = image_count,
+        .imageFormat      = surface->image_format,
+        .imageColorSpace  = surface->color_space,
+        .imageExtent      = extent,
+        .imageArrayLayers = 1,
+        .imageUsage       = surface->image_usage,
+        .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .preTransform     = surface_capabilities.currentTransform,
+        .compositeAlpha   = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        .presentMode      = surface->present_mode,
+        .clipped          = VK_TRUE,
+        .oldSwapchain     = surface->swapchain,
+    };
+
+    VkDevice       device    = device_info->device;
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+
+    VkResult res
+        = vkCreateSwapchainKHR(device, &create_info, nullptr, &swapchain);
+    if (res != VK_SUCCESS)
+    {
+        log_error(LOG_SURFACE, "failed to create swapchain object\n");
+        return SURFACE_SWAPCHAIN_CREATION_FAILED;
+    }
+
+    // the driver may create more images than minImageCount asked for
+    res = vkGetSwapchainImagesKHR(device, swapchain, &image_count, NULL);
+    if (res != VK_SUCCESS)
+    {
+        vkDestroySwapchainKHR(device, swapchain, nullptr);
+        return SURFACE_SWAPCHAIN_IMAGES_NOT_FOUND;
+    }
+
+    VkImage* images = alloc->malloc(
+        (ptrdiff_t) (image_count * sizeof(VkImage)), alloc->ctx);
+    VkImageView* views = alloc->malloc(
+        (ptrdiff_t) (image_count * sizeof(VkImageView)), alloc->ctx);
+    if (!images || !views
+        || vkGetSwapchainImagesKHR(device, swapchain, &image_count, images)
+               != VK_SUCCESS)
+    {
+        alloc->free(images, alloc->ctx);
+        alloc->free(views, alloc->ctx);
+        vkDestroySwapchainKHR(device, swapchain, nullptr);
+        return SURFACE_SWAPCHAIN_IMAGES_NOT_FOUND;
+    }
+
+    VkImageViewCreateInfo view_info = {
+        .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .viewType         = VK_IMAGE_VIEW_TYPE_2D,
+        .format           = surface->image_format,
+        .components       = (VkComponentMapping) {
+            VK_COMPONENT_SWIZZLE_IDENTITY,
+            VK_COMPONENT_SWIZZLE_IDENTITY,
+            VK_COMPONENT_SWIZZLE_IDENTITY,
+            VK_COMPONENT_SWIZZLE_IDENTITY,
+        },
+        .subresourceRange = (VkImageSubresourceRange) {
+            .aspectMask       = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = 0,
+            .levelCount      = 1,
+            .baseArrayLayer  = 0,
+            .layerCount = 1,
+        }
+    };
+
+    for (uint32_t i = 0; i < image_count; i++)
+    {
+        view_info.image = images[i];
+        // todo add error handling ?
+        vkCreateImageView(device, &view_info, nullptr, &views[i]);
+    }
+
+    surface->swapchain   = swapchain;
+    surface->extent      = extent;
+    surface->image_count = image_count;
+    surface->images      = images;
+    surface->views       = views;
+
+    return SURFACE_OK;
+}
+
+static VkPresentModeKHR surface__choose_present_mode(
+    present_policy_t        policy,
+    const VkPresentModeKHR* modes,
+    uint32_t                count)
+{
+    // preference order per policy, each ends in the always supported FIFO
+    static const VkPresentModeKHR preferences[][3] = {
+        [PRESENT_MAILBOX]      = { VK_PRESENT_MODE_MAILBOX_KHR,
+                                   VK_PRESENT_MODE_FIFO_KHR },
+        [PRESENT_VSYNC]        = { VK_PRESENT_MODE_FIFO_KHR },
+        [PRESENT_IMMEDIATE]    = { VK_PRESENT_MODE_IMMEDIATE_KHR,
+                                   VK_PRESENT_MODE_MAILBOX_KHR,
+                                   VK_PRESENT_MODE_FIFO_KHR },
+        [PRESENT_FIFO_RELAXED] = { VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+                                   VK_PRESENT_MODE_FIFO_KHR },
+    };
+
+    if ((uint32_t) policy > PRESENT_FIFO_RELAXED)
+    {
+        policy = PRESENT_MAILBOX;
+    }
+
+    const VkPresentModeKHR* wanted = preferences[policy];
+    for (uint32_t p = 0; p < 3; p++)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (modes[i] == wanted[p])
+            {
+                if (p != 0)
+                {
+                    log_warn(LOG_SURFACE,
+                             "present mode %d unavailable, using %d\n",
+                             wanted[0],
+                             wanted[p]);
+                }
+
+                return wanted[p];
+            }
+        }
+
+        if (wanted[p] == VK_PRESENT_MODE_FIFO_KHR)
+        {
+            break;
+        }
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+// Swapchain images and views are owned by `alloc`, the format and present
+// mode queries are transient and come from `scratch`. `image_count` of 0
+// picks one more than the surface minimum. `window` comes from make_window,
+// so it can be opened while the device is still being created, NULL opens
+// one here.
+surface_info_t create_surface(allocator*       alloc,
+                              allocator*       scratch,
+                              VkInstance       instance,
+                              device_info_t    device_info,
+                              GLFWwindow*      window,
+                              present_policy_t present_policy,
+                              uint32_t         image_count)
 {
     surface_info_t surface_info = { 0 };
-    surface_info.window         = make_window();
+    surface_info.window         = window ? window : make_window();
+    if (!surface_info.window)
+    {
+        surface_info.status = SURFACE_CREATION_FAILED;
+        return surface_info;
+    }
+
+    surface_info.events = alloc->malloc(sizeof(surface_events_t), alloc->ctx);
+    if (!surface_info.events)
+    {
+        surface_info.status = SURFACE_CREATION_FAILED;
+        return surface_info;
+    }
+
+    *surface_info.events = (surface_events_t) { 0 };
+    glfwSetWindowUserPointer(surface_info.window, surface_info.events);
+    glfwSetFramebufferSizeCallback(surface_info.window,
+                                   surface__framebuffer_resized);
 
     VkResult res = glfwCreateWindowSurface(
         instance, surface_info.window, NULL, &surface_info.surface);
@@ -90,8 +348,14 @@ surface_info_t create_surface(allocator*    alloc,
         return surface_info;
     }
 
-    VkSurfaceFormatKHR* surface_formats = alloc->malloc(
-        surface_format_count * sizeof(VkSurfaceFormatKHR), alloc->ctx);
+    VkSurfaceFormatKHR* surface_formats = scratch->malloc(
+        surface_format_count * sizeof(VkSurfaceFormatKHR), scratch->ctx);
+    if (!surface_formats)
+    {
+        surface_info.status = SURFACE_FORMAT_NOT_FOUND;
+        return surface_info;
+    }
+
     vkGetPhysicalDeviceSurfaceFormatsKHR(device_info.physical_device,
                                          surface_info.surface,
                                          &surface_format_count,
@@ -112,32 +376,10 @@ surface_info_t create_surface(allocator*    alloc,
 
     if (choosen_surface_format.format == VK_FORMAT_UNDEFINED)
     {
-        printf("could not find the surface format we want");
+        log_error(LOG_SURFACE, "could not find the surface format we want\n");
         choosen_surface_format = surface_formats[0];
     }
 
-    // find swapchain extents
-    VkSurfaceCapabilitiesKHR surface_capabilities;
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device_info.physical_device,
-                                              surface_info.surface,
-                                              &surface_capabilities);
-
-    int width, height;
-    glfwGetFramebufferSize(surface_info.window, &width, &height);
-
-    width  = clamp(width,
-                  surface_capabilities.minImageExtent.width,
-                  surface_capabilities.maxImageExtent.width);
-    height = clamp(height,
-                   surface_capabilities.minImageExtent.height,
-                   surface_capabilities.maxImageExtent.height);
-
-    uint32_t image_count = surface_capabilities.minImageCount + 1;
-    if (image_count > surface_capabilities.maxImageCount)
-    {
-        image_count = surface_capabilities.maxImageCount;
-    }
-
     // choose present mode
     uint32_t present_mode_count;
     vkGetPhysicalDeviceSurfacePresentModesKHR(device_info.physical_device,
@@ -150,108 +392,101 @@ surface_info_t create_surface(allocator*    alloc,
         return surface_info;
     }
 
-    VkPresentModeKHR* present_modes = alloc->malloc(
-        present_mode_count * sizeof(VkPresentModeKHR), alloc->ctx);
+    VkPresentModeKHR* present_modes = scratch->malloc(
+        present_mode_count * sizeof(VkPresentModeKHR), scratch->ctx);
+    if (!present_modes)
+    {
+        surface_info.status = SURFACE_PRESENT_MODE_NOT_FOUND;
+        return surface_info;
+    }
+
     vkGetPhysicalDeviceSurfacePresentModesKHR(device_info.physical_device,
                                               surface_info.surface,
                                               &present_mode_count,
                                               present_modes);
 
-    VkPresentModeKHR choosen_present_mode = VK_PRESENT_MODE_FIFO_KHR;
-    for (uint32_t i = 0; i < present_mode_count; i++)
+    VkPresentModeKHR choosen_present_mode = surface__choose_present_mode(
+        present_policy, present_modes, present_mode_count);
+
+    // frames are cleared with a transfer until there is a render pass
+    VkSurfaceCapabilitiesKHR surface_capabilities;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device_info.physical_device,
+                                              surface_info.surface,
+                                              &surface_capabilities);
+
+    VkImageUsageFlags image_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (surface_capabilities.supportedUsageFlags
+        & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
     {
-        if (present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR)
-        {
-            choosen_present_mode = present_modes[i];
-            break;
-        }
+        image_usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     }
 
+    surface_info.image_format = choosen_surface_format.format;
+    surface_info.color_space  = choosen_surface_format.colorSpace;
+    surface_info.present_mode = choosen_present_mode;
+    surface_info.image_usage  = image_usage;
 
-    VkSwapchainCreateInfoKHR create_info = {
-        .sType            = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-        .pNext            = NULL,
-        .surface          = surface_info.surface,
-        .minImageCount    = image_count,
-        .imageFormat      = choosen_surface_format.format,
-        .imageColorSpace  = choosen_surface_format.colorSpace,
-        .imageExtent      = (VkExtent2D) { width, height },
-        .imageArrayLayers = 1,
-        .imageUsage       = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-        .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
-        .preTransform     = surface_capabilities.currentTransform,
-        .compositeAlpha   = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-        .presentMode      = choosen_present_mode,
-        .clipped          = VK_TRUE,
-        .oldSwapchain     = VK_NULL_HANDLE,
-    };
+    surface_info.requested_image_count = image_count;
 
-    res = vkCreateSwapchainKHR(
-        device_info.device, &create_info, nullptr, &surface_info.swapchain);
-    if (res != VK_SUCCESS)
-    {
-        printf("failed to create swapchain object\n");
-        surface_info.status = SURFACE_SWAPCHAIN_CREATION_FAILED;
-        return surface_info;
-    }
+    surface_info.status
+        = surface__create_swapchain(alloc, &device_info, &surface_info);
 
-    res = vkGetSwapchainImagesKHR(device_info.device,
-                                  surface_info.swapchain,
-                                  &surface_info.image_count,
-                                  NULL);
-    if (res != VK_SUCCESS)
-    {
-        surface_info.status = SURFACE_SWAPCHAIN_IMAGES_NOT_FOUND;
-        return surface_info;
-    }
+    return surface_info;
+}
 
-    surface_info.images
-        = alloc->malloc(image_count * sizeof(VkImage), alloc->ctx);
-    res = vkGetSwapchainImagesKHR(device_info.device,
-                                  surface_info.swapchain,
-                                  &image_count,
-                                  surface_info.images);
-    if (res != VK_SUCCESS)
+// Replaces the swapchain after a resize or an out-of-date acquire/present.
+// The old swapchain is passed as oldSwapchain so the driver can hand its
+// resources over; it and its images and views are returned in `retired`
+// instead of destroyed, since frames still in flight may reference them.
+// SURFACE_MINIMIZED leaves everything as it was and keeps `resized` set,
+// update_surface then waits for the window to be restored.
+surface_status_t recreate_swapchain(allocator*           alloc,
+                                    const device_info_t* device_info,
+                                    surface_info_t*      surface,
+                                    surface_info_t*      retired)
+{
+    surface_info_t old = *surface;
+
+    surface_status_t status
+        = surface__create_swapchain(alloc, device_info, surface);
+    if (status != SURFACE_OK)
     {
-        surface_info.status = SURFACE_SWAPCHAIN_IMAGES_NOT_FOUND;
-        return surface_info;
+        return status;
     }
 
-    VkImageViewCreateInfo view_info = {
-        .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-        .viewType         = VK_IMAGE_VIEW_TYPE_2D,
-        .format           = choosen_surface_format.format,
-        .components       = (VkComponentMapping) {
-            VK_COMPONENT_SWIZZLE_IDENTITY,
-            VK_COMPONENT_SWIZZLE_IDENTITY,
-            VK_COMPONENT_SWIZZLE_IDENTITY,
-            VK_COMPONENT_SWIZZLE_IDENTITY,
-        },
-        .subresourceRange = (VkImageSubresourceRange) {
-            .aspectMask       = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = 0,
-            .levelCount      = 1,
-            .baseArrayLayer  = 0,
-            .layerCount = 1,
-        }
-    };
+    surface->events->resized = false;
+    *retired                 = old;
 
-    surface_info.views
-        = alloc->malloc(image_count * sizeof(VkImageView), alloc->ctx);
-    for (uint32_t i = 0; i < image_count; i++)
+    return SURFACE_OK;
+}
+
+// Frees what recreate_swapchain retired. Only the swapchain, its views and
+// the image arrays belong to it, the window and surface are still live.
+void destroy_retired_swapchain(allocator*           alloc,
+                               const device_info_t* device_info,
+                               surface_info_t*      retired)
+{
+    for (uint32_t i = 0; i < retired->image_count; i++)
     {
-        view_info.image = surface_info.images[i];
-        // todo add error handling ?
-        vkCreateImageView(
-            device_info.device, &view_info, nullptr, &surface_info.views[i]);
+        vkDestroyImageView(device_info->device, retired->views[i], nullptr);
     }
 
-    surface_info.image_format = choosen_surface_format.format;
-    surface_info.extent       = (VkExtent2D) { width, height };
+    vkDestroySwapchainKHR(device_info->device, retired->swapchain, nullptr);
 
-    return surface_info;
+    alloc->free(retired->images, alloc->ctx);
+    alloc->free(retired->views, alloc->ctx);
+
+    *retired = (surface_info_t) { 0 };
 }
 
+bool surface_resized(const surface_info_t* surface)
+{
+    return surface->events && surface->events->resized;
+}
+
+// Polls window events. A minimized window has nothing to present to, so this
+// blocks in glfwWaitEvents until it is restored or closed rather than letting
+// the frame loop retry the swapchain every iteration.
 surface_status_t update_surface(surface_info_t* surface)
 {
     if (glfwWindowShouldClose(surface->window))
@@ -261,6 +496,20 @@ surface_status_t update_surface(surface_info_t* surface)
 
     glfwPollEvents();
 
+    int width, height;
+    glfwGetFramebufferSize(surface->window, &width, &height);
+    while ((width == 0 || height == 0)
+           && !glfwWindowShouldClose(surface->window))
+    {
+        glfwWaitEvents();
+        glfwGetFramebufferSize(surface->window, &width, &height);
+    }
+
+    if (glfwWindowShouldClose(surface->window))
+    {
+        return SURFACE_SHOULD_CLOSE;
+    }
+
     return SURFACE_OK;
 }
 
@@ -278,6 +527,7 @@ void destroy_surface(allocator*      alloc,
 
     alloc->free(surface->images, alloc->ctx);
     alloc->free(surface->views, alloc->ctx);
+    alloc->free(surface->events, alloc->ctx);
 
     vkDestroySurfaceKHR(instance, surface->surface, nullptr);
 
@@ -0,0 +1,116 @@
+//
+// Validation layer messages.
+//
+// The debug messenger callback runs on whatever thread made the offending
+// Vulkan call, including drivers' own threads and job workers. It hands the
+// message to the logger (see log.h) under LOG_VALIDATION, which copies it into
+// the calling thread's ring and returns without touching stdio.
+//
+
+#ifndef VALIDATION_H
+#define VALIDATION_H
+
+#include <vulkan/vulkan_core.h>
+
+#include "prelude.h"
+#include "log.h"
+
+typedef enum
+{
+    VALIDATION_AUTO,  // on in DEBUG builds when the layer is installed
+    VALIDATION_ON,    // init fails without the layer
+    VALIDATION_OFF
+} validation_mode_t;
+
+static const char* validation__type_name(VkDebugUtilsMessageTypeFlagsEXT type)
+{
+    if (type & VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT)
+    {
+        return "validation";
+    }
+    if (type & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT)
+    {
+        return "performance";
+    }
+    return "general";
+}
+
+static VKAPI_ATTR VkBool32 VKAPI_CALL
+validation__callback(VkDebugUtilsMessageSeverityFlagBitsEXT      severity,
+                     VkDebugUtilsMessageTypeFlagsEXT             type,
+                     const VkDebugUtilsMessengerCallbackDataEXT* data,
+                     void*                                       user_data)
+{
+    (void) user_data;
+
+    log_level_t level
+        = severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT ? LOG_ERROR
+        : severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT
+            ? LOG_WARN
+            : LOG_INFO;
+
+    log_write(level,
+              LOG_VALIDATION,
+              "%s: %s",
+              validation__type_name(type),
+              data->pMessage ? data->pMessage : "");
+    return VK_FALSE;
+}
+
+bool create_debug_utils_messenger(VkInstance                instance,
+                                  VkDebugUtilsMessengerEXT* debug_messenger)
+{
+    VkDebugUtilsMessengerCreateInfoEXT create_info = { 0 };
+    create_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+
+    create_info.messageSeverity
+        = VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT
+          | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+
+    create_info.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT
+                              | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT
+                              | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+
+    create_info.pfnUserCallback = validation__callback;
+
+    PFN_vkCreateDebugUtilsMessengerEXT pfnCreateDebugUtilsMessengerEXT
+        = (PFN_vkCreateDebugUtilsMessengerEXT) vkGetInstanceProcAddr(
+            instance, "vkCreateDebugUtilsMessengerEXT");
+    if (pfnCreateDebugUtilsMessengerEXT == NULL)
+    {
+        log_error(LOG_VALIDATION, "failed to register debug callback\n");
+        return false;
+    }
+
+    VkResult res = pfnCreateDebugUtilsMessengerEXT(
+        instance, &create_info, nullptr, debug_messenger);
+    if (res)
+    {
+        log_error(
+            LOG_VALIDATION, "failed to create debug messenger %d\n", res);
+        return false;
+    }
+
+    return true;
+}
+
+void destroy_debug_utils_messenger(VkInstance               instance,
+                                   VkDebugUtilsMessengerEXT debug_messenger)
+{
+    if (debug_messenger == VK_NULL_HANDLE)
+    {
+        return;
+    }
+
+    PFN_vkDestroyDebugUtilsMessengerEXT pfnDestroyDebugUtilsMessengerEXT
+        = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(
+            instance, "vkDestroyDebugUtilsMessengerEXT");
+    if (pfnDestroyDebugUtilsMessengerEXT == NULL)
+    {
+        return;
+    }
+
+    pfnDestroyDebugUtilsMessengerEXT(instance, debug_messenger, nullptr);
+}
+
+#endif  // VALIDATION_H
@@ -2,9 +2,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define ZERUS_CORE_IMPLEMENTATION
 #include "engine/core.h"
+#include "engine/log.h"
+#include "engine/pool.h"
 
 
 #include <cglm/cglm.h>
@@ -23,31 +26,91 @@ static void std_free(void* ptr, void* ctx)
     free(ptr);
 }
 
+static void* std_realloc(void*     ptr,
+                         ptrdiff_t old_size,
+                         ptrdiff_t new_size,
+                         void*     ctx)
+{
+    (void) old_size;
+    (void) ctx;
+    return realloc(ptr, new_size);
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+            "usage: %s [--device NAME|UUID] [--headless] [--frames N] "
+            "[--capture DIR]\n"
+            "  --device       GPU to use, a name substring or device UUID\n"
+            "  --headless     render offscreen, no window or display\n"
+            "  --frames N     exit after N frames\n"
+            "  --capture DIR  write headless frames to DIR as PPM\n",
+            program);
+}
+
 int main(int argc, char* argv[])
 {
-    (void) argc;  // Suppress unused parameter warning
-    (void) argv;
+    zerus_engine_config_t config = { 0 };
 
-    printf("Zerus Game Engine v1.0.0\n");
-    printf("Initializing engine...\n");
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+        {
+            config.device = argv[++i];
+        }
+        else if (strcmp(argv[i], "--headless") == 0)
+        {
+            config.headless = true;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            config.frame_count = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+        {
+            config.capture_dir = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    allocator std_alloc = { std_malloc, std_free, NULL };
+    log_info(LOG_CORE, "Zerus Game Engine v1.0.0\n");
+    log_info(LOG_CORE, "Initializing engine...\n");
 
-    glfwInit();
+    allocator std_alloc = { .malloc  = std_malloc,
+                            .free    = std_free,
+                            .realloc = std_realloc,
+                            .ctx     = NULL };
 
-    zerus_engine_state_t engine = zerus_engine_init(&std_alloc);
+    // engine objects come from size-class pools instead of libc malloc
+    static pool_t pool;
+    if (!pool_init(&pool, &std_alloc))
+    {
+        log_error(LOG_CORE, "Failed to initialize pool allocator\n");
+        return EXIT_FAILURE;
+    }
+    allocator engine_alloc = pool_allocator(&pool);
+
+    zerus_engine_state_t engine = zerus_engine_init(&engine_alloc, &config);
 
     if (!engine.initialized)
     {
-        fprintf(stderr, "Failed to initialize engine\n");
+        log_error(LOG_CORE, "Failed to initialize engine\n");
+        pool_destroy(&pool);
         return EXIT_FAILURE;
     }
 
-    printf("Engine initialized successfully\n");
+    log_info(LOG_CORE, "Engine initialized successfully\n");
 
     // Update engine systems
     zerus_engine_start(&engine);
 
-    printf("Engine shutdown complete\n");
+    pool_print_stats(&pool);
+    pool_destroy(&pool);
+
+    log_info(LOG_CORE, "Engine shutdown complete\n");
     return EXIT_SUCCESS;
 }